@@ -3,7 +3,7 @@
    - Runs in any standard console/terminal.
    - No external libraries (like ncurses) needed.
    - Patient intake (disease + doctor) is a single, unified workflow.
-   - Robust integer input and efficient qsort.
+   - Robust integer input and indexed lookups by ID and name.
 
    --- HOW TO COMPILE ---
    gcc hospital.c -o hospital
@@ -12,22 +12,65 @@
    ./hospital
 */
 
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L // For fileno/fsync under strict -std=c99
+#endif
+
 #include <stdio.h>
 #include <stdlib.h> // Added for qsort, atoi, strtol
 #include <string.h>
+#include <stddef.h> // For offsetof
 #include <ctype.h>
 #include <errno.h> // For checking strtol errors
 #include <limits.h> // For INT_MAX, INT_MIN
+#include <time.h>   // For clock
+#include <stdarg.h> // For the output buffer
+#include <stdint.h> // For intptr_t
 
 #ifdef _WIN32
-#include <windows.h> // For "cls"
+#include <windows.h> // For the console API
+#include <io.h>      // For _commit, _isatty
+#else
+#include <unistd.h>  // For fsync
+#include <sys/mman.h> // For mmap
+#include <sys/socket.h> // For service mode
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>  // For getaddrinfo (replicas)
+#include <sys/time.h> // For socket timeouts
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>  // For sched_yield
+#include <sys/wait.h> // For benchmark mode
+#define HAVE_MMAP
+#define HAVE_SOCKETS
+#define HAVE_THREADS
+#define HAVE_FORK
 #endif
 
 /* --------------------- CONSTANTS --------------------- */
-#define MAX_PATIENTS 500
-#define MAX_DISEASES 200 // For the reference database
-#define MAX_DOCTORS 100
-#define MAX_APPOINTS 1000
+// Records are stored in fixed-size chunks (see RECORD STORES below).
+// A chunk is only allocated once its first record is added.
+#define STORE_CHUNK_SHIFT 8
+#define STORE_CHUNK_SIZE (1 << STORE_CHUNK_SHIFT) // Records per chunk
+#define STORE_CHUNK_MASK (STORE_CHUNK_SIZE - 1)
+// Deleted records are tombstoned and swept out later, once at least
+// STORE_COMPACT_MIN of them have piled up and they make up 1/4 of a store
+#define STORE_COMPACT_MIN 64
+
+#define DATA_FILE "hospital_data.bin"
+#define JOURNAL_FILE "hospital_data.jnl" // Mutations since the last save
+#define JOURNAL_OLD_FILE "hospital_data.jnl.old" // Mutations an autosave in progress covers
+#define SNAPSHOT_TEMP_FILE DATA_FILE ".tmp" // A save being written, renamed over DATA_FILE once complete
+#define SNAPSHOT_DAMAGED_FILE DATA_FILE ".damaged" // Where an unloadable DATA_FILE is moved aside
+#define SNAPSHOT_GENERATIONS 2 // Replaced save files kept by default (DATA_FILE.1 and .2)
+#define REPLICA_POSITION_FILE "hospital_data.rep" // Where a replica's data stands in its primary's stream
+#define REPLICA_SEND_FILE DATA_FILE ".send" // A snapshot a primary is sending to a replica
+#define REPLICA_RECEIVE_FILE DATA_FILE ".recv" // A snapshot a replica is receiving
+#define ARCHIVE_FILE "hospital_data.arc" // Appointments of closed days, compressed (see ARCHIVE)
+#define REPLICA_ARCHIVE_FILE ARCHIVE_FILE ".recv" // The primary's archive, received with a snapshot
 
 /* --------------------- ANSI COLORS (Optional) --------------------- */
 #define RESET_COLOR "\x1B[0m"
@@ -39,6 +82,11 @@
 #define CYAN "\x1B[36m"
 
 /* --------------------- STRUCTS --------------------- */
+// Patient and Appointment are the row form of a record: what intake
+// fills in, what the journal encodes, and the record layout of version 1
+// and 2 data files. Stored patients and appointments are split into
+// columns instead (see TABLES), and repeated values such as gender,
+// disease and specialization are interned (see INTERNED STRINGS).
 
 typedef struct {
     int id;
@@ -72,31 +120,931 @@ typedef struct {
     char time[10]; // "HH:MM"
 } Appointment;
 
+/* --------------------- CHECKSUMS --------------------- */
+
+// Standard CRC-32 (IEEE 802.3), table driven; pass 0 to start
+unsigned crc32Update(unsigned crc, const void *data, size_t len) {
+    static unsigned table[256];
+    if (table[1] == 0) {
+        for (unsigned i = 0; i < 256; i++) {
+            unsigned c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    const unsigned char *p = data;
+    crc = ~crc;
+    while (len--) crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* --------------------- PARALLEL TASKS --------------------- */
+// Saving, checking and indexing large tables is split into independent
+// tasks that run on one thread per core (HMS_THREADS in the environment
+// sets the count). A task may read anything but writes only its own
+// output; a task may run tasks of its own. Where threads are unavailable
+// the tasks run one after another.
+
+#define TASK_MAX_THREADS 32
+
+typedef struct {
+    void (*fn)(void *arg, int task);
+    void *arg;
+    int count;
+    int next; // next task to claim
+} TaskSet;
+
+// Threads a task set may use
+int taskThreads() {
+    static int n = 0;
+    if (n) return n;
+    const char *env = getenv("HMS_THREADS");
+    int want = env ? atoi(env) : 0;
+#ifdef HAVE_THREADS
+    if (want <= 0) want = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (want < 1) want = 1;
+    if (want > TASK_MAX_THREADS) want = TASK_MAX_THREADS;
+    return n = want;
+}
+
+static void* taskWorker(void *arg) {
+    TaskSet *ts = arg;
+    int t;
+    while ((t = __atomic_fetch_add(&ts->next, 1, __ATOMIC_RELAXED)) < ts->count) ts->fn(ts->arg, t);
+    return NULL;
+}
+
+// Runs fn(arg, 0) .. fn(arg, count - 1) and returns once all are done
+void runTasks(int count, void (*fn)(void *arg, int task), void *arg) {
+    TaskSet ts = { fn, arg, count, 0 };
+#ifdef HAVE_THREADS
+    pthread_t threads[TASK_MAX_THREADS];
+    int want = (count < taskThreads() ? count : taskThreads()) - 1, started = 0;
+    while (started < want && pthread_create(&threads[started], NULL, taskWorker, &ts) == 0) started++;
+    taskWorker(&ts); // This thread takes tasks too
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+#else
+    taskWorker(&ts);
+#endif
+}
+
+/* --------------------- METRICS --------------------- */
+// With --metrics, the core operations count themselves and time their
+// latency into log-scale histograms: LAT_SUB buckets per power of two of
+// nanoseconds, so a percentile is within a few percent and a histogram
+// is a fixed size however many samples it holds. Updates are relaxed
+// atomic adds, so service-mode workers record without taking a lock.
+// Without --metrics each hook is a single test of metricsOn. The figures
+// are shown by the Statistics screen and, in Prometheus text format, by
+// the "metrics" command (see BATCH MODE) and GET /metrics in service
+// mode (see SERVICE MODE).
+
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (64 * LAT_SUB)
+
+typedef struct {
+    long long counts[LAT_BUCKETS];
+    long long total;
+    unsigned long long sum, max; // nanoseconds
+} LatencyHistogram;
+
+static int latBucket(unsigned long long ns) {
+    if (ns < LAT_SUB) return (int)ns;
+    int e = 63 - __builtin_clzll(ns);
+    return (e - LAT_SUB_BITS + 1) * LAT_SUB + (int)((ns >> (e - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+// Middle of the range of nanoseconds bucket b holds
+static double latBucketValue(int b) {
+    if (b < LAT_SUB) return b;
+    int e = b / LAT_SUB + LAT_SUB_BITS - 1;
+    double width = (double)(1ull << (e - LAT_SUB_BITS));
+    return (double)(LAT_SUB + b % LAT_SUB) * width + width / 2;
+}
+
+static void latAdd(LatencyHistogram *h, unsigned long long ns) {
+    h->counts[latBucket(ns)]++;
+    h->total++;
+    h->sum += ns;
+    if (ns > h->max) h->max = ns;
+}
+
+// Nanoseconds below which fraction q of the samples fall
+static double latPercentile(const LatencyHistogram *h, double q) {
+    long long want = (long long)(q * (double)h->total), seen = 0;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen > want) return latBucketValue(b) < (double)h->max ? latBucketValue(b) : (double)h->max;
+    }
+    return (double)h->max;
+}
+
+unsigned long long nowNanos() {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (unsigned long long)(now.QuadPart / freq.QuadPart) * 1000000000ull +
+           (unsigned long long)(now.QuadPart % freq.QuadPart) * 1000000000ull / (unsigned long long)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+enum { MT_INTAKE, MT_BOOKING, MT_NAME_SEARCH, MT_JOURNAL_SYNC, MT_SAVE, MT_LOAD, MT_REQUEST, MT_COUNT };
+enum { MC_PATIENT_LOOKUPS, MC_DOCTOR_LOOKUPS, MC_APPOINTMENT_LOOKUPS, MC_JOURNAL_RECORDS, MC_COUNT };
+
+// Metric name (after "hms_"), then what it measures
+static const char *const timerNames[MT_COUNT][2] = {
+    { "patient_intake_seconds", "Admitting a patient" },
+    { "appointment_booking_seconds", "Booking an appointment" },
+    { "name_search_seconds", "Searching patients by name" },
+    { "journal_sync_seconds", "Syncing the journal to disk" },
+    { "save_seconds", "Saving the data file" },
+    { "load_seconds", "Loading the data file and journal" },
+    { "request_seconds", "Serving one service-mode request" },
+};
+static const char *const counterNames[MC_COUNT][2] = {
+    { "patient_lookups_total", "Patient lookups by id" },
+    { "doctor_lookups_total", "Doctor lookups by id" },
+    { "appointment_lookups_total", "Appointment lookups by id" },
+    { "journal_records_total", "Records appended to the journal" },
+};
+
+int metricsOn = 0; // Set by --metrics
+LatencyHistogram timers[MT_COUNT];
+long long counters[MC_COUNT];
+
+// Starts timing an operation: pass the result to metricStop
+static inline unsigned long long metricStart() {
+    return metricsOn ? nowNanos() : 0;
+}
+
+static void metricRecord(int m, unsigned long long ns) {
+    LatencyHistogram *h = &timers[m];
+    __atomic_fetch_add(&h->counts[latBucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+    unsigned long long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+static inline void metricStop(int m, unsigned long long started) {
+    if (started) metricRecord(m, nowNanos() - started);
+}
+
+static inline void metricCount(int c) {
+    if (metricsOn) __atomic_fetch_add(&counters[c], 1, __ATOMIC_RELAXED);
+}
+
+// Copies timer m as it is now (others may be adding to it)
+static void metricRead(int m, LatencyHistogram *out) {
+    const LatencyHistogram *h = &timers[m];
+    out->total = 0;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        out->counts[b] = __atomic_load_n(&h->counts[b], __ATOMIC_RELAXED);
+        out->total += out->counts[b]; // Consistent with the buckets
+    }
+    out->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    out->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+/* --------------------- SNAPSHOT VIEWS --------------------- */
+// In service mode, listings scan the tables without taking storeLock, so
+// a long listing never holds up intake (see SERVICE MODE). Changes are
+// still made one at a time under the lock; after each one the writer
+// publishes a View: a version number and every table's row count at that
+// version. A reader pins the current version and sees exactly the rows
+// that existed then: rows added later lie past its counts, and rows
+// deleted later keep their old id in a row stamp (see TABLES).
+// Memory a pinned reader may still be walking (an outgrown chunk
+// directory, an older View) is retired instead of freed, and reclaimed
+// once no reader pins a version that old. Moving rows (compaction) is the
+// one change readers cannot overlap; it is put off, or waits, while any
+// view is pinned (see maintainStores).
+
+typedef struct {
+    unsigned version; // from 1 up; a pin of 0 means no view is held
+    int patients, appointments, doctors, diseases; // rows visible
+} View;
+
+#define VIEW_MAX_READERS 64
+
+typedef struct {
+    unsigned version;
+    char pad[60]; // One cache line per reader, so pinning does not contend
+} ViewPin;
+
+typedef struct Retired {
+    void *ptr;
+    unsigned version; // readers pinned at or below this may still use ptr
+    struct Retired *next;
+} Retired;
+
+View firstView = { 1, 0, 0, 0, 0 };
+View *currentView = &firstView;
+unsigned viewVersion = 1;   // currentView->version, readable without touching the view
+ViewPin viewPins[VIEW_MAX_READERS];
+int viewsShared = 0;        // Set once readers run beside writers
+int viewsFrozen = 0;        // Set while a writer moves rows
+Retired *retiredList = NULL; // Touched by the writer only
+
+// Frees ptr now, or once no reader can still be using it
+void retireMemory(void *ptr) {
+    if (!viewsShared) { free(ptr); return; }
+    if (!ptr) return;
+    Retired *r = malloc(sizeof(Retired));
+    if (!r) return; // Leaked: freeing it could pull memory from under a reader
+    r->ptr = ptr;
+    r->version = viewVersion;
+    r->next = retiredList;
+    retiredList = r;
+}
+
+// Lowest version any reader has pinned, or 0 if none
+static unsigned oldestPin() {
+    unsigned oldest = 0;
+    for (int r = 0; r < VIEW_MAX_READERS; r++) {
+        unsigned v = __atomic_load_n(&viewPins[r].version, __ATOMIC_SEQ_CST);
+        if (v && (!oldest || v < oldest)) oldest = v;
+    }
+    return oldest;
+}
+
+// Frees what no pinned reader can reach any more
+void reclaimRetired() {
+    unsigned oldest = oldestPin();
+    for (Retired **p = &retiredList; *p;) {
+        Retired *r = *p;
+        if (oldest && r->version >= oldest) { p = &r->next; continue; }
+        *p = r->next;
+        free(r->ptr);
+        free(r);
+    }
+}
+
+/* --------------------- RECORD STORES --------------------- */
+
+// A growable table of fixed-size records. Records live in chunks of
+// STORE_CHUNK_SIZE that are never moved or freed while the store is in
+// use, so appending is O(1) amortized and a pointer to a record stays
+// valid as the table grows. Only the chunk directory (an array of
+// pointers) is ever replaced, and the old one is retired (see SNAPSHOT
+// VIEWS).
+// A store may also start with a 'base' run of records that lives in a
+// memory-mapped snapshot (see PERSISTENCE); chunks hold what follows it.
+typedef struct {
+    size_t recSize;  // sizeof one record
+    int count;       // slots in use, live or dead
+    int dead;        // tombstoned slots (id columns of tables only)
+    int chunkCount;  // chunks allocated
+    int chunkCap;    // capacity of the chunk directory
+    char **chunks;
+    char *base;      // records [0, baseCount) when attached to a snapshot
+    int baseCount;
+} RecordStore;
+
+#define STORE_INIT(type) { sizeof(type), 0, 0, 0, 0, NULL, NULL, 0 }
+
+// Returns the record at index i (0 <= i < s->count)
+static inline void* storeAt(const RecordStore *s, int i) {
+    if (i < s->baseCount) return s->base + (size_t)i * s->recSize;
+    i -= s->baseCount;
+    return s->chunks[i >> STORE_CHUNK_SHIFT] + (size_t)(i & STORE_CHUNK_MASK) * s->recSize;
+}
+
+// Makes sure the chunk holding index s->count exists.
+// Returns 0 if memory is exhausted.
+static int storeGrow(RecordStore *s) {
+    int c = (s->count - s->baseCount) >> STORE_CHUNK_SHIFT;
+    if (c < s->chunkCount) return 1;
+    if (s->chunkCount == s->chunkCap) {
+        int newCap = s->chunkCap ? s->chunkCap * 2 : 4;
+        char **dir = malloc(newCap * sizeof(char*));
+        if (!dir) return 0;
+        if (s->chunkCount) memcpy(dir, s->chunks, s->chunkCount * sizeof(char*));
+        char **old = s->chunks;
+        __atomic_store_n(&s->chunks, dir, __ATOMIC_RELEASE);
+        retireMemory(old); // A reader may still be walking the old directory
+        s->chunkCap = newCap;
+    }
+    char *chunk = malloc((size_t)STORE_CHUNK_SIZE * s->recSize);
+    if (!chunk) return 0;
+    s->chunks[s->chunkCount++] = chunk;
+    return 1;
+}
+
+// The slot the next append will use, to be filled in place first (see
+// insertRecord). It is not zeroed and not part of the store yet, so
+// readers never see it half written. Returns NULL if memory is exhausted.
+void* storeDraft(RecordStore *s) {
+    return storeGrow(s) ? storeAt(s, s->count) : NULL;
+}
+
+// Reserves a new zeroed record at the end of the store.
+// Returns NULL if memory is exhausted.
+void* storeAppend(RecordStore *s) {
+    void *rec = storeDraft(s);
+    if (!rec) return NULL;
+    memset(rec, 0, s->recSize);
+    s->count++;
+    return rec;
+}
+
+// Number of live (non-tombstoned) records
+static inline int storeLive(const RecordStore *s) {
+    return s->count - s->dead;
+}
+
+// Drops records from the end so only n remain, freeing emptied chunks
+void storeTruncate(RecordStore *s, int n) {
+    s->count = n;
+    if (n < s->baseCount) s->baseCount = n;
+    int keep = (n - s->baseCount + STORE_CHUNK_SIZE - 1) >> STORE_CHUNK_SHIFT;
+    while (s->chunkCount > keep) free(s->chunks[--s->chunkCount]);
+}
+
+// Uses n records at 'records' (inside a mapped snapshot) as the start of
+// an empty store. Nothing is copied; pages are read as records are touched.
+void storeAttach(RecordStore *s, void *records, int n) {
+    s->base = records;
+    s->baseCount = n;
+    s->count = n;
+}
+
+// Number of records from index i that lie contiguously in memory (to
+// the end of the base run or of i's chunk)
+static inline int storeRun(const RecordStore *s, int i) {
+    int n = i < s->baseCount ? s->baseCount - i
+                             : STORE_CHUNK_SIZE - ((i - s->baseCount) & STORE_CHUNK_MASK);
+    return n < s->count - i ? n : s->count - i;
+}
+
+// Appends n records read from fp, filling a chunk per fread.
+// Returns the number actually read.
+int storeRead(RecordStore *s, FILE *fp, int n) {
+    int read = 0;
+    while (read < n && storeGrow(s)) {
+        int room = STORE_CHUNK_SIZE - ((s->count - s->baseCount) & STORE_CHUNK_MASK);
+        int want = n - read < room ? n - read : room;
+        size_t got = fread(storeAt(s, s->count), s->recSize, want, fp);
+        s->count += (int)got;
+        read += (int)got;
+        if ((int)got < want) break;
+    }
+    return read;
+}
+
+/* --------------------- STRING POOL --------------------- */
+// Variable-length strings stored out of line and addressed by a StrRef,
+// a byte offset into the pool. Strings never straddle a block and are
+// never moved, so the pointer poolStr() returns stays valid. Ref 0 is
+// always the empty string. Like a RecordStore, the pool may start with a
+// base run of bytes mapped from a snapshot.
+
+typedef unsigned StrRef;
+
+#define POOL_BLOCK_SHIFT 16
+#define POOL_BLOCK_SIZE (1u << POOL_BLOCK_SHIFT)
+#define POOL_BLOCK_MASK (POOL_BLOCK_SIZE - 1)
+
+typedef struct {
+    char *base;       // mapped bytes [0, baseLen)
+    unsigned baseLen;
+    int blockCount;
+    int blockCap;
+    char **blocks;
+    unsigned used;    // bytes used in the last block
+    unsigned garbage; // bytes held by strings nothing refers to any more
+} StringPool;
+
+#define POOL_INIT { NULL, 0, 0, 0, NULL, 0, 0 }
+
+static inline const char* poolStr(const StringPool *p, StrRef ref) {
+    if (ref == 0) return "";
+    if (ref < p->baseLen) return p->base + ref;
+    ref -= p->baseLen;
+    return p->blocks[ref >> POOL_BLOCK_SHIFT] + (ref & POOL_BLOCK_MASK);
+}
+
+// Total bytes addressed by the pool (the size it is saved with)
+static inline unsigned poolSize(const StringPool *p) {
+    if (p->blockCount == 0) return p->baseLen;
+    return p->baseLen + (unsigned)(p->blockCount - 1) * POOL_BLOCK_SIZE + p->used;
+}
+
+// Copies at most maxLen bytes of str into the pool. Returns 0 if memory
+// is exhausted.
+int poolAdd(StringPool *p, const char *str, size_t maxLen, StrRef *out) {
+    size_t len = strnlen(str, maxLen);
+    if (len == 0) { *out = 0; return 1; }
+    if (p->blockCount == 0 || p->used + len + 1 > POOL_BLOCK_SIZE) {
+        if (p->blockCount == p->blockCap) {
+            int newCap = p->blockCap ? p->blockCap * 2 : 4;
+            char **dir = malloc(newCap * sizeof(char*));
+            if (!dir) return 0;
+            if (p->blockCount) memcpy(dir, p->blocks, p->blockCount * sizeof(char*));
+            char **old = p->blocks;
+            __atomic_store_n(&p->blocks, dir, __ATOMIC_RELEASE);
+            retireMemory(old);
+            p->blockCap = newCap;
+        }
+        char *block = malloc(POOL_BLOCK_SIZE);
+        if (!block) return 0;
+        memset(block, 0, POOL_BLOCK_SIZE); // Keeps the unused tail deterministic on disk
+        p->blocks[p->blockCount++] = block;
+        p->used = (p->blockCount == 1 && p->baseLen == 0) ? 1 : 0; // Byte 0 is ref 0
+    }
+    char *dst = p->blocks[p->blockCount - 1] + p->used;
+    memcpy(dst, str, len);
+    dst[len] = '\0';
+    *out = p->baseLen + (unsigned)(p->blockCount - 1) * POOL_BLOCK_SIZE + p->used;
+    p->used += (unsigned)len + 1;
+    return 1;
+}
+
+// Copies the string at ref in another pool into p
+static inline int poolCopy(StringPool *p, const StringPool *from, StrRef ref, StrRef *out) {
+    const char *str = poolStr(from, ref);
+    return poolAdd(p, str, strlen(str), out);
+}
+
+// Marks a string as no longer referenced
+static inline void poolRelease(StringPool *p, StrRef ref) {
+    if (ref) p->garbage += (unsigned)strlen(poolStr(p, ref)) + 1;
+}
+
+// Uses a mapped run of pool bytes (whose first byte is '\0') as the base
+void poolAttach(StringPool *p, char *bytes, unsigned len) {
+    p->base = bytes;
+    p->baseLen = len;
+}
+
+void poolFree(StringPool *p) {
+    while (p->blockCount) free(p->blocks[--p->blockCount]);
+    p->base = NULL;
+    p->baseLen = 0;
+    p->used = 0;
+    p->garbage = 0;
+}
+
+// The pool's bytes from offset off that lie contiguously in memory; sets
+// *n to how many (see storeRun)
+static inline const char* poolRun(const StringPool *p, unsigned off, unsigned *n) {
+    unsigned left = poolSize(p) - off;
+    if (off < p->baseLen) {
+        *n = p->baseLen - off;
+        return p->base + off;
+    }
+    unsigned in = (off - p->baseLen) & POOL_BLOCK_MASK;
+    *n = POOL_BLOCK_SIZE - in < left ? POOL_BLOCK_SIZE - in : left;
+    return p->blocks[(off - p->baseLen) >> POOL_BLOCK_SHIFT] + in;
+}
+
+/* --------------------- INTERNED STRINGS --------------------- */
+// Fields that repeat across many records (gender, disease, doctor
+// specialization) are stored once each and referred to by a small int
+// handle, so comparing two values is comparing two ints. Handle 0 is the
+// empty string. Interned strings live in a StringPool and are never
+// released; a hash table over the handles finds existing ones.
+
+typedef struct {
+    StringPool *pool;
+    RecordStore refs; // StrRef of handle h at index h - 1
+    int *buckets;     // handles, 0 = empty; cap is a power of two
+    int cap;
+} InternTable;
+
+#define INTERN_INIT(pool) { pool, STORE_INIT(StrRef), NULL, 0 }
+
+static inline const char* internStr(const InternTable *t, int h) {
+    return h > 0 ? poolStr(t->pool, *(StrRef*)storeAt(&t->refs, h - 1)) : "";
+}
+
+// FNV-1a over the first len bytes
+static unsigned internHash(const char *s, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+// Bucket holding s (len bytes), or the empty bucket where it would go
+static int internProbe(const InternTable *t, const char *s, size_t len) {
+    int mask = t->cap - 1;
+    int b = (int)(internHash(s, len) & (unsigned)mask);
+    while (t->buckets[b]) {
+        const char *have = internStr(t, t->buckets[b]);
+        if (strncmp(have, s, len) == 0 && have[len] == '\0') break;
+        b = (b + 1) & mask;
+    }
+    return b;
+}
+
+static int internResize(InternTable *t, int cap) {
+    int *buckets = calloc((size_t)cap, sizeof(int));
+    if (!buckets) return 0;
+    free(t->buckets);
+    t->buckets = buckets;
+    t->cap = cap;
+    for (int h = 1; h <= t->refs.count; h++) {
+        const char *str = internStr(t, h);
+        t->buckets[internProbe(t, str, strlen(str))] = h;
+    }
+    return 1;
+}
+
+// Handle of the first maxLen bytes of s: 0 if empty, -1 if never interned
+int internFind(const InternTable *t, const char *s, size_t maxLen) {
+    size_t len = strnlen(s, maxLen);
+    if (len == 0) return 0;
+    if (t->cap == 0) return -1;
+    int h = t->buckets[internProbe(t, s, len)];
+    return h ? h : -1;
+}
+
+// Handle of the first maxLen bytes of s, adding it if it is new.
+// Returns -1 if memory is exhausted.
+int intern(InternTable *t, const char *s, size_t maxLen) {
+    size_t len = strnlen(s, maxLen);
+    if (len == 0) return 0;
+    if ((t->refs.count + 1) * 2 > t->cap && !internResize(t, t->cap ? t->cap * 2 : 64)) return -1;
+    int b = internProbe(t, s, len);
+    if (t->buckets[b]) return t->buckets[b];
+    StrRef ref;
+    if (!poolAdd(t->pool, s, len, &ref)) return -1;
+    StrRef *slot = storeAppend(&t->refs);
+    if (!slot) return -1;
+    *slot = ref;
+    t->buckets[b] = t->refs.count;
+    return t->refs.count;
+}
+
+// Rehashes after the handles were attached from a snapshot
+int internRebuild(InternTable *t) {
+    int cap = 64;
+    while (cap < t->refs.count * 2 + 2) cap *= 2;
+    return internResize(t, cap);
+}
+
+/* --------------------- TABLES --------------------- */
+// A table is a set of RecordStores holding one column each, all with the
+// same row count; a row is the same slot in every column. The first
+// column holds the row ids. Deleting a row only zeroes its id (a
+// tombstone); tableCompact() squeezes dead rows out later. Loops over a
+// table must skip rows whose id is 0.
+// While views are shared, a table also keeps a stamp column (never
+// saved) recording the version at which each row was deleted and the id
+// it had, so readers holding an older view still see the row.
+
+#define TABLE_MAX_COLUMNS 7
+
+typedef struct {
+    unsigned killed; // first version the row is gone in, 0 if never deleted
+    int id;          // the id it had
+} RowStamp;
+
+typedef struct {
+    int ncols;
+    RecordStore *cols[TABLE_MAX_COLUMNS]; // cols[0] is the int id column
+    RecordStore *stamps; // also the last column, when kept
+} Table;
+
+static inline int tableRows(const Table *t) { return t->cols[0]->count; }
+static inline int tableLive(const Table *t) { return storeLive(t->cols[0]); }
+
+// Appends a zeroed row. Returns its slot, or -1 if memory is exhausted.
+int tableAppend(Table *t) {
+    int slot = t->cols[0]->count;
+    for (int c = 0; c < t->ncols; c++) {
+        if (!storeAppend(t->cols[c])) {
+            for (int u = 0; u < c; u++) storeTruncate(t->cols[u], slot);
+            return -1;
+        }
+    }
+    return slot;
+}
+
+// Tombstones row i in O(1)
+void tableKill(Table *t, int i) {
+    int *id = storeAt(t->cols[0], i);
+    if (t->stamps) {
+        RowStamp *st = storeAt(t->stamps, i);
+        st->id = *id;
+        st->killed = viewVersion + 1; // Gone from the next view on
+        __atomic_store_n(id, 0, __ATOMIC_RELEASE);
+    } else {
+        *id = 0;
+    }
+    t->cols[0]->dead++;
+}
+
+// Starts keeping a stamp column for t. Returns 0 if memory is exhausted.
+int tableKeepStamps(Table *t, RecordStore *stamps) {
+    while (stamps->count < tableRows(t)) if (!storeAppend(stamps)) return 0;
+    t->cols[t->ncols++] = stamps;
+    t->stamps = stamps;
+    return 1;
+}
+
+// Id of row i, even if it was deleted after some reader's view
+static inline int tableRowId(const Table *t, int i) {
+    int id = *(int*)storeAt(t->cols[0], i);
+    return id || !t->stamps ? id : ((RowStamp*)storeAt(t->stamps, i))->id;
+}
+
+// Id of row i as of view version, or 0 if the row was gone by then
+static inline int tableIdAt(const Table *t, unsigned version, int i) {
+    int id = __atomic_load_n((int*)storeAt(t->cols[0], i), __ATOMIC_ACQUIRE);
+    if (id || !t->stamps) return id;
+    const RowStamp *st = storeAt(t->stamps, i);
+    return st->killed > version ? st->id : 0;
+}
+
+// True once enough tombstones have piled up to be worth a sweep
+static inline int tableNeedsCompact(const Table *t) {
+    const RecordStore *ids = t->cols[0];
+    return ids->dead >= STORE_COMPACT_MIN && ids->dead * 4 >= ids->count;
+}
+
+// Slides live rows down over the tombstones in one pass, column by
+// column, and frees chunks that end up empty. Slots change, so indexes
+// over the table must be rebuilt.
+void tableCompact(Table *t) {
+    RecordStore *ids = t->cols[0];
+    if (ids->dead == 0) return;
+    int out = 0;
+    for (int i = 0; i < ids->count; i++) {
+        if (*(int*)storeAt(ids, i) == 0) continue;
+        if (out != i) {
+            for (int c = 0; c < t->ncols; c++) {
+                memcpy(storeAt(t->cols[c], out), storeAt(t->cols[c], i), t->cols[c]->recSize);
+            }
+        }
+        out++;
+    }
+    ids->dead = 0;
+    for (int c = 0; c < t->ncols; c++) storeTruncate(t->cols[c], out);
+}
+
+/* --------------------- ID INDEXES --------------------- */
+
+// Open-addressing hash map from record id to store slot (linear probing).
+// Ids start at 1, so 0 marks an empty bucket. Every record type begins
+// with an 'int id' field, which lets one index type serve all stores.
+typedef struct {
+    int cap;   // buckets, always a power of two (or 0 before first use)
+    int used;  // occupied buckets
+    int *ids;
+    int *slots;
+} IdIndex;
+
+#define IDINDEX_INIT { 0, 0, NULL, NULL }
+
+static inline unsigned idHash(int id) {
+    return (unsigned)id * 2654435761u; // Knuth multiplicative hash
+}
+
+static inline int recordId(const RecordStore *s, int i) {
+    return *(const int*)storeAt(s, i);
+}
+
+// Returns the slot stored for id, or -1
+int idIndexGet(const IdIndex *ix, int id) {
+    if (ix->cap == 0 || id == 0) return -1;
+    unsigned mask = ix->cap - 1;
+    for (unsigned b = idHash(id) & mask; ix->ids[b] != 0; b = (b + 1) & mask) {
+        if (ix->ids[b] == id) return ix->slots[b];
+    }
+    return -1;
+}
+
+static int idIndexResize(IdIndex *ix, int newCap) {
+    int *ids = calloc(newCap, sizeof(int));
+    int *slots = malloc(newCap * sizeof(int));
+    if (!ids || !slots) { free(ids); free(slots); return 0; }
+    unsigned mask = newCap - 1;
+    for (int i = 0; i < ix->cap; i++) {
+        if (ix->ids[i] == 0) continue;
+        unsigned b = idHash(ix->ids[i]) & mask;
+        while (ids[b] != 0) b = (b + 1) & mask;
+        ids[b] = ix->ids[i];
+        slots[b] = ix->slots[i];
+    }
+    free(ix->ids); free(ix->slots);
+    ix->ids = ids; ix->slots = slots; ix->cap = newCap;
+    return 1;
+}
+
+// Inserts or updates id -> slot. Returns 0 if memory is exhausted.
+int idIndexPut(IdIndex *ix, int id, int slot) {
+    for (;;) {
+        unsigned mask = ix->cap - 1;
+        unsigned b = idHash(id) & mask;
+        while (ix->cap && ix->ids[b] != 0 && ix->ids[b] != id) b = (b + 1) & mask;
+        if (ix->cap && ix->ids[b] == id) { ix->slots[b] = slot; return 1; }
+
+        // New id: keep the load factor under 70%
+        if ((ix->used + 1) * 10 > ix->cap * 7) {
+            if (!idIndexResize(ix, ix->cap ? ix->cap * 2 : 64)) return 0;
+            continue; // Probe again in the larger table
+        }
+        ix->ids[b] = id;
+        ix->slots[b] = slot;
+        ix->used++;
+        return 1;
+    }
+}
+
+// Removes id. Later entries of the probe run are shifted back so that
+// lookups never need tombstones.
+void idIndexRemove(IdIndex *ix, int id) {
+    if (ix->cap == 0) return;
+    unsigned mask = ix->cap - 1;
+    unsigned b = idHash(id) & mask;
+    while (ix->ids[b] != id) {
+        if (ix->ids[b] == 0) return; // not present
+        b = (b + 1) & mask;
+    }
+    ix->ids[b] = 0;
+    ix->used--;
+    for (unsigned n = (b + 1) & mask; ix->ids[n] != 0; n = (n + 1) & mask) {
+        unsigned home = idHash(ix->ids[n]) & mask;
+        // Move n into the hole if its home bucket is not in (b, n]
+        if (((n - home) & mask) >= ((n - b) & mask)) {
+            ix->ids[b] = ix->ids[n];
+            ix->slots[b] = ix->slots[n];
+            ix->ids[n] = 0;
+            b = n;
+        }
+    }
+}
+
+// Re-indexes slots [from, s->count) after records were moved
+int idIndexReindex(IdIndex *ix, const RecordStore *s, int from) {
+    for (int i = from; i < s->count; i++) {
+        int id = recordId(s, i);
+        if (id != 0 && !idIndexPut(ix, id, i)) return 0;
+    }
+    return 1;
+}
+
+// Throws away the index and builds it again from the store
+int idIndexRebuild(IdIndex *ix, const RecordStore *s) {
+    if (ix->cap) memset(ix->ids, 0, ix->cap * sizeof(int));
+    ix->used = 0;
+    return idIndexReindex(ix, s, 0);
+}
+
+/* --------------------- DEFERRED INDEXES --------------------- */
+// A load builds only the small indexes (interned strings, doctors) and
+// leaves the ones over patients and appointments pending; each is built
+// from the rows the first time something reads it, so startup costs the
+// same however large the tables are. Readers call indexNeed() first.
+// Changes skip an index that is still pending, as its build will see
+// the rows as they are by then. Service workers may need the same index
+// at once while sharing storeLock, so builds hold indexLock; a build
+// reads only rows and the doctor index and never waits on another.
+
+enum { X_INTERNED, X_DOCTORS, X_PATIENT_IDS, X_APPOINTMENT_IDS, X_SCHEDULES, X_CALENDAR,
+       X_NAMES, X_TRIGRAMS, X_AGGREGATES, X_COUNT };
+
+unsigned indexesPending = 0;     // Bit x is set while index x waits to be built
+int (*indexBuild)(int x) = NULL; // Set with the first deferral (see PERSISTENCE)
+
+static inline int indexReady(int x) {
+    return !(__atomic_load_n(&indexesPending, __ATOMIC_ACQUIRE) >> x & 1);
+}
+
+// Builds index x now if it is still pending
+void indexNeed(int x) {
+    if (indexReady(x)) return;
+#ifdef HAVE_THREADS
+    static pthread_mutex_t indexLock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&indexLock);
+#endif
+    if (!indexReady(x)) {
+        if (!indexBuild(x)) printf(RED "? Error: Out of memory while indexing records.\n" RESET_COLOR);
+        __atomic_and_fetch(&indexesPending, ~(1u << x), __ATOMIC_RELEASE);
+    }
+#ifdef HAVE_THREADS
+    pthread_mutex_unlock(&indexLock);
+#endif
+}
+
 /* --------------------- GLOBALS --------------------- */
 
-Patient patients[MAX_PATIENTS];
-Disease diseases[MAX_DISEASES];
-Doctor doctors[MAX_DOCTORS];
-Appointment appointments[MAX_APPOINTS];
+StringPool stringPool = POOL_INIT;
+InternTable interned = INTERN_INIT(&stringPool);
+
+// Patients are split hot/cold: the numbers that scans and joins read
+// (id, age, doctor, and the interned gender and disease) each sit in a
+// contiguous column, and the free-text strings live out of line in
+// stringPool, referenced from one PatientText per row.
+typedef struct {
+    StrRef name;
+    StrRef phone;
+} PatientText;
+
+RecordStore patientIds = STORE_INIT(int); // 0 marks a deleted patient
+RecordStore patientAges = STORE_INIT(int);
+RecordStore patientDoctorIds = STORE_INIT(int);
+RecordStore patientGenders = STORE_INIT(int);  // interned handles
+RecordStore patientDiseases = STORE_INIT(int); // interned handles
+RecordStore patientTexts = STORE_INIT(PatientText);
+RecordStore patientStamps = STORE_INIT(RowStamp);
+Table patientTable = { 6, { &patientIds, &patientAges, &patientDoctorIds,
+                            &patientGenders, &patientDiseases, &patientTexts }, NULL };
+
+// Appointments are all numbers: the date and time are kept as minutes
+// since 1970 (see DOCTOR SCHEDULES). Rows from old files whose date/time
+// never parsed keep the original text in appointmentOldText and have a
+// time of -1.
+RecordStore appointmentIds = STORE_INIT(int); // 0 marks a canceled appointment
+RecordStore appointmentPatientIds = STORE_INIT(int);
+RecordStore appointmentDoctorIds = STORE_INIT(int);
+RecordStore appointmentTimes = STORE_INIT(int);
+RecordStore appointmentOldText = STORE_INIT(StrRef);
+RecordStore appointmentStamps = STORE_INIT(RowStamp);
+Table appointmentTable = { 5, { &appointmentIds, &appointmentPatientIds, &appointmentDoctorIds,
+                                &appointmentTimes, &appointmentOldText }, NULL };
+
+// Stored form of a doctor, with the specialization interned
+typedef struct {
+    int id;
+    char name[100];
+    int specialization;
+    char phone[20];
+} DoctorRecord;
 
-int patientCount = 0;
-int diseaseCount = 0;
-int doctorCount = 0;
-int appointmentCount = 0;
+RecordStore diseaseStore = STORE_INIT(Disease);
+RecordStore doctorStore = STORE_INIT(DoctorRecord);
+
+static inline int* intAt(const RecordStore *s, int i) { return (int*)storeAt(s, i); }
+
+static inline int patientId(int i) { return *intAt(&patientIds, i); }
+static inline int patientAge(int i) { return *intAt(&patientAges, i); }
+static inline int patientDoctorId(int i) { return *intAt(&patientDoctorIds, i); }
+static inline void setPatientDoctorId(int i, int did) { *intAt(&patientDoctorIds, i) = did; }
+static inline PatientText* patientText(int i) { return (PatientText*)storeAt(&patientTexts, i); }
+static inline const char* patientName(int i) { return poolStr(&stringPool, patientText(i)->name); }
+static inline int patientGenderId(int i) { return *intAt(&patientGenders, i); }
+static inline int patientDiseaseId(int i) { return *intAt(&patientDiseases, i); }
+static inline const char* patientGender(int i) { return internStr(&interned, patientGenderId(i)); }
+static inline const char* patientPhone(int i) { return poolStr(&stringPool, patientText(i)->phone); }
+static inline const char* patientDisease(int i) { return internStr(&interned, patientDiseaseId(i)); }
+
+static inline int appointmentId(int i) { return *intAt(&appointmentIds, i); }
+static inline int appointmentPatientId(int i) { return *intAt(&appointmentPatientIds, i); }
+static inline int appointmentDoctorId(int i) { return *intAt(&appointmentDoctorIds, i); }
+static inline int appointmentTime(int i) { return *intAt(&appointmentTimes, i); }
+
+static inline Disease* diseaseAt(int i) { return (Disease*)storeAt(&diseaseStore, i); }
+static inline DoctorRecord* doctorAt(int i) { return (DoctorRecord*)storeAt(&doctorStore, i); }
+static inline const char* doctorSpecialization(int i) { return internStr(&interned, doctorAt(i)->specialization); }
+
+IdIndex patientIndex = IDINDEX_INIT;
+IdIndex doctorIndex = IDINDEX_INIT;
+IdIndex appointmentIndex = IDINDEX_INIT;
 
 int nextPatientId = 1;
 int nextDiseaseId = 1;
 int nextDoctorId = 1;
 int nextAppointmentId = 1;
 
+int batchMode = 0; // Running from --batch: no prompts or screen clears
+
 /* --------------------- UTILS --------------------- */
 
-// Clears the console screen
+// Clears the terminal without starting a shell: the console API on
+// Windows, the escape sequences 'clear' itself writes elsewhere. Nothing
+// is written when stdout is not a terminal (piped or redirected) or in
+// batch mode.
 void clear_screen() {
+    static int onTerminal = -1;
+#ifdef _WIN32
+    if (onTerminal < 0) onTerminal = _isatty(_fileno(stdout));
+#else
+    if (onTerminal < 0) onTerminal = isatty(fileno(stdout));
+#endif
+    if (!onTerminal || batchMode) return;
+    fflush(stdout);
 #ifdef _WIN32
-    system("cls");
+    HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    if (!GetConsoleScreenBufferInfo(out, &info)) return;
+    DWORD cells = (DWORD)info.dwSize.X * info.dwSize.Y, written;
+    COORD home = { 0, 0 };
+    FillConsoleOutputCharacterA(out, ' ', cells, home, &written);
+    FillConsoleOutputAttribute(out, info.wAttributes, cells, home, &written);
+    SetConsoleCursorPosition(out, home);
 #else
-    system("clear"); // Assumes POSIX-compliant system (Linux, macOS)
+    fputs("\033[H\033[2J\033[3J", stdout); // Home, clear screen, clear scrollback
+    fflush(stdout);
 #endif
 }
 
@@ -147,6 +1095,22 @@ int get_int_from_user(const char *prompt) {
     return (int)value;
 }
 
+// Like get_int_from_user, but a blank line is accepted and gives blank
+int get_optional_int_from_user(const char *prompt, int blank) {
+    char buffer[100];
+    while (1) {
+        getLine(prompt, buffer, sizeof(buffer));
+        if (buffer[0] == '\0') return blank;
+        char *endptr;
+        errno = 0;
+        long value = strtol(buffer, &endptr, 10);
+        if (endptr != buffer && *endptr == '\0' && errno != ERANGE && value <= INT_MAX && value >= INT_MIN) {
+            return (int)value;
+        }
+        printf(RED "Invalid input. Please enter a number, or leave it blank.\n" RESET_COLOR);
+    }
+}
+
 // Gets a choice and clears the input buffer
 int get_choice() {
     return get_int_from_user("\nEnter your choice: ");
@@ -164,23 +1128,36 @@ int stricmp_custom(const char *a, const char *b) {
 }
 
 // --- Consolidated Finder Functions ---
+// O(1) lookups through the id indexes; each returns a store slot or -1
 int findPatientIndex(int id) {
-    for (int i = 0; i < patientCount; i++) {
-        if (patients[i].id == id) return i;
-    }
-    return -1;
+    metricCount(MC_PATIENT_LOOKUPS);
+    indexNeed(X_PATIENT_IDS);
+    return idIndexGet(&patientIndex, id);
 }
 
 int findDoctorIndex(int id) {
-    for (int i = 0; i < doctorCount; i++) {
-        if (doctors[i].id == id) return i;
-    }
-    return -1;
+    metricCount(MC_DOCTOR_LOOKUPS);
+    return idIndexGet(&doctorIndex, id);
 }
 
 int findAppointmentIndex(int id) {
-    for (int i = 0; i < appointmentCount; i++) {
-        if (appointments[i].id == id) return i;
+    metricCount(MC_APPOINTMENT_LOOKUPS);
+    indexNeed(X_APPOINTMENT_IDS);
+    return idIndexGet(&appointmentIndex, id);
+}
+
+// Slot of the disease reference with this id, or -1. The reference table
+// is small, so this and findDiseaseByName() are plain scans.
+int findDiseaseIndex(int id) {
+    for (int i = 0; i < diseaseStore.count; i++) if (diseaseAt(i)->id == id) return i;
+    return -1;
+}
+
+// Slot of the disease reference whose name matches (ignoring case), or -1.
+int findDiseaseByName(const char *name) {
+    if (name[0] == '\0') return -1;
+    for (int i = 0; i < diseaseStore.count; i++) {
+        if (stricmp_custom(diseaseAt(i)->name, name) == 0) return i;
     }
     return -1;
 }
@@ -189,468 +1166,6826 @@ int findAppointmentIndex(int id) {
 const char* getPatientName(int id) {
     int i = findPatientIndex(id);
     if (i != -1) {
-        return patients[i].name;
+        return patientName(i);
     }
     return "Unknown";
 }
 
+// Flushes fp through to stable storage. Returns 0 on failure.
+static int fileSync(FILE *fp) {
+    if (fflush(fp) != 0) return 0;
+#ifdef _WIN32
+    return _commit(_fileno(fp)) == 0;
+#else
+    return fsync(fileno(fp)) == 0;
+#endif
+}
 
-/* --------------------- PERSISTENCE --------------------- */
-
-void saveData() {
-    FILE *fp = fopen("hospital_data.bin", "wb");
-    if (!fp) {
-        printf(RED "? Error: Could not open save file for writing.\n" RESET_COLOR);
-        return;
-    }
+/* --------------------- PAGED OUTPUT --------------------- */
+// Long listings are shown a page at a time. Each page is formatted into
+// one OutBuf and written with a single fwrite, so a listing costs one
+// page of formatting per screen however large the table is. In plain
+// mode (--plain or NO_COLOR, for piping) color escapes are left out and
+// every page is written in turn without prompting.
 
-    fwrite(&patientCount, sizeof(int), 1, fp);
-    fwrite(&diseaseCount, sizeof(int), 1, fp);
-    fwrite(&doctorCount, sizeof(int), 1, fp);
-    fwrite(&appointmentCount, sizeof(int), 1, fp);
+#define DEFAULT_PAGE_SIZE 20
 
-    fwrite(&nextPatientId, sizeof(int), 1, fp);
-    fwrite(&nextDiseaseId, sizeof(int), 1, fp);
-    fwrite(&nextDoctorId, sizeof(int), 1, fp);
-    fwrite(&nextAppointmentId, sizeof(int), 1, fp);
+int pageSize = DEFAULT_PAGE_SIZE; // Rows per page; see --page-size
+int plainOutput = 0;
 
-    if (patientCount > 0) fwrite(patients, sizeof(Patient), patientCount, fp);
-    if (diseaseCount > 0) fwrite(diseases, sizeof(Disease), diseaseCount, fp);
-    if (doctorCount > 0) fwrite(doctors, sizeof(Doctor), doctorCount, fp);
-    if (appointmentCount > 0) fwrite(appointments, sizeof(Appointment), appointmentCount, fp);
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed; // set if memory ran out; the flush then says so
+} OutBuf;
 
-    fclose(fp);
-    printf(GREEN "?? Data saved successfully.\n" RESET_COLOR);
+void obPrintf(OutBuf *ob, const char *fmt, ...) {
+    if (ob->failed) return;
+    for (;;) {
+        va_list ap;
+        va_start(ap, fmt);
+        size_t room = ob->cap - ob->len;
+        int n = vsnprintf(ob->data ? ob->data + ob->len : NULL, room, fmt, ap);
+        va_end(ap);
+        if (n < 0) { ob->failed = 1; return; }
+        if ((size_t)n < room) { ob->len += (size_t)n; return; }
+        size_t cap = ob->cap ? ob->cap * 2 : 4096;
+        while (cap - ob->len <= (size_t)n) cap *= 2;
+        char *data = realloc(ob->data, cap);
+        if (!data) { ob->failed = 1; return; }
+        ob->data = data;
+        ob->cap = cap;
+    }
 }
 
+// Drops ANSI color escapes (ESC '[' ... 'm') in place
+static size_t stripColors(char *s, size_t len) {
+    size_t w = 0;
+    for (size_t r = 0; r < len; r++) {
+        if (s[r] == '\033' && r + 1 < len && s[r + 1] == '[') {
+            while (r < len && s[r] != 'm') r++;
+            continue;
+        }
+        s[w++] = s[r];
+    }
+    return w;
+}
+
+// Writes the buffer in one go and empties it
+void obFlush(OutBuf *ob) {
+    fflush(stdout); // Keep it in order with earlier printf output
+    if (ob->len) {
+        if (plainOutput) ob->len = stripColors(ob->data, ob->len);
+        fwrite(ob->data, 1, ob->len, stdout);
+    }
+    if (ob->failed) printf(RED "? Out of memory while formatting output.\n" RESET_COLOR);
+    fflush(stdout);
+    ob->len = 0;
+    ob->failed = 0;
+}
+
+void obFree(OutBuf *ob) {
+    free(ob->data);
+    ob->data = NULL;
+    ob->len = ob->cap = 0;
+}
+
+// A listing walks positions 0, 1, ... (slots or index positions); seek()
+// skips ones with nothing to show, such as deleted rows.
+typedef struct {
+    const char *title;
+    int rows;                           // how many rows will be shown in all
+    int (*seek)(int pos);               // first showable position >= pos, or -1
+    void (*emit)(OutBuf *ob, int pos);  // formats one row
+} Listing;
+
+// Shows a listing page by page. Pressing Enter goes to the next page,
+// 'p' back to the previous one and 'q' stops.
+void showListing(const Listing *l) {
+    int pages = (l->rows + pageSize - 1) / pageSize;
+    int *starts = malloc((size_t)(pages + 1) * sizeof(int)); // First position of each page seen
+    if (!starts) { printf(RED "? Out of memory.\n" RESET_COLOR); return; }
+    OutBuf ob = { 0 };
+    int page = 0;
+    starts[0] = l->seek(0);
+    while (page < pages && starts[page] != -1) {
+        obPrintf(&ob, "\n" MAGENTA "========== %s ==========\n" RESET_COLOR, l->title);
+        int pos = starts[page];
+        for (int n = 0; n < pageSize && pos != -1; n++) {
+            l->emit(&ob, pos);
+            pos = l->seek(pos + 1);
+        }
+        starts[page + 1] = pos;
+        obPrintf(&ob, CYAN "Page %d of %d (%d total)\n" RESET_COLOR, page + 1, pages, l->rows);
+        obFlush(&ob);
+        if (pos == -1 || page + 1 == pages) break;
+        if (plainOutput || batchMode) { page++; continue; }
+
+        char cmd[16];
+        getLine("[Enter] next page, [p] previous, [q] back to menu: ", cmd, sizeof(cmd));
+        if (cmd[0] == 'q' || cmd[0] == 'Q') break;
+        if (cmd[0] == 'p' || cmd[0] == 'P') { if (page > 0) page--; }
+        else page++;
+        clear_screen();
+    }
+    obFree(&ob);
+    free(starts);
+}
+
+/* --------------------- NAME INDEX --------------------- */
+// Patient slots kept sorted by case-insensitive name (ties broken by id),
+// so name search is a binary search and a by-name listing is a walk of
+// this array. The records themselves are never reordered.
+
+typedef struct {
+    int count;
+    int cap;
+    int *slots;
+} NameIndex;
+
+NameIndex patientNameIndex = { 0, 0, NULL };
+
+// Orders patient slot a against (name, id)
+static int nameKeyCompare(int a, const char *name, int id) {
+    int c = stricmp_custom(patientName(a), name);
+    if (c != 0) return c;
+    return (patientId(a) > id) - (patientId(a) < id);
+}
+
+// First position whose key is >= (name, id)
+static int nameIndexLowerBound(const NameIndex *ix, const char *name, int id) {
+    int lo = 0, hi = ix->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (nameKeyCompare(ix->slots[mid], name, id) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Makes room for n entries. Returns 0 if memory is exhausted.
+int nameIndexReserve(NameIndex *ix, int n) {
+    if (n <= ix->cap) return 1;
+    int newCap = ix->cap ? ix->cap : 64;
+    while (newCap < n) newCap *= 2;
+    int *slots = realloc(ix->slots, newCap * sizeof(int));
+    if (!slots) return 0;
+    ix->slots = slots;
+    ix->cap = newCap;
+    return 1;
+}
+
+// Adds patient slot. The caller must have reserved room.
+void nameIndexInsert(NameIndex *ix, int slot) {
+    int pos = nameIndexLowerBound(ix, patientName(slot), patientId(slot));
+    memmove(ix->slots + pos + 1, ix->slots + pos, (ix->count - pos) * sizeof(int));
+    ix->slots[pos] = slot;
+    ix->count++;
+}
+
+// Drops patient slot. Must run while the record still has its id and name.
+void nameIndexRemove(NameIndex *ix, int slot) {
+    int pos = nameIndexLowerBound(ix, patientName(slot), patientId(slot));
+    if (pos == ix->count || ix->slots[pos] != slot) return;
+    memmove(ix->slots + pos, ix->slots + pos + 1, (ix->count - pos - 1) * sizeof(int));
+    ix->count--;
+}
+
+// qsort comparator over patient slots
+int comparePatientsByName(const void *a, const void *b) {
+    int sb = *(const int*)b;
+    return nameKeyCompare(*(const int*)a, patientName(sb), patientId(sb));
+}
+
+// Rebuilds the index from the live patients (after load or compaction)
+// Large rebuilds sort one run per thread, then merge runs pairwise
+#define NAME_SORT_RUN_MIN 16384
+
+typedef struct {
+    int *from, *to; // the pass reads from and writes to (sorting is in place in from)
+    int *bounds;    // run r is [bounds[r], bounds[r + 1])
+    int runs;
+} NameSort;
+
+static void nameSortTask(void *arg, int r) {
+    NameSort *ns = arg;
+    qsort(ns->from + ns->bounds[r], (size_t)(ns->bounds[r + 1] - ns->bounds[r]), sizeof(int), comparePatientsByName);
+}
+
+// Merges runs 2m and 2m + 1 (or copies a last unpaired run)
+static void nameMergeTask(void *arg, int m) {
+    NameSort *ns = arg;
+    int a = ns->bounds[2 * m], mid = ns->bounds[2 * m + 1 < ns->runs ? 2 * m + 1 : ns->runs];
+    int end = ns->bounds[2 * m + 2 <= ns->runs ? 2 * m + 2 : ns->runs];
+    int i = a, j = mid, o = a;
+    while (i < mid && j < end) ns->to[o++] = comparePatientsByName(&ns->from[j], &ns->from[i]) < 0 ? ns->from[j++] : ns->from[i++];
+    while (i < mid) ns->to[o++] = ns->from[i++];
+    while (j < end) ns->to[o++] = ns->from[j++];
+}
+
+int nameIndexRebuild(NameIndex *ix) {
+    ix->count = 0;
+    if (!nameIndexReserve(ix, tableLive(&patientTable))) return 0;
+    for (int i = 0; i < patientIds.count; i++) {
+        if (patientId(i) != 0) ix->slots[ix->count++] = i;
+    }
+    int runs = taskThreads();
+    if (runs > ix->count / NAME_SORT_RUN_MIN) runs = ix->count / NAME_SORT_RUN_MIN;
+    int bounds[TASK_MAX_THREADS + 1];
+    int *spare = runs > 1 ? malloc((size_t)ix->count * sizeof(int)) : NULL;
+    if (!spare) {
+        qsort(ix->slots, ix->count, sizeof(int), comparePatientsByName);
+        return 1;
+    }
+    for (int r = 0; r <= runs; r++) bounds[r] = (int)((long long)ix->count * r / runs);
+    NameSort ns = { ix->slots, spare, bounds, runs };
+    runTasks(runs, nameSortTask, &ns);
+    while (ns.runs > 1) {
+        runTasks((ns.runs + 1) / 2, nameMergeTask, &ns);
+        int kept = 0;
+        for (int r = 0; r <= ns.runs; r += 2) bounds[kept++] = bounds[r];
+        if (ns.runs % 2) bounds[kept++] = bounds[ns.runs];
+        ns.runs = kept - 1;
+        int *t = ns.from;
+        ns.from = ns.to;
+        ns.to = t;
+    }
+    if (ns.from != ix->slots) memcpy(ix->slots, ns.from, (size_t)ix->count * sizeof(int));
+    free(spare);
+    return 1;
+}
+
+
+/* --------------------- FUZZY NAME SEARCH --------------------- */
+// Trigram posting lists over lowercased patient names. A name is padded
+// as "  name " and every 3-byte window is posted with the patient id.
+// Ids (not slots) are posted so compaction does not invalidate lists;
+// deleted ids are skipped at query time and pruned when lists are rebuilt.
+// A query collects candidates sharing enough trigrams with it, then
+// confirms each with a bounded edit distance.
+
+#define SEARCH_MAX_RESULTS 20 // Prefix/fuzzy matches shown per search
+
+typedef struct {
+    int count;
+    int cap;
+    int *ids; // ascending, since ids are handed out in increasing order
+} PostingList;
+
+typedef struct {
+    int cap;            // buckets, power of two (or 0)
+    int used;
+    unsigned *keys;     // trigram code + 1; 0 marks an empty bucket
+    PostingList *lists;
+} TrigramIndex;
+
+TrigramIndex patientTrigrams = { 0, 0, NULL, NULL };
+
+// Fills grams[] with the trigram codes of name. Returns how many.
+static int nameTrigrams(const char *name, unsigned *grams, int max) {
+    unsigned char buf[104];
+    int n = 0;
+    buf[n++] = ' '; buf[n++] = ' ';
+    for (const char *c = name; *c && n < (int)sizeof(buf) - 1; c++) buf[n++] = (unsigned char)tolower((unsigned char)*c);
+    buf[n++] = ' ';
+    int g = 0;
+    for (int i = 0; i + 2 < n && g < max; i++) {
+        grams[g++] = ((unsigned)buf[i] << 16) | ((unsigned)buf[i+1] << 8) | buf[i+2];
+    }
+    return g;
+}
+
+static PostingList* trigramFind(const TrigramIndex *ix, unsigned gram) {
+    if (ix->cap == 0) return NULL;
+    unsigned mask = ix->cap - 1;
+    for (unsigned b = idHash((int)gram) & mask; ix->keys[b] != 0; b = (b + 1) & mask) {
+        if (ix->keys[b] == gram + 1) return &ix->lists[b];
+    }
+    return NULL;
+}
+
+static PostingList* trigramFindOrAdd(TrigramIndex *ix, unsigned gram) {
+    PostingList *pl = trigramFind(ix, gram);
+    if (pl) return pl;
+    if ((ix->used + 1) * 10 > ix->cap * 7) {
+        int newCap = ix->cap ? ix->cap * 2 : 1024;
+        unsigned *keys = calloc(newCap, sizeof(unsigned));
+        PostingList *lists = calloc(newCap, sizeof(PostingList));
+        if (!keys || !lists) { free(keys); free(lists); return NULL; }
+        for (int i = 0; i < ix->cap; i++) {
+            if (ix->keys[i] == 0) continue;
+            unsigned b = idHash((int)(ix->keys[i] - 1)) & (newCap - 1);
+            while (keys[b] != 0) b = (b + 1) & (newCap - 1);
+            keys[b] = ix->keys[i];
+            lists[b] = ix->lists[i];
+        }
+        free(ix->keys); free(ix->lists);
+        ix->keys = keys; ix->lists = lists; ix->cap = newCap;
+    }
+    unsigned mask = ix->cap - 1;
+    unsigned b = idHash((int)gram) & mask;
+    while (ix->keys[b] != 0) b = (b + 1) & mask;
+    ix->keys[b] = gram + 1;
+    ix->used++;
+    return &ix->lists[b];
+}
+
+// Posts every trigram of a patient's name. Returns 0 if memory is exhausted.
+int trigramIndexAdd(TrigramIndex *ix, const char *name, int id) {
+    unsigned grams[104];
+    int g = nameTrigrams(name, grams, 104);
+    for (int i = 0; i < g; i++) {
+        PostingList *pl = trigramFindOrAdd(ix, grams[i]);
+        if (!pl) return 0;
+        if (pl->count > 0 && pl->ids[pl->count - 1] == id) continue; // Repeated trigram
+        if (pl->count == pl->cap) {
+            int newCap = pl->cap ? pl->cap * 2 : 4;
+            int *ids = realloc(pl->ids, newCap * sizeof(int));
+            if (!ids) return 0;
+            pl->ids = ids;
+            pl->cap = newCap;
+        }
+        pl->ids[pl->count++] = id;
+    }
+    return 1;
+}
+
+// Large rebuilds index one range of rows per thread, then append the
+// partial lists in row order, which keeps every list ascending
+#define TRIGRAM_PART_MIN 16384
+
+typedef struct {
+    TrigramIndex parts[TASK_MAX_THREADS];
+    int count;
+    int ok[TASK_MAX_THREADS];
+} TrigramBuild;
+
+static void trigramPartTask(void *arg, int k) {
+    TrigramBuild *tb = arg;
+    int from = (int)((long long)patientIds.count * k / tb->count);
+    int to = (int)((long long)patientIds.count * (k + 1) / tb->count);
+    tb->ok[k] = 1;
+    for (int i = from; i < to && tb->ok[k]; i++) {
+        if (patientId(i) != 0) tb->ok[k] = trigramIndexAdd(&tb->parts[k], patientName(i), patientId(i));
+    }
+}
+
+static void trigramIndexFree(TrigramIndex *ix) {
+    for (int i = 0; i < ix->cap; i++) free(ix->lists[i].ids);
+    free(ix->keys);
+    free(ix->lists);
+}
+
+// Empties every list and re-posts the live patients
+int trigramIndexRebuild(TrigramIndex *ix) {
+    for (int i = 0; i < ix->cap; i++) ix->lists[i].count = 0;
+    int parts = taskThreads();
+    if (parts > patientIds.count / TRIGRAM_PART_MIN) parts = patientIds.count / TRIGRAM_PART_MIN;
+    if (parts <= 1) {
+        for (int i = 0; i < patientIds.count; i++) {
+            if (patientId(i) != 0 && !trigramIndexAdd(ix, patientName(i), patientId(i))) return 0;
+        }
+        return 1;
+    }
+    TrigramBuild *tb = calloc(1, sizeof(TrigramBuild));
+    if (!tb) return 0;
+    tb->count = parts;
+    runTasks(parts, trigramPartTask, tb);
+    int ok = 1;
+    for (int k = 0; k < parts; k++) {
+        const TrigramIndex *part = &tb->parts[k];
+        ok = ok && tb->ok[k];
+        for (int b = 0; ok && b < part->cap; b++) {
+            const PostingList *from = &part->lists[b];
+            if (part->keys[b] == 0 || from->count == 0) continue;
+            PostingList *pl = trigramFindOrAdd(ix, part->keys[b] - 1);
+            if (!pl) { ok = 0; break; }
+            if (pl->count + from->count > pl->cap) {
+                int *ids = realloc(pl->ids, (size_t)(pl->count + from->count) * sizeof(int));
+                if (!ids) { ok = 0; break; }
+                pl->ids = ids;
+                pl->cap = pl->count + from->count;
+            }
+            memcpy(pl->ids + pl->count, from->ids, (size_t)from->count * sizeof(int));
+            pl->count += from->count;
+        }
+    }
+    for (int k = 0; k < parts; k++) trigramIndexFree(&tb->parts[k]);
+    free(tb);
+    return ok;
+}
+
+// Case-insensitive edit distance, giving up (returning limit+1) as soon
+// as every cell in a row exceeds limit
+static int boundedEditDistance(const char *a, const char *b, int limit) {
+    int la = (int)strlen(a), lb = (int)strlen(b);
+    if (la > 99) la = 99;
+    if (lb > 99) lb = 99;
+    if (abs(la - lb) > limit) return limit + 1;
+    int prev[100], cur[100];
+    for (int j = 0; j <= lb; j++) prev[j] = j;
+    for (int i = 1; i <= la; i++) {
+        cur[0] = i;
+        int rowMin = cur[0];
+        for (int j = 1; j <= lb; j++) {
+            int cost = tolower((unsigned char)a[i-1]) != tolower((unsigned char)b[j-1]);
+            int v = prev[j-1] + cost;
+            if (prev[j] + 1 < v) v = prev[j] + 1;
+            if (cur[j-1] + 1 < v) v = cur[j-1] + 1;
+            cur[j] = v;
+            if (v < rowMin) rowMin = v;
+        }
+        if (rowMin > limit) return limit + 1;
+        memcpy(prev, cur, (lb + 1) * sizeof(int));
+    }
+    return prev[lb];
+}
+
+typedef struct { int slot; int dist; } FuzzyMatch;
+
+static int compareFuzzyMatches(const void *a, const void *b) {
+    const FuzzyMatch *x = a, *y = b;
+    if (x->dist != y->dist) return x->dist - y->dist;
+    return x->slot - y->slot;
+}
+
+// Finds up to max patients whose names are within a small edit distance
+// of query (1 for short queries, 2 otherwise), closest first.
+// Returns the number of matches written to out.
+int fuzzyFindPatients(const char *query, FuzzyMatch *out, int max) {
+    indexNeed(X_TRIGRAMS);
+    unsigned grams[104];
+    int g = nameTrigrams(query, grams, 104);
+    int limit = strlen(query) <= 4 ? 1 : 2;
+    // One edit destroys at most three trigrams
+    int need = g - 3 * limit;
+    if (need < 1) need = 1;
+
+    // Count shared trigrams per candidate id in a small open-addressed table
+    int cap = 256;
+    long long postings = 0;
+    for (int i = 0; i < g; i++) {
+        PostingList *pl = trigramFind(&patientTrigrams, grams[i]);
+        if (pl) postings += pl->count;
+    }
+    while (cap < postings * 2) cap *= 2;
+    int *ids = calloc(cap, sizeof(int));
+    int *hits = calloc(cap, sizeof(int));
+    if (!ids || !hits) { free(ids); free(hits); return 0; }
+    int used = 0;
+    for (int i = 0; i < g; i++) {
+        int dup = 0;
+        for (int k = 0; k < i; k++) if (grams[k] == grams[i]) dup = 1;
+        PostingList *pl = dup ? NULL : trigramFind(&patientTrigrams, grams[i]);
+        if (!pl) continue;
+        for (int k = 0; k < pl->count; k++) {
+            unsigned b = idHash(pl->ids[k]) & (cap - 1);
+            while (ids[b] != 0 && ids[b] != pl->ids[k]) b = (b + 1) & (cap - 1);
+            if (ids[b] == 0) { ids[b] = pl->ids[k]; used++; }
+            hits[b]++;
+        }
+    }
+
+    int n = 0, total = 0;
+    FuzzyMatch *all = malloc((used ? used : 1) * sizeof(FuzzyMatch));
+    for (int b = 0; all && b < cap; b++) {
+        if (ids[b] == 0 || hits[b] < need) continue;
+        int slot = findPatientIndex(ids[b]);
+        if (slot == -1) continue; // Deleted since it was posted
+        int d = boundedEditDistance(query, patientName(slot), limit);
+        if (d <= limit) { all[total].slot = slot; all[total].dist = d; total++; }
+    }
+    if (all) {
+        qsort(all, total, sizeof(FuzzyMatch), compareFuzzyMatches);
+        n = total < max ? total : max;
+        memcpy(out, all, n * sizeof(FuzzyMatch));
+    }
+    free(all); free(ids); free(hits);
+    return n;
+}
+
+
+/* --------------------- FILTERS --------------------- */
+// Ad-hoc patient queries such as "age 60 to 80, disease Flu, doctor 2".
+// Each condition is a range test lo <= value <= hi on one int column
+// (equality is a range of one; text fields compare interned handles).
+// A query runs one condition at a time over whole columns into a bitmap
+// of matching slots, 64 rows per word: the first condition fills it, and
+// each later one only reads the rows of words still non-zero, so a
+// selective first condition keeps the others from touching most of
+// their column. The inner test is branch-free, which lets the compiler
+// vectorize it, and large tables are split across threads by word range.
+
+#define FILTER_MAX 8
+#define FILTER_TASK_WORDS 4096 // 262144 rows per task
+
+typedef struct {
+    const RecordStore *col;
+    int lo, hi;
+} Filter;
+
+typedef struct {
+    Filter terms[FILTER_MAX]; // the last is kept for filterPatients()' live-row test
+    int count;
+    int none; // a condition no row can meet (e.g. an unknown disease)
+} PatientQuery;
+
+// Bits of the n (<= 64) values at v that lie in [lo, lo + span]
+static inline unsigned long long filterWord(const int *v, int n, unsigned lo, unsigned span) {
+    unsigned long long m = 0;
+    for (int j = 0; j < n; j++) m |= (unsigned long long)((unsigned)v[j] - lo <= span) << j;
+    return m;
+}
+
+// Full words, kept separate so the loop has a constant trip count
+static inline unsigned long long filterWord64(const int *v, unsigned lo, unsigned span) {
+    unsigned long long m = 0;
+    for (int j = 0; j < 64; j++) m |= (unsigned long long)((unsigned)v[j] - lo <= span) << j;
+    return m;
+}
+
+// Applies term f to bitmap words [from, to) of rows matching so far
+// (all rows if first)
+static void filterWords(const Filter *f, unsigned long long *bits, int rows, int from, int to, int first) {
+    unsigned lo = (unsigned)f->lo, span = (unsigned)f->hi - (unsigned)f->lo;
+    for (int w = from; w < to; w++) {
+        if (!first && !bits[w]) continue;
+        int r = w * 64, n = rows - r < 64 ? rows - r : 64;
+        unsigned long long m;
+        if (n == 64 && storeRun(f->col, r) >= 64) {
+            m = filterWord64(intAt(f->col, r), lo, span);
+        } else {
+            int v[64];
+            for (int j = 0; j < n; j++) v[j] = *intAt(f->col, r + j);
+            m = filterWord(v, n, lo, span);
+        }
+        bits[w] = first ? m : bits[w] & m;
+    }
+}
+
+typedef struct {
+    const PatientQuery *q;
+    unsigned long long *bits;
+    int rows, words;
+} FilterRun;
+
+static void filterTask(void *arg, int task) {
+    FilterRun *run = arg;
+    int from = task * FILTER_TASK_WORDS;
+    int to = from + FILTER_TASK_WORDS < run->words ? from + FILTER_TASK_WORDS : run->words;
+    for (int t = 0; t < run->q->count; t++) filterWords(&run->q->terms[t], run->bits, run->rows, from, to, t == 0);
+}
+
+// Starts a query that matches every live patient
+void queryInit(PatientQuery *q) {
+    q->count = 0;
+    q->none = 0;
+}
+
+// Adds "lo <= col <= hi". Returns 0 if the query is full.
+int queryRange(PatientQuery *q, const RecordStore *col, int lo, int hi) {
+    if (q->count == FILTER_MAX - 1) return 0;
+    if (lo > hi) q->none = 1;
+    q->terms[q->count++] = (Filter){ col, lo, hi };
+    return 1;
+}
+
+// Adds "field is text" for an interned field (gender, disease)
+int queryText(PatientQuery *q, const RecordStore *col, const char *text, size_t maxLen) {
+    int h = internFind(&interned, text, maxLen);
+    if (h < 0) q->none = 1; // Never stored, so nobody has it
+    return queryRange(q, col, h, h);
+}
+
+// The patient query screens and commands offer: ages from minAge to
+// maxAge, then gender, condition and doctor unless empty (or 0). A
+// condition is spelled as its disease reference, as intake stores it.
+void queryPatients(PatientQuery *q, int minAge, int maxAge, const char *gender, const char *disease, int doctorId) {
+    queryInit(q);
+    if (minAge != INT_MIN || maxAge != INT_MAX) queryRange(q, &patientAges, minAge, maxAge);
+    if (*gender) queryText(q, &patientGenders, gender, strlen(gender));
+    if (*disease) {
+        int ref = findDiseaseByName(disease);
+        if (ref != -1) disease = diseaseAt(ref)->name;
+        queryText(q, &patientDiseases, disease, strlen(disease));
+    }
+    if (doctorId) queryRange(q, &patientDoctorIds, doctorId, doctorId);
+}
+
+// Runs q over all patient slots. Returns a bitmap of matching slots
+// (free() it) and sets *matches, or NULL if memory is exhausted.
+unsigned long long* filterPatients(const PatientQuery *q, int *matches) {
+    int rows = patientIds.count, words = (rows + 63) / 64;
+    unsigned long long *bits = calloc((size_t)(words ? words : 1), sizeof(unsigned long long));
+    if (!bits) return NULL;
+    *matches = 0;
+    if (q->none) return bits;
+    // The live-row test goes last: it rarely rules anything out
+    PatientQuery ordered = *q;
+    ordered.terms[ordered.count++] = (Filter){ &patientIds, 1, INT_MAX };
+    FilterRun run = { &ordered, bits, rows, words };
+    runTasks((words + FILTER_TASK_WORDS - 1) / FILTER_TASK_WORDS, filterTask, &run);
+    for (int w = 0; w < words; w++) *matches += __builtin_popcountll(bits[w]);
+    return bits;
+}
+
+// First set bit at or after slot pos, or -1
+static int filterNext(const unsigned long long *bits, int rows, int pos) {
+    if (pos >= rows) return -1;
+    int w = pos / 64;
+    unsigned long long m = bits[w] & (~0ull << (pos % 64));
+    while (!m) {
+        if (++w >= (rows + 63) / 64) return -1;
+        m = bits[w];
+    }
+    return w * 64 + __builtin_ctzll(m);
+}
+
+/* --------------------- DOCTOR SCHEDULES --------------------- */
+// Each doctor's appointments, ordered by start time. Times are parsed
+// once, when an appointment is inserted, into minutes since 1970-01-01,
+// so conflict checks and day/week lookups are binary searches.
+// The schedule array runs parallel to doctorStore (doctors are never
+// deleted, so their slots are stable). Entries name the appointment by id.
+
+#define APPOINT_SLOT_MINUTES 15 // Two visits with one doctor must be this far apart
+#define MINUTES_PER_DAY (24 * 60)
+#define MAX_REPORT_DAYS 366 // Longest day range one report or query covers
+// Latest year a date may have: minutes since 1970 to the end of a report
+// range from its last day still fit in an int. The date error messages
+// name the range.
+#define MAX_DATE_YEAR 5999
+
+typedef struct {
+    int when;    // minutes since 1970-01-01 00:00
+    int apptId;
+} ScheduleEntry;
+
+typedef struct {
+    int count;
+    int cap;
+    ScheduleEntry *entries;
+} DoctorSchedule;
+
+DoctorSchedule *schedules = NULL; // indexed by doctor slot
+int scheduleCap = 0;
+
+// Days from 1970-01-01 to y-m-d in the proleptic Gregorian calendar
+static int daysFromCivil(int y, int m, int d) {
+    y -= m <= 2;
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+// Inverse of daysFromCivil
+static void civilFromDays(int z, int *y, int *m, int *d) {
+    z += 719468;
+    int era = (z >= 0 ? z : z - 146096) / 146097;
+    int doe = z - era * 146097;
+    int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int mp = (5 * doy + 2) / 153;
+    *d = doy - (153 * mp + 2) / 5 + 1;
+    *m = mp + (mp < 10 ? 3 : -9);
+    *y = yoe + era * 400 + (*m <= 2);
+}
+
+// Parses "YYYY-MM-DD". Returns the day number, or -1 if malformed or
+// outside 1970 to MAX_DATE_YEAR.
+int parseDate(const char *date) {
+    int y, m, d, n = 0;
+    if (sscanf(date, "%4d-%2d-%2d%n", &y, &m, &d, &n) != 3 || date[n] != '\0') return -1;
+    if (y < 1970 || y > MAX_DATE_YEAR || m < 1 || m > 12 || d < 1) return -1;
+    static const int mdays[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    int leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+    if (d > mdays[m - 1] + (m == 2 && leap)) return -1;
+    return daysFromCivil(y, m, d);
+}
+
+// Parses "YYYY-MM-DD" and "HH:MM". Returns minutes since 1970, or -1.
+int parseDateTime(const char *date, const char *time) {
+    int day = parseDate(date);
+    int hh, mm, n = 0;
+    if (day < 0 || sscanf(time, "%2d:%2d%n", &hh, &mm, &n) != 2 || time[n] != '\0') return -1;
+    if (hh < 0 || hh > 23 || mm < 0 || mm > 59) return -1;
+    return day * MINUTES_PER_DAY + hh * 60 + mm;
+}
+
+// Formats a day number as "YYYY-MM-DD" into buf (at least 11 bytes)
+void formatDate(int day, char *buf, size_t size) {
+    int y, m, d;
+    civilFromDays(day, &y, &m, &d);
+    snprintf(buf, size, "%04d-%02d-%02d", y, m, d);
+}
+
+// Formats minutes since 1970 as "YYYY-MM-DD" and "HH:MM"
+void formatWhen(int when, char *date, size_t dateSize, char *time, size_t timeSize) {
+    formatDate(when / MINUTES_PER_DAY, date, dateSize);
+    snprintf(time, timeSize, "%02d:%02d", when % MINUTES_PER_DAY / 60, when % 60);
+}
+
+// Makes sure there is a schedule for every doctor slot below n
+int scheduleReserve(int n) {
+    if (n <= scheduleCap) return 1;
+    int newCap = scheduleCap ? scheduleCap : 16;
+    while (newCap < n) newCap *= 2;
+    DoctorSchedule *grown = realloc(schedules, newCap * sizeof(DoctorSchedule));
+    if (!grown) return 0;
+    memset(grown + scheduleCap, 0, (newCap - scheduleCap) * sizeof(DoctorSchedule));
+    schedules = grown;
+    scheduleCap = newCap;
+    return 1;
+}
+
+// First entry starting at or after 'when'
+int scheduleLowerBound(const DoctorSchedule *ds, int when) {
+    int lo = 0, hi = ds->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ds->entries[mid].when < when) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Returns the id of an appointment of doctor slot di that overlaps a
+// visit starting at 'when', or 0 if the slot is free
+int scheduleConflict(int di, int when) {
+    indexNeed(X_SCHEDULES);
+    if (di >= scheduleCap) return 0;
+    const DoctorSchedule *ds = &schedules[di];
+    int k = scheduleLowerBound(ds, when - APPOINT_SLOT_MINUTES + 1);
+    if (k < ds->count && ds->entries[k].when < when + APPOINT_SLOT_MINUTES) return ds->entries[k].apptId;
+    return 0;
+}
+
+// Adds an entry in time order. Returns 0 if memory is exhausted.
+static int scheduleAdd(DoctorSchedule *ds, int when, int apptId) {
+    if (ds->count == ds->cap) {
+        int newCap = ds->cap ? ds->cap * 2 : 8;
+        ScheduleEntry *e = realloc(ds->entries, newCap * sizeof(ScheduleEntry));
+        if (!e) return 0;
+        ds->entries = e;
+        ds->cap = newCap;
+    }
+    int k = scheduleLowerBound(ds, when + 1); // After equal times: keeps insertion order
+    memmove(ds->entries + k + 1, ds->entries + k, (ds->count - k) * sizeof(ScheduleEntry));
+    ds->entries[k].when = when;
+    ds->entries[k].apptId = apptId;
+    ds->count++;
+    return 1;
+}
+
+static void scheduleDrop(DoctorSchedule *ds, int when, int apptId) {
+    for (int k = scheduleLowerBound(ds, when); k < ds->count && ds->entries[k].when == when; k++) {
+        if (ds->entries[k].apptId == apptId) {
+            memmove(ds->entries + k, ds->entries + k + 1, (ds->count - k - 1) * sizeof(ScheduleEntry));
+            ds->count--;
+            return;
+        }
+    }
+}
+
+// Adds an appointment to doctor slot di. Returns 0 if memory is exhausted.
+int scheduleInsert(int di, int when, int apptId) {
+    return scheduleReserve(di + 1) && scheduleAdd(&schedules[di], when, apptId);
+}
+
+void scheduleRemove(int di, int when, int apptId) {
+    if (di < scheduleCap) scheduleDrop(&schedules[di], when, apptId);
+}
+
+// Rebuilds every schedule from the appointment table (after load).
+// Appointments without a parsed time are left out.
+int scheduleRebuild() {
+    if (!scheduleReserve(doctorStore.count)) return 0;
+    for (int i = 0; i < scheduleCap; i++) schedules[i].count = 0;
+    for (int i = 0; i < appointmentIds.count; i++) {
+        int di = findDoctorIndex(appointmentDoctorId(i));
+        int when = appointmentTime(i);
+        if (appointmentId(i) == 0 || di == -1 || when < 0) continue;
+        if (!scheduleInsert(di, when, appointmentId(i))) return 0;
+    }
+    return 1;
+}
+
+/* --------------------- CALENDAR --------------------- */
+// Every appointment with a parsed time is also kept in the bucket of its
+// day, in time order like a doctor's schedule, so "today" or "this week"
+// reads only the entries of those days. There is one bucket per day over
+// the span of days in use, grown at either end like a vector, so a day's
+// bucket is found by subtraction. A bucket's count is also the
+// appointments-per-day figure of the reports.
+// Days that have closed are moved out to the archive (see ARCHIVE);
+// closedBefore records how far that has got.
+
+typedef struct {
+    DoctorSchedule *days; // bucket of day firstDay + k
+    int firstDay, dayCount;
+    int closedBefore;     // no bucket before this day holds anything
+} Calendar;
+
+Calendar calendar = { NULL, 0, 0, INT_MIN };
+
+// Today's day number, by the local clock
+int today() {
+    time_t now = time(NULL);
+    const struct tm *tm = localtime(&now);
+    return daysFromCivil(tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday);
+}
+
+// Bucket of day, or NULL if no appointment was ever on it
+static inline DoctorSchedule* calendarDay(int day) {
+    const Calendar *c = &calendar;
+    return day >= c->firstDay && day < c->firstDay + c->dayCount ? &c->days[day - c->firstDay] : NULL;
+}
+
+static inline int appointmentsOn(int day) {
+    const DoctorSchedule *b = calendarDay(day);
+    return b ? b->count : 0;
+}
+
+// Makes day part of the calendar's range. Returns 0 if memory is exhausted.
+static int calendarReserve(int day) {
+    Calendar *c = &calendar;
+    int first = c->dayCount ? c->firstDay : day, last = c->dayCount ? c->firstDay + c->dayCount : day + 1;
+    if (c->dayCount && day >= first && day < last) return 1;
+    // Overshoot by the current span, so growing is amortized O(1) per day
+    int slack = last - first + 366;
+    if (day < first || !c->dayCount) first = day - slack > 0 ? day - slack : 0;
+    if (day >= last || !c->dayCount) last = day + 1 + slack;
+    DoctorSchedule *grown = calloc((size_t)(last - first), sizeof(DoctorSchedule));
+    if (!grown) return 0;
+    if (c->dayCount) memcpy(grown + (c->firstDay - first), c->days, (size_t)c->dayCount * sizeof(DoctorSchedule));
+    free(c->days);
+    c->days = grown;
+    c->firstDay = first;
+    c->dayCount = last - first;
+    return 1;
+}
+
+// Adds an appointment to its day. Returns 0 if memory is exhausted.
+int calendarInsert(int when, int apptId) {
+    int day = when / MINUTES_PER_DAY;
+    if (!calendarReserve(day) || !scheduleAdd(calendarDay(day), when, apptId)) return 0;
+    if (day < calendar.closedBefore) calendar.closedBefore = day; // A closed day: archived on the next pass
+    return 1;
+}
+
+void calendarRemove(int when, int apptId) {
+    DoctorSchedule *b = calendarDay(when / MINUTES_PER_DAY);
+    if (b) scheduleDrop(b, when, apptId);
+}
+
+// The days the calendar covers from closedBefore up to (not including)
+// 'before', and whether any of them has appointments
+static int calendarClosing(int before, int *from, int *to) {
+    const Calendar *c = &calendar;
+    *from = c->closedBefore > c->firstDay ? c->closedBefore : c->firstDay;
+    *to = before < c->firstDay + c->dayCount ? before : c->firstDay + c->dayCount;
+    for (int d = *from; d < *to; d++) if (appointmentsOn(d)) return 1;
+    return 0;
+}
+
+// Refills every bucket from the appointment table (after load)
+int calendarRebuild() {
+    for (int k = 0; k < calendar.dayCount; k++) calendar.days[k].count = 0;
+    calendar.closedBefore = INT_MIN;
+    for (int i = 0; i < appointmentIds.count; i++) {
+        int when = appointmentTime(i);
+        if (appointmentId(i) == 0 || when < 0) continue;
+        if (!calendarInsert(when, appointmentId(i))) return 0;
+    }
+    return 1;
+}
+
+
+/* --------------------- AGGREGATES --------------------- */
+// Counts kept current as rows come and go, so the workload and census
+// reports never scan a table: patients and appointments per doctor (by
+// doctor slot, like the schedules), live patients per condition (by
+// interned handle); appointments per day are the CALENDAR buckets. The
+// core operations below adjust them by one per change; a load recounts
+// them from the columns.
+// If memory runs out while growing one of them, the counts are marked
+// stale and maintainStores() recounts them.
+//
+// The doctors of each specialization are also kept in a min-heap by
+// patient count, so the least-loaded doctor for a condition is found in
+// O(1) and kept in order in O(log D) per change (see leastLoadedDoctor).
+
+typedef struct {
+    int patients;
+    int appointments;
+} DoctorLoad;
+
+typedef struct {
+    DoctorLoad *doctors; // indexed by doctor slot
+    int doctorCap;
+    int *census;         // live patients per condition, by interned handle
+    int censusCap;
+    int unassigned;      // live patients with no (known) doctor
+    int unscheduled;     // appointments whose time did not parse
+    int stale;           // a count was missed; recount before use
+} Aggregates;
+
+Aggregates aggregates = { NULL, 0, NULL, 0, 0, 0, 0 };
+
+// Doctor slots of one specialization, least patients first (ties: oldest)
+typedef struct {
+    int *doctors;
+    int count, cap;
+} LoadQueue;
+
+LoadQueue *loadQueues = NULL; // by specialization handle
+int loadQueueCap = 0;
+int *loadQueuePos = NULL;     // by doctor slot: heap position + 1, 0 if not queued
+int loadQueuePosCap = 0;
+
+// Grows *array (of *cap ints or pairs of ints) to hold index n - 1
+static int aggregateGrow(void **array, int *cap, int n, size_t size) {
+    if (n <= *cap) return 1;
+    int newCap = *cap ? *cap : 16;
+    while (newCap < n) newCap *= 2;
+    char *grown = realloc(*array, (size_t)newCap * size);
+    if (!grown) return 0;
+    memset(grown + (size_t)*cap * size, 0, (size_t)(newCap - *cap) * size);
+    *array = grown;
+    *cap = newCap;
+    return 1;
+}
+
+// The counter for patients or appointments of the doctor in slot di
+static int* doctorLoadOf(int di, int appointments) {
+    Aggregates *g = &aggregates;
+    if (di == -1) return appointments ? NULL : &g->unassigned;
+    if (!aggregateGrow((void**)&g->doctors, &g->doctorCap, di + 1, sizeof(DoctorLoad))) return NULL;
+    return appointments ? &g->doctors[di].appointments : &g->doctors[di].patients;
+}
+
+static inline int doctorSlotOf(int did) {
+    return did ? findDoctorIndex(did) : -1;
+}
+
+static inline int loadBefore(int a, int b) {
+    int x = aggregates.doctors[a].patients, y = aggregates.doctors[b].patients;
+    return x < y || (x == y && a < b);
+}
+
+static void loadQueueSet(LoadQueue *q, int k, int di) {
+    q->doctors[k] = di;
+    loadQueuePos[di] = k + 1;
+}
+
+// Moves the doctor at position k up or down to where its load belongs
+static void loadQueueSift(LoadQueue *q, int k) {
+    int di = q->doctors[k];
+    while (k > 0 && loadBefore(di, q->doctors[(k - 1) / 2])) {
+        loadQueueSet(q, k, q->doctors[(k - 1) / 2]);
+        k = (k - 1) / 2;
+    }
+    for (;;) {
+        int c = 2 * k + 1;
+        if (c >= q->count) break;
+        if (c + 1 < q->count && loadBefore(q->doctors[c + 1], q->doctors[c])) c++;
+        if (!loadBefore(q->doctors[c], di)) break;
+        loadQueueSet(q, k, q->doctors[c]);
+        k = c;
+    }
+    loadQueueSet(q, k, di);
+}
+
+// Queues the doctor in slot di under its specialization. Returns 0 if
+// memory is exhausted.
+static int loadQueuePush(int di) {
+    Aggregates *g = &aggregates;
+    int spec = doctorAt(di)->specialization;
+    if (!aggregateGrow((void**)&g->doctors, &g->doctorCap, di + 1, sizeof(DoctorLoad)) ||
+        !aggregateGrow((void**)&loadQueues, &loadQueueCap, spec + 1, sizeof(LoadQueue)) ||
+        !aggregateGrow((void**)&loadQueuePos, &loadQueuePosCap, di + 1, sizeof(int)) ||
+        !aggregateGrow((void**)&loadQueues[spec].doctors, &loadQueues[spec].cap, loadQueues[spec].count + 1, sizeof(int))) {
+        return 0;
+    }
+    LoadQueue *q = &loadQueues[spec];
+    q->doctors[q->count++] = di;
+    loadQueueSift(q, q->count - 1);
+    return 1;
+}
+
+// Restores heap order after doctor di's patient count changed
+static void loadQueueUpdate(int di) {
+    if (di >= loadQueuePosCap || !loadQueuePos[di]) return;
+    loadQueueSift(&loadQueues[doctorAt(di)->specialization], loadQueuePos[di] - 1);
+}
+
+// Adds delta (+1 or -1) for the patient in slot
+void aggregatePatient(int slot, int delta) {
+    Aggregates *g = &aggregates;
+    int di = doctorSlotOf(patientDoctorId(slot));
+    int *load = doctorLoadOf(di, 0);
+    int disease = patientDiseaseId(slot);
+    if (!load || !aggregateGrow((void**)&g->census, &g->censusCap, disease + 1, sizeof(int))) {
+        g->stale = 1;
+        return;
+    }
+    *load += delta;
+    g->census[disease] += delta;
+    if (di != -1) loadQueueUpdate(di);
+}
+
+// Adds delta (+1 or -1) for the appointment in slot
+void aggregateAppointment(int slot, int delta) {
+    Aggregates *g = &aggregates;
+    int when = appointmentTime(slot);
+    int *load = doctorLoadOf(doctorSlotOf(appointmentDoctorId(slot)), 1);
+    if (load) *load += delta;
+    if (when < 0) g->unscheduled += delta;
+}
+
+// Recounts everything from the live rows. Returns 0 if memory is exhausted.
+int aggregatesRebuild() {
+    Aggregates *g = &aggregates;
+    if (g->doctors) memset(g->doctors, 0, (size_t)g->doctorCap * sizeof(DoctorLoad));
+    if (g->census) memset(g->census, 0, (size_t)g->censusCap * sizeof(int));
+    if (loadQueuePos) memset(loadQueuePos, 0, (size_t)loadQueuePosCap * sizeof(int));
+    for (int s = 0; s < loadQueueCap; s++) loadQueues[s].count = 0;
+    g->unassigned = g->unscheduled = g->stale = 0;
+    for (int i = 0; i < patientIds.count; i++) if (patientId(i)) aggregatePatient(i, 1);
+    for (int i = 0; i < appointmentIds.count; i++) if (appointmentId(i)) aggregateAppointment(i, 1);
+    for (int di = 0; di < doctorStore.count; di++) if (!loadQueuePush(di)) g->stale = 1;
+    return !g->stale;
+}
+
+// Recounts if a change was missed (a pending recount happens anyway)
+static void aggregatesFresh() {
+    if (aggregates.stale && indexReady(X_AGGREGATES)) aggregatesRebuild();
+}
+
+static inline DoctorLoad doctorLoad(int di) {
+    DoctorLoad none = { 0, 0 };
+    return di < aggregates.doctorCap ? aggregates.doctors[di] : none;
+}
+
+static inline int censusOf(int handle) {
+    return handle < aggregates.censusCap ? aggregates.census[handle] : 0;
+}
+
+// Slot of the doctor with the fewest patients among those whose
+// specialization is spelled like condition, or -1 if there is none
+int leastLoadedDoctor(const char *condition, size_t maxLen) {
+    indexNeed(X_AGGREGATES);
+    int spec = internFind(&interned, condition, maxLen);
+    if (spec <= 0 || spec >= loadQueueCap || !loadQueues[spec].count) return -1;
+    return loadQueues[spec].doctors[0];
+}
+
+/* --------------------- CORE OPERATIONS --------------------- */
+// These change the stores and indexes without any prompting or output.
+// The interactive screens and journal replay both go through them.
+// Inserts return the new slot (or record), or -1 (NULL) if memory is
+// exhausted.
+
+// Appends rec, which may be the store's draft slot (then nothing is copied)
+static void* insertRecord(RecordStore *s, IdIndex *ix, const void *rec, int id) {
+    void *slot = storeDraft(s);
+    if (!slot || (ix && !idIndexPut(ix, id, s->count))) return NULL;
+    if (slot != rec) memcpy(slot, rec, s->recSize);
+    s->count++;
+    return slot;
+}
+
+// Appends an empty row to t and indexes it under id (unless ix is NULL).
+// Returns the slot or -1.
+static int appendRow(Table *t, IdIndex *ix, int id) {
+    int slot = tableAppend(t);
+    if (slot < 0) return -1;
+    if (ix && !idIndexPut(ix, id, slot)) {
+        for (int c = 0; c < t->ncols; c++) storeTruncate(t->cols[c], slot);
+        return -1;
+    }
+    *intAt(t->cols[0], slot) = id;
+    return slot;
+}
+
+// Stores a patient's columns and id index entry only. Bulk loads call
+// this and rebuild the name and trigram indexes once at the end.
+static int appendPatientRow(const Patient *p) {
+    PatientText t;
+    int gender = intern(&interned, p->gender, sizeof(p->gender));
+    int disease = intern(&interned, p->disease, sizeof(p->disease));
+    if (gender < 0 || disease < 0 ||
+        !poolAdd(&stringPool, p->name, sizeof(p->name), &t.name) ||
+        !poolAdd(&stringPool, p->phone, sizeof(p->phone), &t.phone)) return -1;
+    int slot = appendRow(&patientTable, indexReady(X_PATIENT_IDS) ? &patientIndex : NULL, p->id);
+    if (slot < 0) return -1;
+    *intAt(&patientAges, slot) = p->age;
+    *intAt(&patientDoctorIds, slot) = p->doctorId;
+    *intAt(&patientGenders, slot) = gender;
+    *intAt(&patientDiseases, slot) = disease;
+    *patientText(slot) = t;
+    if (p->id >= nextPatientId) nextPatientId = p->id + 1;
+    return slot;
+}
+
+// Set while the benchmark imports: the name and trigram indexes are left
+// stale and rebuilt once at the end instead of per insert
+int deferNameIndexes = 0;
+
+int insertPatient(const Patient *p) {
+    int names = !deferNameIndexes && indexReady(X_NAMES);
+    if (names && !nameIndexReserve(&patientNameIndex, patientNameIndex.count + 1)) return -1;
+    int slot = appendPatientRow(p);
+    if (slot < 0) return -1;
+    if (indexReady(X_AGGREGATES)) aggregatePatient(slot, 1);
+    if (names) nameIndexInsert(&patientNameIndex, slot);
+    if (!deferNameIndexes && indexReady(X_TRIGRAMS)) {
+        trigramIndexAdd(&patientTrigrams, p->name, p->id); // On OOM only fuzzy search misses it
+    }
+    return slot;
+}
+
+// Moves a patient to another primary doctor
+void reassignPatientDoctor(int slot, int did) {
+    int counted = indexReady(X_AGGREGATES);
+    if (counted) aggregatePatient(slot, -1);
+    setPatientDoctorId(slot, did);
+    if (counted) aggregatePatient(slot, 1);
+}
+
+// Converts a doctor to its stored form. Returns 0 if memory is exhausted.
+static int doctorRecord(const Doctor *d, DoctorRecord *r) {
+    r->id = d->id;
+    memcpy(r->name, d->name, sizeof(r->name));
+    memcpy(r->phone, d->phone, sizeof(r->phone));
+    r->specialization = intern(&interned, d->specialization, sizeof(d->specialization));
+    return r->specialization >= 0;
+}
+
+DoctorRecord* insertDoctor(const Doctor *d) {
+    DoctorRecord *r = storeDraft(&doctorStore); // Built in place
+    if (!r || !doctorRecord(d, r) || !scheduleReserve(doctorStore.count + 1)) return NULL;
+    DoctorRecord *slot = insertRecord(&doctorStore, &doctorIndex, r, d->id);
+    if (slot && d->id < nextDoctorId) aggregates.stale = 1; // Rows may already name this id
+    if (slot && indexReady(X_AGGREGATES) && !loadQueuePush(doctorStore.count - 1)) aggregates.stale = 1;
+    if (slot && d->id >= nextDoctorId) nextDoctorId = d->id + 1;
+    return slot;
+}
+
+Disease* insertDisease(const Disease *d) {
+    Disease *slot = insertRecord(&diseaseStore, NULL, d, d->id);
+    if (slot && d->id >= nextDiseaseId) nextDiseaseId = d->id + 1;
+    return slot;
+}
+
+// A zeroed disease to fill in where it will be stored; passing it to
+// insertDisease() (or registerDisease()) then adds it without a copy.
+// Good until another disease is added. NULL if memory is exhausted.
+Disease* diseaseDraft() {
+    Disease *d = storeDraft(&diseaseStore);
+    if (d) memset(d, 0, sizeof(*d));
+    return d;
+}
+
+// Stores an appointment's columns and id index entry only (see
+// appendPatientRow). A date/time that does not parse (possible only in
+// old files) is kept as text, with a time of -1.
+static int appendAppointmentRow(const Appointment *a) {
+    int when = parseDateTime(a->date, a->time);
+    StrRef old = 0;
+    if (when < 0) {
+        char text[sizeof(a->date) + sizeof(a->time) + 1];
+        snprintf(text, sizeof(text), "%.*s %.*s", (int)sizeof(a->date), a->date, (int)sizeof(a->time), a->time);
+        if (!poolAdd(&stringPool, text, sizeof(text), &old)) return -1;
+    }
+    int slot = appendRow(&appointmentTable, indexReady(X_APPOINTMENT_IDS) ? &appointmentIndex : NULL, a->id);
+    if (slot < 0) return -1;
+    *intAt(&appointmentPatientIds, slot) = a->patientId;
+    *intAt(&appointmentDoctorIds, slot) = a->doctorId;
+    *intAt(&appointmentTimes, slot) = when;
+    *(StrRef*)storeAt(&appointmentOldText, slot) = old;
+    if (a->id >= nextAppointmentId) nextAppointmentId = a->id + 1;
+    return slot;
+}
+
+// Appointments without a parsed time are stored but left off the
+// doctor's schedule and the calendar
+int insertAppointment(const Appointment *a) {
+    int slot = appendAppointmentRow(a);
+    if (slot < 0) return -1;
+    int di = findDoctorIndex(a->doctorId);
+    int when = appointmentTime(slot);
+    int scheduled = di != -1 && indexReady(X_SCHEDULES);
+    int placed = when < 0 || ((!scheduled || scheduleInsert(di, when, a->id)) &&
+                              (!indexReady(X_CALENDAR) || calendarInsert(when, a->id)));
+    if (!placed) {
+        if (scheduled) scheduleRemove(di, when, a->id); // A no-op if it never got in
+        if (indexReady(X_APPOINTMENT_IDS)) idIndexRemove(&appointmentIndex, a->id);
+        for (int c = 0; c < appointmentTable.ncols; c++) storeTruncate(appointmentTable.cols[c], slot);
+        return -1;
+    }
+    if (indexReady(X_AGGREGATES)) aggregateAppointment(slot, 1);
+    return slot;
+}
+
+void removePatient(int slot) {
+    if (indexReady(X_AGGREGATES)) aggregatePatient(slot, -1);
+    if (indexReady(X_NAMES)) nameIndexRemove(&patientNameIndex, slot);
+    if (indexReady(X_PATIENT_IDS)) idIndexRemove(&patientIndex, patientId(slot));
+    PatientText *t = patientText(slot);
+    poolRelease(&stringPool, t->name);
+    poolRelease(&stringPool, t->phone);
+    tableKill(&patientTable, slot);
+}
+
+void removeAppointment(int slot) {
+    int di = findDoctorIndex(appointmentDoctorId(slot));
+    int when = appointmentTime(slot);
+    if (di != -1 && when >= 0 && indexReady(X_SCHEDULES)) scheduleRemove(di, when, appointmentId(slot));
+    if (when >= 0 && indexReady(X_CALENDAR)) calendarRemove(when, appointmentId(slot));
+    if (indexReady(X_AGGREGATES)) aggregateAppointment(slot, -1);
+    if (indexReady(X_APPOINTMENT_IDS)) idIndexRemove(&appointmentIndex, appointmentId(slot));
+    poolRelease(&stringPool, *(StrRef*)storeAt(&appointmentOldText, slot));
+    tableKill(&appointmentTable, slot);
+}
+
+// Writes an appointment's date and time as text (the original text for
+// old rows whose time never parsed)
+void appointmentDateTime(int slot, char *date, size_t dateSize, char *time, size_t timeSize) {
+    int when = appointmentTime(slot);
+    if (when < 0) {
+        snprintf(date, dateSize, "%s", poolStr(&stringPool, *(StrRef*)storeAt(&appointmentOldText, slot)));
+        time[0] = '\0';
+        return;
+    }
+    formatWhen(when, date, dateSize, time, timeSize);
+}
+
+// --- Tombstone Compaction ---
+void compactPatients() {
+    tableCompact(&patientTable);
+    if (indexReady(X_PATIENT_IDS)) idIndexRebuild(&patientIndex, &patientIds);
+    if (indexReady(X_NAMES)) nameIndexRebuild(&patientNameIndex);
+    if (indexReady(X_TRIGRAMS)) trigramIndexRebuild(&patientTrigrams); // Prune deleted ids
+}
+
+void compactAppointments() {
+    tableCompact(&appointmentTable);
+    if (indexReady(X_APPOINTMENT_IDS)) idIndexRebuild(&appointmentIndex, &appointmentIds);
+}
+
+// Copies every live string into a fresh pool, dropping the garbage left
+// by deleted rows. Cold strings of live rows and interned strings get new
+// refs; nothing else holds refs.
+int compactStringPool() {
+    StringPool fresh = POOL_INIT;
+    RecordStore newTexts = STORE_INIT(PatientText);
+    RecordStore newOld = STORE_INIT(StrRef);
+    RecordStore newInterned = STORE_INIT(StrRef);
+    int ok = 1;
+    for (int h = 0; ok && h < interned.refs.count; h++) {
+        StrRef *r = storeAppend(&newInterned);
+        ok = r && poolCopy(&fresh, &stringPool, *(StrRef*)storeAt(&interned.refs, h), r);
+    }
+    for (int i = 0; ok && i < patientIds.count; i++) {
+        PatientText *t = storeAppend(&newTexts);
+        if (!t) { ok = 0; break; }
+        const PatientText *o = patientText(i);
+        ok = poolCopy(&fresh, &stringPool, o->name, &t->name) &&
+             poolCopy(&fresh, &stringPool, o->phone, &t->phone);
+    }
+    for (int i = 0; ok && i < appointmentIds.count; i++) {
+        StrRef *r = storeAppend(&newOld);
+        ok = r && poolCopy(&fresh, &stringPool, *(StrRef*)storeAt(&appointmentOldText, i), r);
+    }
+    if (!ok) {
+        poolFree(&fresh);
+        storeTruncate(&newTexts, 0);
+        storeTruncate(&newOld, 0);
+        storeTruncate(&newInterned, 0);
+        return 0;
+    }
+    // Write the new refs back in place, so mapped columns stay attached
+    for (int i = 0; i < patientIds.count; i++) *patientText(i) = *(PatientText*)storeAt(&newTexts, i);
+    for (int i = 0; i < appointmentIds.count; i++) *(StrRef*)storeAt(&appointmentOldText, i) = *(StrRef*)storeAt(&newOld, i);
+    for (int h = 0; h < interned.refs.count; h++) *(StrRef*)storeAt(&interned.refs, h) = *(StrRef*)storeAt(&newInterned, h);
+    storeTruncate(&newTexts, 0);
+    storeTruncate(&newOld, 0);
+    storeTruncate(&newInterned, 0);
+    free(newTexts.chunks);
+    free(newOld.chunks);
+    free(newInterned.chunks);
+    poolFree(&stringPool);
+    free(stringPool.blocks);
+    stringPool = fresh;
+    return 1;
+}
+
+// The stores as they stand now, as a view
+static void viewOfStores(View *v) {
+    v->version = viewVersion;
+    v->patients = patientIds.count;
+    v->appointments = appointmentIds.count;
+    v->doctors = doctorStore.count;
+    v->diseases = diseaseStore.count;
+}
+
+// Makes every change so far visible to readers that pin from now on
+void viewPublish() {
+    if (!viewsShared) return;
+    View *v = malloc(sizeof(View));
+    if (!v) return; // Readers keep the older view until the next change
+    viewOfStores(v);
+    v->version++;
+    View *old = currentView;
+    __atomic_store_n(&currentView, v, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&viewVersion, v->version, __ATOMIC_SEQ_CST);
+    if (old != &firstView) retireMemory(old);
+    reclaimRetired();
+}
+
+// Keeps readers out so rows can move. If a reader holds a view, waits
+// for it when wait is set, and otherwise gives up and returns 0.
+static int viewsFreeze(int wait) {
+    if (!viewsShared) return 1;
+    __atomic_store_n(&viewsFrozen, 1, __ATOMIC_SEQ_CST);
+    while (oldestPin()) {
+        if (!wait) {
+            __atomic_store_n(&viewsFrozen, 0, __ATOMIC_SEQ_CST);
+            return 0;
+        }
+#ifdef HAVE_SOCKETS
+        sched_yield();
+#endif
+    }
+    return 1;
+}
+
+// Publishes the moved rows and lets readers back in
+static void viewsThaw() {
+    viewPublish();
+    __atomic_store_n(&viewsFrozen, 0, __ATOMIC_SEQ_CST);
+}
+
+// Sweeps tombstones out of any table that has collected enough of them.
+// Called from the menu loop after an operation has finished, so deletes
+// themselves stay O(1). Put off while a listing holds a view: the sweep
+// runs after a later change instead of making this one wait.
+void maintainStores() {
+    aggregatesFresh();
+    int patients = tableNeedsCompact(&patientTable);
+    int appointments = tableNeedsCompact(&appointmentTable);
+    if (!(patients || appointments) || !viewsFreeze(0)) return;
+    if (patients) compactPatients();
+    if (appointments) compactAppointments();
+    viewsThaw();
+}
+
+// Lets readers (service workers, the autosave writer) work beside the
+// thread making changes: deleted rows keep stamps and outgrown memory is
+// retired rather than freed. Returns 0 if memory is exhausted.
+int shareViews() {
+    if (!tableKeepStamps(&patientTable, &patientStamps) || !tableKeepStamps(&appointmentTable, &appointmentStamps)) return 0;
+    viewsShared = 1;
+    viewPublish();
+    return 1;
+}
+
+
+/* --------------------- BLOCK COMPRESSION --------------------- */
+// A small LZ77 codec in the style of LZ4, used by packed snapshots and
+// the archive. Each block is compressed on its own, so blocks decode
+// independently. A block is a run of sequences: a token byte (literal
+// count in the high nibble, match length minus LZ_MIN_MATCH in the low;
+// 15 means more length bytes follow, adding up to 255 each), the
+// literals, then a 2-byte little-endian match offset and any extra
+// match-length bytes. The last sequence of a block has literals only.
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+#define LZ_MAX_OFFSET 65535
+
+// Room that compressing n bytes may need
+static inline size_t lzBound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+static size_t lzPutLength(unsigned char *dst, size_t o, size_t len) {
+    for (; len >= 255; len -= 255) dst[o++] = 255;
+    dst[o++] = (unsigned char)len;
+    return o;
+}
+
+// Writes one sequence: litLen literals, then (unless matchLen is 0) a
+// match of matchLen bytes offset bytes back
+static size_t lzSequence(unsigned char *dst, size_t o, const unsigned char *lit, size_t litLen, size_t offset, size_t matchLen) {
+    size_t m = matchLen ? matchLen - LZ_MIN_MATCH : 0;
+    dst[o++] = (unsigned char)((litLen < 15 ? litLen : 15) << 4 | (m < 15 ? m : 15));
+    if (litLen >= 15) o = lzPutLength(dst, o, litLen - 15);
+    memcpy(dst + o, lit, litLen);
+    o += litLen;
+    if (!matchLen) return o;
+    dst[o++] = (unsigned char)(offset & 255);
+    dst[o++] = (unsigned char)(offset >> 8);
+    if (m >= 15) o = lzPutLength(dst, o, m - 15);
+    return o;
+}
+
+// Compresses n bytes of src into dst, which has lzBound(n) bytes.
+// Returns the compressed length.
+size_t lzCompress(const unsigned char *src, size_t n, unsigned char *dst) {
+    int table[1 << LZ_HASH_BITS]; // last position of each 4-byte hash
+    memset(table, 0xff, sizeof(table));
+    size_t i = 0, anchor = 0, o = 0;
+    while (i + LZ_MIN_MATCH <= n) {
+        unsigned v;
+        memcpy(&v, src + i, 4);
+        unsigned h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int cand = table[h];
+        table[h] = (int)i;
+        if (cand < 0 || i - (size_t)cand > LZ_MAX_OFFSET || memcmp(src + cand, src + i, 4) != 0) {
+            i++;
+            continue;
+        }
+        size_t len = LZ_MIN_MATCH;
+        while (i + len < n && src[cand + len] == src[i + len]) len++;
+        o = lzSequence(dst, o, src + anchor, i - anchor, i - (size_t)cand, len);
+        i += len;
+        anchor = i;
+    }
+    return lzSequence(dst, o, src + anchor, n - anchor, 0, 0);
+}
+
+static int lzGetLength(const unsigned char *src, size_t n, size_t *i, size_t *len) {
+    for (;;) {
+        if (*i >= n || *len > ((size_t)1 << 30)) return 0;
+        unsigned char c = src[(*i)++];
+        *len += c;
+        if (c != 255) return 1;
+    }
+}
+
+// Decompresses n bytes of src into dst, which must come out exactly
+// rawLen bytes long. Returns 0 if the block is damaged.
+int lzDecompress(const unsigned char *src, size_t n, unsigned char *dst, size_t rawLen) {
+    size_t i = 0, o = 0;
+    while (i < n) {
+        unsigned token = src[i++];
+        size_t lit = token >> 4;
+        if (lit == 15 && !lzGetLength(src, n, &i, &lit)) return 0;
+        if (lit > n - i || lit > rawLen - o) return 0;
+        memcpy(dst + o, src + i, lit);
+        i += lit;
+        o += lit;
+        if (i == n) break; // The last sequence
+        if (n - i < 2) return 0;
+        size_t offset = (size_t)src[i] | (size_t)src[i + 1] << 8;
+        i += 2;
+        size_t len = token & 15;
+        if (len == 15 && !lzGetLength(src, n, &i, &len)) return 0;
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > o || len > rawLen - o) return 0;
+        unsigned char *d = dst + o;
+        const unsigned char *from = d - offset;
+        if (offset >= len) memcpy(d, from, len);
+        else for (size_t k = 0; k < len; k++) d[k] = from[k]; // Overlapping: repeats the run
+        o += len;
+    }
+    return o == rawLen;
+}
+
+/* --------------------- ARCHIVE --------------------- */
+// Appointments of days that have closed are moved out of the tables into
+// ARCHIVE_FILE, which loadData() never reads: only the archive report
+// and query open it. The file is a run of blocks, one per day archived:
+// an ArchiveBlock header, then that day's appointments as four int
+// columns (ids, patients, doctors, times), compressed (see BLOCK
+// COMPRESSION). Blocks are only ever appended, at the end of the file;
+// only a block torn by a crash mid-write, as the file's last bytes, is
+// written over. Readers skip a damaged block by searching on for the
+// next header that looks whole, so it costs only itself.
+// A pass is journaled before it runs (J_ARCHIVE_DAYS), so replay and
+// replicas redo it from their own rows, and each copy of the data keeps
+// its own archive. Redoing it after a crash may write a day twice;
+// readers keep one copy of each appointment.
+
+#define ARCHIVE_MAGIC 0x31435241u // "ARC1"
+#define ARCHIVE_KEEP_DAYS 30 // Closed days left in the tables by default
+
+typedef struct {
+    unsigned magic;
+    int day;
+    int count;          // appointments in the block
+    unsigned packedLen; // compressed bytes that follow
+    unsigned crc;       // crc32 of those bytes
+} ArchiveBlock;
+
+typedef struct {
+    int id, patientId, doctorId, when;
+} ArchivedAppointment;
+
+int archiveKeepDays = ARCHIVE_KEEP_DAYS; // Set by --keep-days; -1 never archives
+
+static inline int archiveBlockValid(const ArchiveBlock *b) {
+    return b->magic == ARCHIVE_MAGIC && b->count > 0 && (size_t)b->count <= INT_MAX / sizeof(ArchivedAppointment) &&
+           b->packedLen <= lzBound((size_t)b->count * sizeof(ArchivedAppointment));
+}
+
+// Decodes the block whose header was just read from fp onto the end of
+// *rows. Returns 0 if it is damaged or memory ran out.
+static int archiveUnpack(FILE *fp, const ArchiveBlock *b, ArchivedAppointment **rows, int *count, int *cap) {
+    int n = b->count;
+    size_t raw = (size_t)n * sizeof(ArchivedAppointment);
+    unsigned char *packed = malloc(b->packedLen ? b->packedLen : 1);
+    int *cols = malloc(raw);
+    int ok = packed && cols && fread(packed, 1, b->packedLen, fp) == b->packedLen &&
+             crc32Update(0, packed, b->packedLen) == b->crc && lzDecompress(packed, b->packedLen, (unsigned char*)cols, raw);
+    if (ok && *count + n > *cap) {
+        int newCap = *cap ? *cap : 256;
+        while (newCap < *count + n) newCap *= 2;
+        ArchivedAppointment *grown = realloc(*rows, (size_t)newCap * sizeof(ArchivedAppointment));
+        ok = grown != NULL;
+        if (ok) {
+            *rows = grown;
+            *cap = newCap;
+        }
+    }
+    for (int k = 0; ok && k < n; k++) {
+        ArchivedAppointment *r = &(*rows)[(*count)++];
+        r->id = cols[k];
+        r->patientId = cols[n + k];
+        r->doctorId = cols[2 * n + k];
+        r->when = cols[3 * n + k];
+    }
+    free(packed);
+    free(cols);
+    return ok;
+}
+
+// Reads the block header at pos. Returns 1 if it is valid and its bytes
+// end within the file.
+static int archiveHeaderAt(FILE *fp, long pos, long size, ArchiveBlock *b) {
+    return size - pos >= (long)sizeof(*b) && fseek(fp, pos, SEEK_SET) == 0 && fread(b, sizeof(*b), 1, fp) == 1 &&
+           archiveBlockValid(b) && (long)b->packedLen <= size - pos - (long)sizeof(*b);
+}
+
+// Walks the blocks of fp from the start, decoding those of days from
+// 'from' up to 'to' onto *rows (when rows is given). Returns where the
+// next block goes: the start of a torn last block, else the end of the
+// file (-1 if fp cannot be read).
+static long archiveWalk(FILE *fp, int from, int to, ArchivedAppointment **rows, int *count, int *cap) {
+    long size = fseek(fp, 0, SEEK_END) == 0 ? ftell(fp) : -1, pos = 0, damaged = -1; // Start of bytes being skipped
+    ArchiveBlock b;
+    if (size < 0) return -1;
+    while (pos < size) {
+        int whole = archiveHeaderAt(fp, pos, size, &b);
+        if (whole && rows && b.day >= from && b.day < to) whole = archiveUnpack(fp, &b, rows, count, cap);
+        if (!whole) {
+            if (damaged < 0) damaged = pos;
+            pos++; // Search on byte by byte; packedLen may be what was damaged
+            continue;
+        }
+        if (damaged >= 0 && rows) printf(YELLOW "?? Skipped a damaged part of %s.\n" RESET_COLOR, ARCHIVE_FILE);
+        damaged = -1;
+        pos += (long)sizeof(b) + (long)b.packedLen;
+    }
+    if (damaged < 0) return size;
+    if (rows) printf(YELLOW "?? Skipped a damaged part of %s.\n" RESET_COLOR, ARCHIVE_FILE);
+    // Torn: too short for a header, or a header whose bytes run past the end
+    int torn = size - damaged < (long)sizeof(b) ||
+               (fseek(fp, damaged, SEEK_SET) == 0 && fread(&b, sizeof(b), 1, fp) == 1 && archiveBlockValid(&b));
+    return torn ? damaged : size;
+}
+
+// Appends the appointments of one day's bucket as a block. Returns 0 if
+// it could not be written.
+static int archiveWriteDay(FILE *fp, int day, const DoctorSchedule *bucket) {
+    int n = bucket->count;
+    size_t raw = (size_t)n * sizeof(ArchivedAppointment);
+    int *cols = malloc(raw);
+    unsigned char *packed = malloc(lzBound(raw));
+    int ok = cols && packed;
+    for (int k = 0; ok && k < n; k++) {
+        int slot = findAppointmentIndex(bucket->entries[k].apptId);
+        cols[k] = bucket->entries[k].apptId;
+        cols[n + k] = slot != -1 ? appointmentPatientId(slot) : 0;
+        cols[2 * n + k] = slot != -1 ? appointmentDoctorId(slot) : 0;
+        cols[3 * n + k] = bucket->entries[k].when;
+    }
+    if (ok) {
+        ArchiveBlock h = { ARCHIVE_MAGIC, day, n, 0, 0 };
+        h.packedLen = (unsigned)lzCompress((const unsigned char*)cols, raw, packed);
+        h.crc = crc32Update(0, packed, h.packedLen);
+        ok = fwrite(&h, sizeof(h), 1, fp) == 1 && fwrite(packed, 1, h.packedLen, fp) == h.packedLen;
+    }
+    free(cols);
+    free(packed);
+    return ok;
+}
+
+// Moves the appointments of every day before 'before' out of the tables
+// and into the archive, synced before any row goes. Returns 0 (leaving
+// the rows where they are) if the archive could not be written.
+int archiveDays(int before) {
+    int from, to;
+    indexNeed(X_CALENDAR);
+    if (before <= calendar.closedBefore) return 1;
+    if (calendarClosing(before, &from, &to)) {
+        FILE *fp = fopen(ARCHIVE_FILE, "r+b");
+        if (!fp) fp = fopen(ARCHIVE_FILE, "w+b");
+        int ok = fp && fseek(fp, archiveWalk(fp, 0, 0, NULL, NULL, NULL), SEEK_SET) == 0;
+        for (int d = from; ok && d < to; d++) if (appointmentsOn(d)) ok = archiveWriteDay(fp, d, calendarDay(d));
+        if (fp && !fileSync(fp)) ok = 0;
+        if (fp) fclose(fp);
+        if (!ok) return 0;
+        for (int d = from; d < to; d++) {
+            DoctorSchedule *bucket = calendarDay(d);
+            while (bucket->count) {
+                int i = findAppointmentIndex(bucket->entries[bucket->count - 1].apptId);
+                if (i != -1) removeAppointment(i);
+                else bucket->count--;
+            }
+        }
+    }
+    calendar.closedBefore = before;
+    return 1;
+}
+
+static int compareArchived(const void *a, const void *b) {
+    const ArchivedAppointment *x = a, *y = b;
+    if (x->when != y->when) return x->when < y->when ? -1 : 1;
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+// Reads the archived appointments of days from 'from' up to 'to' into
+// *rows (to be freed), in time order. Returns how many. The file is
+// read afresh each time.
+int archiveRead(int from, int to, ArchivedAppointment **rows) {
+    int count = 0, cap = 0;
+    *rows = NULL;
+    FILE *fp = fopen(ARCHIVE_FILE, "rb");
+    if (!fp) return 0;
+    archiveWalk(fp, from, to, rows, &count, &cap);
+    fclose(fp);
+    if (!count) return 0;
+    qsort(*rows, (size_t)count, sizeof(ArchivedAppointment), compareArchived);
+    int kept = 0;
+    for (int k = 0; k < count; k++) {
+        if (kept && (*rows)[kept - 1].id == (*rows)[k].id) continue; // The same day archived twice
+        (*rows)[kept++] = (*rows)[k];
+    }
+    return kept;
+}
+
+/* --------------------- JOURNAL --------------------- */
+// Every mutation is appended to JOURNAL_FILE as one small record and
+// synced to disk before the operation reports success. saveData() writes
+// a full snapshot and empties the journal (a checkpoint); loadData()
+// reads the snapshot and replays the journal on top of it. An autosave
+// first moves the journal aside to JOURNAL_OLD_FILE and deletes it once
+// its snapshot is written; loading replays that file first.
+//
+// Record layout: JournalHeader, then 'len' payload bytes. The payload is
+// a list of fields (ints and length-prefixed strings), so it does not
+// depend on the in-memory struct layout. Replay is idempotent by id, so
+// a crash between writing the snapshot and emptying the journal is safe.
+
+enum {
+    J_ADD_PATIENT = 1,
+    J_DELETE_PATIENT,
+    J_SET_PATIENT_DOCTOR,
+    J_ADD_DOCTOR,
+    J_ADD_DISEASE,
+    J_ADD_APPOINTMENT,
+    J_CANCEL_APPOINTMENT,
+    J_ARCHIVE_DAYS
+};
+
+typedef struct {
+    int op;
+    int len;       // payload bytes
+    unsigned crc;  // crc32 of op and payload
+} JournalHeader;
+
+#define JOURNAL_MAX_PAYLOAD 1024
+
+typedef struct {
+    unsigned char data[JOURNAL_MAX_PAYLOAD];
+    int len;  // bytes written (or read, when decoding)
+    int bad;  // set on overflow or truncated input
+} JBuf;
+
+FILE *journalFp = NULL;
+int journalSync = 1;     // fsync after every record
+int journalBuffered = 0; // batch mode: leave records in the stdio buffer; the run ends with a sync
+int journalChanges = 0;  // records appended since the last snapshot (or autosave) began
+
+#ifdef HAVE_SOCKETS
+// In service mode every record appended is also kept here, numbered from
+// 0 in the order written, for the replica feeds to send on (see
+// REPLICATION under SERVICE MODE). Once full, the oldest half is dropped.
+#define BACKLOG_BYTES (8 << 20)
+
+typedef struct {
+    unsigned char *data;     // whole records (header and payload), oldest first
+    size_t len;
+    unsigned long long base; // stream offset of data[0]
+    unsigned long long baseSeq, endSeq; // number of the first record held, and of the next one
+    pthread_mutex_t lock;
+    pthread_cond_t grew;
+} Backlog;
+
+Backlog backlog = { NULL, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void backlogAppend(const JournalHeader *h, const unsigned char *payload) {
+    Backlog *bl = &backlog;
+    size_t n = sizeof(*h) + (size_t)h->len;
+    pthread_mutex_lock(&bl->lock);
+    if (bl->len + n > BACKLOG_BYTES) {
+        size_t drop = 0;
+        while (drop < bl->len && (drop < BACKLOG_BYTES / 2 || bl->len - drop + n > BACKLOG_BYTES)) {
+            JournalHeader old;
+            memcpy(&old, bl->data + drop, sizeof(old));
+            drop += sizeof(old) + (size_t)old.len;
+            bl->baseSeq++;
+        }
+        memmove(bl->data, bl->data + drop, bl->len - drop);
+        bl->len -= drop;
+        bl->base += drop;
+    }
+    memcpy(bl->data + bl->len, h, sizeof(*h));
+    memcpy(bl->data + bl->len + sizeof(*h), payload, (size_t)h->len);
+    bl->len += n;
+    bl->endSeq++;
+    pthread_cond_broadcast(&bl->grew);
+    pthread_mutex_unlock(&bl->lock);
+}
+#endif
+
+void jbPutInt(JBuf *b, int v) {
+    if (b->len + (int)sizeof(int) > JOURNAL_MAX_PAYLOAD) { b->bad = 1; return; }
+    memcpy(b->data + b->len, &v, sizeof(int));
+    b->len += sizeof(int);
+}
+
+void jbPutStr(JBuf *b, const char *str) {
+    int n = (int)strlen(str);
+    jbPutInt(b, n);
+    if (b->len + n > JOURNAL_MAX_PAYLOAD) { b->bad = 1; return; }
+    memcpy(b->data + b->len, str, n);
+    b->len += n;
+}
+
+int jbGetInt(JBuf *b, int limit) {
+    int v = 0;
+    if (b->len + (int)sizeof(int) > limit) { b->bad = 1; return 0; }
+    memcpy(&v, b->data + b->len, sizeof(int));
+    b->len += sizeof(int);
+    return v;
+}
+
+// Copies a string field into dst (truncating to size-1)
+void jbGetStr(JBuf *b, int limit, char *dst, size_t size) {
+    int n = jbGetInt(b, limit);
+    if (n < 0 || b->len + n > limit) { b->bad = 1; dst[0] = '\0'; return; }
+    size_t keep = (size_t)n < size - 1 ? (size_t)n : size - 1;
+    memcpy(dst, b->data + b->len, keep);
+    dst[keep] = '\0';
+    b->len += n;
+}
+
+// Flushes the journal through to stable storage
+void syncFile(FILE *fp) {
+    unsigned long long t = metricStart();
+    fileSync(fp);
+    metricStop(MT_JOURNAL_SYNC, t);
+}
+
+// Appends one record. Returns 0 (after warning) if it could not be written.
+int journalAppend(int op, const JBuf *b) {
+    JournalHeader h = { op, b->len, 0 };
+    h.crc = crc32Update(crc32Update(0, &h.op, sizeof(h.op)), b->data, b->len);
+#ifdef HAVE_SOCKETS
+    if (backlog.data && !b->bad) backlogAppend(&h, b->data);
+#endif
+    if (!journalFp) journalFp = fopen(JOURNAL_FILE, "ab");
+    if (!journalFp || b->bad) {
+        printf(RED "? Warning: Could not write to the journal. Use 'Save Data Now'.\n" RESET_COLOR);
+        return 0;
+    }
+    fwrite(&h, sizeof(h), 1, journalFp);
+    fwrite(b->data, 1, b->len, journalFp);
+    journalChanges++;
+    metricCount(MC_JOURNAL_RECORDS);
+    if (journalBuffered) return !ferror(journalFp);
+    if (journalSync) syncFile(journalFp); else fflush(journalFp);
+    return !ferror(journalFp);
+}
+
+void journalPatient(const Patient *p) {
+    JBuf b = { .len = 0 };
+    jbPutInt(&b, p->id);
+    jbPutStr(&b, p->name);
+    jbPutInt(&b, p->age);
+    jbPutStr(&b, p->gender);
+    jbPutStr(&b, p->phone);
+    jbPutStr(&b, p->disease);
+    jbPutInt(&b, p->doctorId);
+    journalAppend(J_ADD_PATIENT, &b);
+}
+
+void journalDoctor(const Doctor *d) {
+    JBuf b = { .len = 0 };
+    jbPutInt(&b, d->id);
+    jbPutStr(&b, d->name);
+    jbPutStr(&b, d->specialization);
+    jbPutStr(&b, d->phone);
+    journalAppend(J_ADD_DOCTOR, &b);
+}
+
+void journalDisease(const Disease *d) {
+    JBuf b = { .len = 0 };
+    jbPutInt(&b, d->id);
+    jbPutStr(&b, d->name);
+    jbPutStr(&b, d->symptoms);
+    jbPutStr(&b, d->treatment);
+    journalAppend(J_ADD_DISEASE, &b);
+}
+
+void journalAppointment(const Appointment *a) {
+    JBuf b = { .len = 0 };
+    jbPutInt(&b, a->id);
+    jbPutInt(&b, a->patientId);
+    jbPutInt(&b, a->doctorId);
+    jbPutStr(&b, a->date);
+    jbPutStr(&b, a->time);
+    journalAppend(J_ADD_APPOINTMENT, &b);
+}
+
+// For delete/cancel and other single-int-argument records
+void journalIds(int op, int id, int arg) {
+    JBuf b = { .len = 0 };
+    jbPutInt(&b, id);
+    jbPutInt(&b, arg);
+    journalAppend(op, &b);
+}
+
+// Applies one decoded record. Records already reflected in the snapshot
+// (an add whose id exists, a delete whose id is gone) are skipped.
+static void journalApply(int op, JBuf *b, int n) {
+    switch (op) {
+        case J_ADD_PATIENT: {
+            Patient p;
+            p.id = jbGetInt(b, n);
+            jbGetStr(b, n, p.name, sizeof(p.name));
+            p.age = jbGetInt(b, n);
+            jbGetStr(b, n, p.gender, sizeof(p.gender));
+            jbGetStr(b, n, p.phone, sizeof(p.phone));
+            jbGetStr(b, n, p.disease, sizeof(p.disease));
+            p.doctorId = jbGetInt(b, n);
+            if (!b->bad && findPatientIndex(p.id) == -1) insertPatient(&p);
+            break;
+        }
+        case J_DELETE_PATIENT: {
+            int i = findPatientIndex(jbGetInt(b, n));
+            if (i != -1) removePatient(i);
+            break;
+        }
+        case J_SET_PATIENT_DOCTOR: {
+            int i = findPatientIndex(jbGetInt(b, n));
+            int did = jbGetInt(b, n);
+            if (i != -1 && !b->bad) reassignPatientDoctor(i, did);
+            break;
+        }
+        case J_ADD_DOCTOR: {
+            Doctor d;
+            d.id = jbGetInt(b, n);
+            jbGetStr(b, n, d.name, sizeof(d.name));
+            jbGetStr(b, n, d.specialization, sizeof(d.specialization));
+            jbGetStr(b, n, d.phone, sizeof(d.phone));
+            if (!b->bad && findDoctorIndex(d.id) == -1) insertDoctor(&d);
+            break;
+        }
+        case J_ADD_DISEASE: {
+            Disease d;
+            d.id = jbGetInt(b, n);
+            jbGetStr(b, n, d.name, sizeof(d.name));
+            jbGetStr(b, n, d.symptoms, sizeof(d.symptoms));
+            jbGetStr(b, n, d.treatment, sizeof(d.treatment));
+            if (!b->bad && findDiseaseIndex(d.id) == -1) insertDisease(&d);
+            break;
+        }
+        case J_ADD_APPOINTMENT: {
+            Appointment a;
+            a.id = jbGetInt(b, n);
+            a.patientId = jbGetInt(b, n);
+            a.doctorId = jbGetInt(b, n);
+            jbGetStr(b, n, a.date, sizeof(a.date));
+            jbGetStr(b, n, a.time, sizeof(a.time));
+            if (!b->bad && findAppointmentIndex(a.id) == -1) insertAppointment(&a);
+            break;
+        }
+        case J_CANCEL_APPOINTMENT: {
+            int i = findAppointmentIndex(jbGetInt(b, n));
+            if (i != -1) removeAppointment(i);
+            break;
+        }
+        case J_ARCHIVE_DAYS: {
+            int before = jbGetInt(b, n);
+            if (!b->bad) archiveDays(before); // On failure the rows stay, for a later pass
+            break;
+        }
+    }
+}
+
+// Replays the journal at path. Returns the number of records applied,
+// or -1 if it ends in a torn or corrupt record (everything before it is
+// still applied).
+static int journalReplayFile(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+
+    int applied = 0;
+    JournalHeader h;
+    JBuf b;
+    while (fread(&h, sizeof(h), 1, fp) == 1) {
+        if (h.len < 0 || h.len > JOURNAL_MAX_PAYLOAD ||
+            fread(b.data, 1, h.len, fp) != (size_t)h.len ||
+            crc32Update(crc32Update(0, &h.op, sizeof(h.op)), b.data, h.len) != h.crc) {
+            applied = -1;
+            break;
+        }
+        b.len = 0;
+        b.bad = 0;
+        journalApply(h.op, &b, h.len);
+        applied++;
+    }
+    if (applied >= 0 && !feof(fp)) applied = -1; // Partial header at the end
+    fclose(fp);
+    return applied;
+}
+
+// Replays JOURNAL_OLD_FILE (left by an unfinished autosave), then
+// JOURNAL_FILE. Returns the records applied, or -1 as above.
+int journalReplay() {
+    int old = journalReplayFile(JOURNAL_OLD_FILE);
+    int now = journalReplayFile(JOURNAL_FILE);
+    return old < 0 || now < 0 ? -1 : old + now;
+}
+
+// Empties the journal once a snapshot holds everything in it
+void journalReset() {
+    if (journalFp) fclose(journalFp);
+    journalFp = fopen(JOURNAL_FILE, "wb");
+    remove(JOURNAL_OLD_FILE);
+    journalChanges = 0;
+}
+
+// Moves the journal aside to JOURNAL_OLD_FILE, for an autosave to cover,
+// so later records start a new journal. If an earlier one is still there
+// (its autosave failed), the journal is left as it is and kept whole.
+void journalRotate() {
+    FILE *old = fopen(JOURNAL_OLD_FILE, "rb");
+    if (old) {
+        fclose(old);
+        return;
+    }
+    if (journalFp) fclose(journalFp);
+    journalFp = NULL; // Reopened by the next append
+    rename(JOURNAL_FILE, JOURNAL_OLD_FILE);
+}
+
+// Archives the days that closed more than archiveKeepDays ago, if any of
+// them still hold appointments. Called between operations, like
+// maintainStores(). After a failure, tries again the next day.
+void archiveClosedDays() {
+    static int failedOn = -1;
+    int now = today();
+    int before = now - archiveKeepDays;
+    int from, to;
+    if (archiveKeepDays < 0 || failedOn == now) return;
+    indexNeed(X_CALENDAR);
+    if (before <= calendar.closedBefore) return;
+    if (!calendarClosing(before, &from, &to)) {
+        calendar.closedBefore = before; // Nothing to move
+        return;
+    }
+    journalIds(J_ARCHIVE_DAYS, before, 0);
+    if (!archiveDays(before)) {
+        printf(RED "? Warning: Could not write %s. Past appointments stay in place for now.\n" RESET_COLOR, ARCHIVE_FILE);
+        failedOn = now;
+    }
+}
+
+
+/* --------------------- PERSISTENCE --------------------- */
+// DATA_FILE layout (version 5):
+//   SnapshotHeader, then each section as a packed array, each starting on
+//   a SNAPSHOT_ALIGN boundary. A section is one table column, one of the
+//   row stores (diseases, doctors), the interned string handles or the
+//   string pool; the last section is the segment table.
+// Every section is cut into segments of whole elements, about
+// SNAPSHOT_SEGMENT_SIZE bytes each, and the segment table holds each
+// segment's CRC, section by section. Segments are written and checked
+// independently, in parallel (see PARALLEL TASKS).
+// The header records every section's offset, count, element size, first
+// segment and CRC (for the data sections, the CRC of their segment
+// CRCs), plus its own CRC. Version 4 is the same without the segment
+// table, with whole-section CRCs. On POSIX the file is mapped copy-on-write
+// (MAP_PRIVATE) and the columns and pool use the mapped bytes in place,
+// so startup does not read them; pages fault in on first use.
+// Version 3 files (before interning) are attached the same way apart
+// from the patient text and doctor sections, which are converted.
+// Older files are read row by row and converted to columns: version 2
+// (the same header over four tables of whole records) and version 1 (no
+// header: four counts, four next-ids, raw tables).
+
+#define SNAPSHOT_MAGIC 0x53444D48u // "HMDS" on little-endian disks
+#define SNAPSHOT_VERSION 5
+#define SNAPSHOT_ALIGN 64
+#define SNAPSHOT_MAX_SECTIONS 16
+#define SNAPSHOT_SEGMENT_SIZE (1 << 22)
+
+enum { T_PATIENTS, T_DISEASES, T_DOCTORS, T_APPOINTMENTS, T_COUNT };
+
+enum {
+    S_PATIENT_IDS, S_PATIENT_AGES, S_PATIENT_DOCTORS, S_PATIENT_GENDERS, S_PATIENT_DISEASES, S_PATIENT_TEXT,
+    S_DISEASES, S_DOCTORS,
+    S_APPOINT_IDS, S_APPOINT_PATIENTS, S_APPOINT_DOCTORS, S_APPOINT_TIMES, S_APPOINT_OLDTEXT,
+    S_INTERNED, S_STRINGS,
+    S_SEGMENTS, // version 5 on
+    S_COUNT
+};
+
+// Version 3 sections: where each one goes now, or -1 if it is converted
+enum { V3_PATIENT_TEXT = 3, V3_DOCTORS = 5, V3_COUNT = 12 };
+const int v3Sections[V3_COUNT] = {
+    S_PATIENT_IDS, S_PATIENT_AGES, S_PATIENT_DOCTORS, -1, S_DISEASES, -1,
+    S_APPOINT_IDS, S_APPOINT_PATIENTS, S_APPOINT_DOCTORS, S_APPOINT_TIMES, S_APPOINT_OLDTEXT, S_STRINGS
+};
+
+typedef struct {
+    StrRef name;
+    StrRef gender;
+    StrRef phone;
+    StrRef disease;
+} PatientTextV3;
+
+typedef struct {
+    long long offset;  // from the start of the file
+    int count;
+    int recSize;       // element size in the build that wrote the file
+    unsigned crc;      // crc32 of the section bytes
+    int firstSegment;  // index of its first CRC in the segment table
+} SnapshotSection;
+
+typedef struct {
+    unsigned magic;
+    int version;
+    int sectionCount;
+    unsigned headerCrc; // crc32 of the header's used part with this field zeroed
+    int nextIds[T_COUNT];
+    SnapshotSection sections[SNAPSHOT_MAX_SECTIONS];
+} SnapshotHeader;
+
+// Bytes of a header with n sections (what is stored on disk)
+#define SNAPSHOT_HEADER_SIZE(n) (offsetof(SnapshotHeader, sections) + (size_t)(n) * sizeof(SnapshotSection))
+
+// The store behind each section (the string pool has none)
+RecordStore *const snapshotStores[S_COUNT] = {
+    &patientIds, &patientAges, &patientDoctorIds, &patientGenders, &patientDiseases, &patientTexts,
+    &diseaseStore, &doctorStore,
+    &appointmentIds, &appointmentPatientIds, &appointmentDoctorIds, &appointmentTimes, &appointmentOldText,
+    &interned.refs, NULL, NULL
+};
+int *const snapshotNextIds[T_COUNT] = { &nextPatientId, &nextDiseaseId, &nextDoctorId, &nextAppointmentId };
+const size_t legacyRecSizes[T_COUNT] = { sizeof(Patient), sizeof(Disease), sizeof(Doctor), sizeof(Appointment) };
+
+#ifdef HAVE_MMAP
+void *snapshotMap = NULL; // Kept mapped for as long as stores point into it
+size_t snapshotMapLen = 0;
+#endif
+char *snapshotCopy = NULL; // The file read in whole where it is not mapped
+int snapshotTouched = 0; // Set once a load has put anything in the stores
+
+// What a snapshot holds: each section's element count (the pool's in
+// bytes) and the next ids, taken at one moment. Stores may grow past the
+// counts while it is written, and rows deleted after view version still
+// go out with their ids (see AUTOSAVE below).
+typedef struct {
+    int counts[S_COUNT];
+    int nextIds[T_COUNT];
+    unsigned version;
+} SnapshotCut;
+
+// A cut of the stores as they are now
+static void snapshotCutNow(SnapshotCut *cut) {
+    for (int sc = 0; sc < S_SEGMENTS; sc++) {
+        cut->counts[sc] = snapshotStores[sc] ? snapshotStores[sc]->count : (int)poolSize(&stringPool);
+    }
+    cut->counts[S_SEGMENTS] = 0;
+    for (int t = 0; t < T_COUNT; t++) cut->nextIds[t] = *snapshotNextIds[t];
+    cut->version = viewVersion;
+}
+
+// The table whose id column section sc is, or NULL
+static const Table* sectionTable(int sc) {
+    return sc == S_PATIENT_IDS ? &patientTable : sc == S_APPOINT_IDS ? &appointmentTable : NULL;
+}
+
+// Element size each section of the current version must have
+static int sectionRecSize(int sc) {
+    if (sc == S_SEGMENTS) return (int)sizeof(unsigned);
+    return snapshotStores[sc] ? (int)snapshotStores[sc]->recSize : 1;
+}
+
+// Bytes in each segment of a section of recSize-byte elements
+static long long segmentBytes(int recSize) {
+    return recSize > 0 && recSize < SNAPSHOT_SEGMENT_SIZE ? SNAPSHOT_SEGMENT_SIZE / recSize * recSize : recSize;
+}
+
+static int sectionSegments(const SnapshotSection *sec) {
+    long long bytes = (long long)sec->count * sec->recSize, per = segmentBytes(sec->recSize);
+    return per > 0 ? (int)((bytes + per - 1) / per) : 0;
+}
+
+// Elements [first, first + count) of section sc, bound for offset in the file
+typedef struct {
+    int sc;
+    int first, count;
+    long long offset;
+} SnapshotSegment;
+
+typedef struct {
+    FILE *fp;
+    const SnapshotCut *cut;
+    SnapshotSegment *segs;
+    unsigned *crcs; // the segment table being built
+    int failed;
+} SnapshotSave;
+
+// Writes len bytes at offset off of fp. Without threads the segments are
+// written in file order, through the stream.
+static int snapshotWriteAt(FILE *fp, const void *buf, size_t len, long long off) {
+#ifdef HAVE_THREADS
+    const char *p = buf;
+    while (len) {
+        ssize_t n = pwrite(fileno(fp), p, len, (off_t)off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t)n;
+        off += n;
+    }
+    return 1;
+#else
+    return fseek(fp, (long)off, SEEK_SET) == 0 && fwrite(buf, 1, len, fp) == len;
+#endif
+}
+
+// Gathers one segment from its store (or the pool), then checksums and
+// writes it
+static void snapshotSaveTask(void *arg, int k) {
+    SnapshotSave *sv = arg;
+    const SnapshotSegment *seg = &sv->segs[k];
+    const RecordStore *st = snapshotStores[seg->sc];
+    size_t size = st ? st->recSize : 1;
+    char *buf = malloc((size_t)seg->count * size);
+    if (!buf) {
+        __atomic_store_n(&sv->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    int end = seg->first + seg->count;
+    for (int i = seg->first; i < end;) {
+        const char *src;
+        unsigned n;
+        if (st) {
+            n = (unsigned)storeRun(st, i);
+            src = storeAt(st, i);
+        } else {
+            src = poolRun(&stringPool, (unsigned)i, &n);
+        }
+        if (n > (unsigned)(end - i)) n = (unsigned)(end - i);
+        memcpy(buf + (size_t)(i - seg->first) * size, src, n * size);
+        i += (int)n;
+    }
+    const Table *tb = sectionTable(seg->sc);
+    for (int j = 0; tb && j < seg->count; j++) {
+        int *id = (int*)buf + j;
+        if (!*id) *id = tableIdAt(tb, sv->cut->version, seg->first + j); // Deleted after the cut
+    }
+    size_t len = (size_t)seg->count * size;
+    sv->crcs[k] = crc32Update(0, buf, len);
+    if (!snapshotWriteAt(sv->fp, buf, len, seg->offset)) __atomic_store_n(&sv->failed, 1, __ATOMIC_RELAXED);
+    free(buf);
+}
+
+static unsigned snapshotHeaderCrc(SnapshotHeader h) {
+    h.headerCrc = 0;
+    if (h.sectionCount < 0 || h.sectionCount > SNAPSHOT_MAX_SECTIONS) return ~0u;
+    return crc32Update(0, &h, SNAPSHOT_HEADER_SIZE(h.sectionCount));
+}
+
+// Writes a version 5 snapshot of cut to fp. Returns 0 on failure.
+static int snapshotWriteSegments(FILE *fp, const SnapshotCut *cut) {
+    SnapshotHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = SNAPSHOT_MAGIC;
+    h.version = SNAPSHOT_VERSION;
+    h.sectionCount = S_COUNT;
+    for (int t = 0; t < T_COUNT; t++) h.nextIds[t] = cut->nextIds[t];
+
+    // Lay every section out first, so each segment knows where it goes
+    long long pos = SNAPSHOT_HEADER_SIZE(S_COUNT), written = pos;
+    int segCount = 0;
+    for (int sc = 0; sc < S_COUNT; sc++) {
+        SnapshotSection *sec = &h.sections[sc];
+        pos += (SNAPSHOT_ALIGN - pos % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN;
+        sec->offset = pos;
+        sec->recSize = sectionRecSize(sc);
+        sec->count = sc == S_SEGMENTS ? segCount : cut->counts[sc];
+        sec->firstSegment = segCount;
+        if (sc != S_SEGMENTS) segCount += sectionSegments(sec);
+        pos += (long long)sec->count * sec->recSize;
+        if (sec->count) written = pos;
+    }
+
+    SnapshotSave sv = { fp, cut, malloc((size_t)(segCount + 1) * sizeof(SnapshotSegment)), calloc((size_t)segCount + 1, sizeof(unsigned)), 0 };
+    int ok = sv.segs && sv.crcs;
+    for (int sc = 0, k = 0; ok && sc < S_SEGMENTS; sc++) {
+        const SnapshotSection *sec = &h.sections[sc];
+        int per = (int)(segmentBytes(sec->recSize) / sec->recSize);
+        for (int first = 0; first < sec->count; first += per, k++) {
+            SnapshotSegment *seg = &sv.segs[k];
+            seg->sc = sc;
+            seg->first = first;
+            seg->count = sec->count - first < per ? sec->count - first : per;
+            seg->offset = sec->offset + (long long)first * sec->recSize;
+        }
+    }
+    if (ok) {
+        crc32Update(0, NULL, 0); // Fills the CRC table before threads share it
+        runTasks(segCount, snapshotSaveTask, &sv);
+        ok = !sv.failed;
+    }
+    if (ok) {
+        for (int sc = 0; sc < S_SEGMENTS; sc++) {
+            SnapshotSection *sec = &h.sections[sc];
+            sec->crc = crc32Update(0, sv.crcs + sec->firstSegment, (size_t)sectionSegments(sec) * sizeof(unsigned));
+        }
+        SnapshotSection *table = &h.sections[S_SEGMENTS];
+        table->crc = crc32Update(0, sv.crcs, (size_t)segCount * sizeof(unsigned));
+        h.headerCrc = snapshotHeaderCrc(h);
+        // Empty sections at the end still point inside the file
+        static const char padding[SNAPSHOT_ALIGN];
+        ok = snapshotWriteAt(fp, sv.crcs, (size_t)segCount * sizeof(unsigned), table->offset) &&
+             snapshotWriteAt(fp, padding, (size_t)(pos - written), written) &&
+             snapshotWriteAt(fp, &h, SNAPSHOT_HEADER_SIZE(S_COUNT), 0);
+    }
+    free(sv.segs);
+    free(sv.crcs);
+    return ok;
+}
+
+/* Packed snapshots (--compress) trade the mapped load for a much smaller
+   file, for backups and copies to other sites. The header mirrors
+   SnapshotHeader (with its own magic and a PackedSection per section, no
+   segment table). Each section is encoded as described by packLayouts:
+   int fields as the zigzag varint of their difference from the same
+   field of the previous element (so ascending ids take a byte each),
+   fixed char arrays as a varint length and the bytes before the NUL, and
+   the string pool as it is. The encoded stream is then stored as
+   [u32 length] and LZ_BLOCK_SIZE blocks, each [u32 length] and its
+   compressed bytes (or the bytes as they are, flagged with LZ_STORED,
+   where compressing does not help). Loading decodes every section in
+   parallel into one image laid out like a version 5 file and attaches
+   the stores to it. */
+
+#define SNAPSHOT_PACKED_MAGIC 0x5A444D48u // "HMDZ"
+#define PACKED_VERSION 1
+#define LZ_BLOCK_SIZE (1 << 16)
+#define LZ_STORED 0x80000000u
+
+typedef struct {
+    long long offset;
+    long long length;  // packed bytes
+    int count;         // elements once decoded
+    int recSize;
+    unsigned crc;      // crc32 of the packed bytes
+    int unused;        // keeps the layout free of padding
+} PackedSection;
+
+typedef struct {
+    unsigned magic;
+    int version;
+    int sectionCount;
+    unsigned headerCrc;
+    int nextIds[T_COUNT];
+    PackedSection sections[SNAPSHOT_MAX_SECTIONS];
+} PackedHeader;
+
+enum { F_INT, F_TEXT };
+
+typedef struct {
+    int kind;
+    int offset;
+    int size;
+} PackField;
+
+#define PACK_MAX_FIELDS 4
+
+typedef struct {
+    int count; // 0 for the string pool, kept byte for byte
+    PackField fields[PACK_MAX_FIELDS];
+} PackLayout;
+
+#define PACK_INTS { 1, { { F_INT, 0, 4 } } }
+#define PACK_INT(type, f) { F_INT, (int)offsetof(type, f), 4 }
+#define PACK_TEXT(type, f) { F_TEXT, (int)offsetof(type, f), (int)sizeof(((type*)0)->f) }
+
+const PackLayout packLayouts[S_SEGMENTS] = {
+    PACK_INTS, PACK_INTS, PACK_INTS, PACK_INTS, PACK_INTS,
+    { 2, { PACK_INT(PatientText, name), PACK_INT(PatientText, phone) } },
+    { 4, { PACK_INT(Disease, id), PACK_TEXT(Disease, name), PACK_TEXT(Disease, symptoms), PACK_TEXT(Disease, treatment) } },
+    { 4, { PACK_INT(DoctorRecord, id), PACK_TEXT(DoctorRecord, name), PACK_INT(DoctorRecord, specialization), PACK_TEXT(DoctorRecord, phone) } },
+    PACK_INTS, PACK_INTS, PACK_INTS, PACK_INTS, PACK_INTS,
+    PACK_INTS,
+    { 0, { { F_INT, 0, 0 } } }
+};
+
+int packSnapshots = 0; // Set by --compress: saves write a packed snapshot
+
+typedef struct {
+    unsigned char *data;
+    size_t len, cap;
+    int failed;
+} PackBuf;
+
+// Makes room for n more bytes. Returns where they go, or NULL on OOM.
+static unsigned char* packReserve(PackBuf *b, size_t n) {
+    if (b->failed) return NULL;
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + n) cap *= 2;
+        unsigned char *data = realloc(b->data, cap);
+        if (!data) { b->failed = 1; return NULL; }
+        b->data = data;
+        b->cap = cap;
+    }
+    return b->data + b->len;
+}
+
+static void packBytes(PackBuf *b, const void *src, size_t n) {
+    unsigned char *p = packReserve(b, n);
+    if (!p) return;
+    memcpy(p, src, n);
+    b->len += n;
+}
+
+static void packVarint(PackBuf *b, unsigned v) {
+    unsigned char *p = packReserve(b, 5);
+    if (!p) return;
+    int n = 0;
+    for (; v >= 128; v >>= 7) p[n++] = (unsigned char)(v | 128);
+    p[n++] = (unsigned char)v;
+    b->len += (size_t)n;
+}
+
+static void putWord(unsigned char *p, unsigned v) {
+    for (int k = 0; k < 4; k++) p[k] = (unsigned char)(v >> (8 * k));
+}
+
+static unsigned getWord(const unsigned char *p) {
+    return (unsigned)p[0] | (unsigned)p[1] << 8 | (unsigned)p[2] << 16 | (unsigned)p[3] << 24;
+}
+
+typedef struct {
+    const unsigned char *p, *end;
+    int bad;
+} PackReader;
+
+static unsigned unpackVarint(PackReader *r) {
+    unsigned v = 0;
+    for (int shift = 0; shift < 35 && r->p < r->end; shift += 7) {
+        unsigned c = *r->p++;
+        v |= (c & 127) << shift;
+        if (!(c & 128)) return v;
+    }
+    r->bad = 1;
+    return 0;
+}
+
+// Encodes the elements of section sc
+static void packElements(int sc, const SnapshotCut *cut, PackBuf *out) {
+    const PackLayout *l = &packLayouts[sc];
+    if (l->count == 0) {
+        unsigned n, size = (unsigned)cut->counts[sc];
+        for (unsigned off = 0; off < size; off += n) {
+            const char *run = poolRun(&stringPool, off, &n);
+            if (n > size - off) n = size - off;
+            packBytes(out, run, n);
+        }
+        return;
+    }
+    const RecordStore *st = snapshotStores[sc];
+    const Table *tb = sectionTable(sc);
+    unsigned prev[PACK_MAX_FIELDS] = { 0 };
+    for (int i = 0; i < cut->counts[sc]; i++) {
+        const char *rec = storeAt(st, i);
+        for (int f = 0; f < l->count; f++) {
+            const PackField *pf = &l->fields[f];
+            if (pf->kind == F_INT) {
+                unsigned v;
+                memcpy(&v, rec + pf->offset, 4);
+                if (tb && !v) v = (unsigned)tableIdAt(tb, cut->version, i); // Deleted after the cut
+                int d = (int)(v - prev[f]);
+                prev[f] = v;
+                packVarint(out, (unsigned)d << 1 ^ (unsigned)(d >> 31)); // Zigzag: small either way
+            } else {
+                size_t len = strnlen(rec + pf->offset, (size_t)pf->size);
+                packVarint(out, (unsigned)len);
+                packBytes(out, rec + pf->offset, len);
+            }
+        }
+    }
+}
+
+// Decodes count elements of section sc from r into dst (zeroed).
+// Returns 0 if the stream does not hold exactly that.
+static int unpackElements(int sc, PackReader *r, char *dst, int count) {
+    const PackLayout *l = &packLayouts[sc];
+    if (l->count == 0) {
+        if (r->end - r->p != count) return 0;
+        memcpy(dst, r->p, (size_t)count);
+        return 1;
+    }
+    size_t recSize = (size_t)sectionRecSize(sc);
+    unsigned prev[PACK_MAX_FIELDS] = { 0 };
+    for (int i = 0; i < count && !r->bad; i++) {
+        char *rec = dst + (size_t)i * recSize;
+        for (int f = 0; f < l->count; f++) {
+            const PackField *pf = &l->fields[f];
+            unsigned v = unpackVarint(r);
+            if (pf->kind == F_INT) {
+                prev[f] += (v >> 1) ^ (0u - (v & 1));
+                memcpy(rec + pf->offset, &prev[f], 4);
+            } else if (v > (unsigned)pf->size || v > (size_t)(r->end - r->p)) {
+                return 0;
+            } else {
+                memcpy(rec + pf->offset, r->p, v);
+                r->p += v;
+            }
+        }
+    }
+    return !r->bad && r->p == r->end;
+}
+
+// Compresses a stream into out as its length and then its blocks
+static void packBlocks(const PackBuf *in, PackBuf *out) {
+    unsigned char *p = packReserve(out, 4);
+    if (!p) return;
+    putWord(p, (unsigned)in->len);
+    out->len += 4;
+    for (size_t at = 0; at < in->len; at += LZ_BLOCK_SIZE) {
+        size_t n = in->len - at < LZ_BLOCK_SIZE ? in->len - at : LZ_BLOCK_SIZE;
+        if (!(p = packReserve(out, 4 + lzBound(n)))) return;
+        size_t c = lzCompress(in->data + at, n, p + 4);
+        unsigned word = (unsigned)c;
+        if (c >= n) {
+            memcpy(p + 4, in->data + at, n);
+            c = n;
+            word = (unsigned)n | LZ_STORED;
+        }
+        putWord(p, word);
+        out->len += 4 + c;
+    }
+}
+
+// Inflates a packed section's blocks into out. Returns 0 if damaged.
+static int unpackBlocks(const unsigned char *p, size_t n, PackBuf *out) {
+    if (n < 4) return 0;
+    const unsigned char *end = p + n;
+    size_t raw = getWord(p);
+    p += 4;
+    if (!(out->data = malloc(raw ? raw : 1))) return 0;
+    out->len = out->cap = raw;
+    for (size_t at = 0; at < raw; at += LZ_BLOCK_SIZE) {
+        size_t want = raw - at < LZ_BLOCK_SIZE ? raw - at : LZ_BLOCK_SIZE;
+        if (end - p < 4) return 0;
+        unsigned word = getWord(p);
+        size_t len = word & ~LZ_STORED;
+        p += 4;
+        if (len > (size_t)(end - p)) return 0;
+        if (word & LZ_STORED) {
+            if (len != want) return 0;
+            memcpy(out->data + at, p, len);
+        } else if (!lzDecompress(p, len, out->data + at, want)) {
+            return 0;
+        }
+        p += len;
+    }
+    return p == end;
+}
+
+typedef struct {
+    const SnapshotCut *cut;
+    PackBuf outs[S_SEGMENTS];
+} PackRun;
+
+static void packTask(void *arg, int sc) {
+    PackRun *run = arg;
+    PackBuf stream = { NULL, 0, 0, 0 };
+    packElements(sc, run->cut, &stream);
+    packBlocks(&stream, &run->outs[sc]);
+    if (stream.failed) run->outs[sc].failed = 1;
+    free(stream.data);
+}
+
+static unsigned packedHeaderCrc(PackedHeader h) {
+    h.headerCrc = 0;
+    if (h.sectionCount < 0 || h.sectionCount > SNAPSHOT_MAX_SECTIONS) return ~0u;
+    return crc32Update(0, &h, offsetof(PackedHeader, sections) + (size_t)h.sectionCount * sizeof(PackedSection));
+}
+
+// Writes a packed snapshot of cut to fp. Returns 0 on failure.
+static int snapshotWritePacked(FILE *fp, const SnapshotCut *cut) {
+    PackedHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = SNAPSHOT_PACKED_MAGIC;
+    h.version = PACKED_VERSION;
+    h.sectionCount = S_SEGMENTS;
+    for (int t = 0; t < T_COUNT; t++) h.nextIds[t] = cut->nextIds[t];
+
+    PackRun run;
+    memset(&run, 0, sizeof(run));
+    run.cut = cut;
+    PackBuf *outs = run.outs;
+    runTasks(S_SEGMENTS, packTask, &run);
+
+    int ok = 1;
+    long long pos = (long long)(offsetof(PackedHeader, sections) + S_SEGMENTS * sizeof(PackedSection));
+    for (int sc = 0; sc < S_SEGMENTS; sc++) {
+        PackedSection *sec = &h.sections[sc];
+        if (outs[sc].failed) ok = 0;
+        sec->offset = pos;
+        sec->length = (long long)outs[sc].len;
+        sec->count = cut->counts[sc];
+        sec->recSize = sectionRecSize(sc);
+        sec->crc = crc32Update(0, outs[sc].data, outs[sc].len);
+        pos += sec->length;
+    }
+    h.headerCrc = packedHeaderCrc(h);
+    if (ok) ok = fwrite(&h, (size_t)h.sections[0].offset, 1, fp) == 1;
+    for (int sc = 0; sc < S_SEGMENTS; sc++) {
+        if (ok && outs[sc].len) ok = fwrite(outs[sc].data, outs[sc].len, 1, fp) == 1;
+        free(outs[sc].data);
+    }
+    return ok;
+}
+
+// The file format has no notion of tombstones, so they are swept out
+// first (and the pool compacted if it is mostly garbage). Rows and
+// strings move, so listings in progress are waited out.
+static void snapshotPrepare() {
+    int compactPool = stringPool.garbage * 2 > poolSize(&stringPool);
+    if (patientIds.dead || appointmentIds.dead || compactPool) {
+        viewsFreeze(1);
+        if (patientIds.dead) compactPatients();
+        if (appointmentIds.dead) compactAppointments();
+        if (compactPool) compactStringPool(); // Saved as is on OOM
+        viewsThaw();
+    }
+}
+
+// Writes cut to path and syncs it to disk. Returns 0 on failure.
+static int snapshotSave(const char *path, const SnapshotCut *cut) {
+    // Unlink first: a mapped snapshot keeps its old inode alive, so the
+    // records the stores still point into are not truncated under them
+    remove(path);
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return 0;
+    int ok = packSnapshots ? snapshotWritePacked(fp, cut) : snapshotWriteSegments(fp, cut);
+    if (ferror(fp) || (ok && !fileSync(fp))) ok = 0;
+    if (fclose(fp) != 0) ok = 0;
+    return ok;
+}
+
+/* Saves never write DATA_FILE in place. The snapshot goes to
+   SNAPSHOT_TEMP_FILE, is synced, and is then renamed over DATA_FILE, so
+   a crash leaves either the old file or the new one, both whole. The
+   file replaced is kept as generation 1 (DATA_FILE.1), the one before it
+   as generation 2 and so on up to --generations (default
+   SNAPSHOT_GENERATIONS); only names change, nothing is copied. If
+   DATA_FILE will not load, loadSnapshot() falls back to the newest
+   generation that does. */
+
+int snapshotGenerations = SNAPSHOT_GENERATIONS; // Set by --generations
+
+// Names generation g: DATA_FILE itself for 0, otherwise DATA_FILE.g
+static void generationName(int g, char *buf, size_t size) {
+    if (g == 0) snprintf(buf, size, "%s", DATA_FILE);
+    else snprintf(buf, size, "%s.%d", DATA_FILE, g);
+}
+
+// Flushes the renames in the working directory to disk (best effort)
+static void syncDirectory() {
+#ifndef _WIN32
+    int fd = open(".", O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+#endif
+}
+
+// Renames the finished snapshot at path over DATA_FILE, shifting the
+// generations up first. DATA_FILE becomes generation 1 by a hard link,
+// so it still names a whole snapshot until the rename replaces it.
+// Returns 0 if the new file could not be put in place.
+static int snapshotInstall(const char *path) {
+    char from[64], to[64];
+    if (snapshotGenerations > 0) {
+        generationName(snapshotGenerations, to, sizeof(to));
+        remove(to);
+        for (int g = snapshotGenerations - 1; g >= 1; g--) {
+            generationName(g, from, sizeof(from));
+            generationName(g + 1, to, sizeof(to));
+            rename(from, to); // A missing generation just leaves a gap
+        }
+        generationName(1, to, sizeof(to));
+#ifdef _WIN32
+        rename(DATA_FILE, to);
+#else
+        if (link(DATA_FILE, to) != 0) rename(DATA_FILE, to); // No hard links on this file system
+#endif
+    }
+#ifdef _WIN32
+    // rename() does not replace files here; removing DATA_FILE first would
+    // leave a moment with no save file at all
+    int ok = MoveFileExA(path, DATA_FILE, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    int ok = rename(path, DATA_FILE) == 0;
+#endif
+    syncDirectory();
+    return ok;
+}
+
+// Writes cut through SNAPSHOT_TEMP_FILE and installs it. Returns 0 on
+// failure, with DATA_FILE left as it was.
+static int snapshotCommit(const SnapshotCut *cut) {
+    int ok = snapshotSave(SNAPSHOT_TEMP_FILE, cut) && snapshotInstall(SNAPSHOT_TEMP_FILE);
+    if (!ok) remove(SNAPSHOT_TEMP_FILE);
+    return ok;
+}
+
+/* Autosave (--autosave SECONDS and/or --autosave-changes N) writes
+   checkpoints from a background thread, so the menu never waits on the
+   disk. Between operations autosavePoll() sees whether enough time has
+   passed or enough changes have piled up. If so it sweeps tombstones (in
+   memory), takes a SnapshotCut, pins the current view for it and moves
+   the journal aside (see journalRotate). The thread commits the cut as a
+   save does and deletes the old journal. Changes go on meanwhile without
+   disturbing it: new rows lie past the cut's counts, rows deleted later
+   keep their ids in the row stamps, and sweeps are put off while the
+   view is pinned. Whenever it stops, the files on disk replay to the
+   same data, since replay is idempotent by id. */
+
+#define CHECKPOINT_PIN (VIEW_MAX_READERS - 1) // View pin slot of the writer thread
+
+int autosaveSeconds = 0; // Set by --autosave
+int autosaveChanges = 0; // Set by --autosave-changes
+
+typedef struct {
+    SnapshotCut cut;
+    int changes;  // journal records the cut covers
+    int running;  // a cut is being written
+    int threaded; // by a thread still to be joined
+    int done;     // set by the writer when it finishes
+    int ok;
+#ifdef HAVE_THREADS
+    pthread_t thread;
+#endif
+} Checkpoint;
+
+Checkpoint checkpoint;
+unsigned long long lastCheckpoint = 0; // nowNanos() when the last one began
+
+static void* checkpointThread(void *arg) {
+    Checkpoint *c = arg;
+    unsigned long long t = metricStart();
+    c->ok = snapshotCommit(&c->cut);
+    if (c->ok) {
+        remove(JOURNAL_OLD_FILE);
+        metricStop(MT_SAVE, t);
+    }
+    __atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Reaps a checkpoint that has finished, or with wait set waits for the
+// one in progress. Returns 0 if it is still running.
+static int checkpointFinish(int wait) {
+    Checkpoint *c = &checkpoint;
+    if (!c->running) return 1;
+    if (!wait && !__atomic_load_n(&c->done, __ATOMIC_ACQUIRE)) return 0;
+#ifdef HAVE_THREADS
+    if (c->threaded) pthread_join(c->thread, NULL);
+#endif
+    __atomic_store_n(&viewPins[CHECKPOINT_PIN].version, 0, __ATOMIC_RELEASE);
+    c->running = 0;
+    if (!c->ok) {
+        journalChanges += c->changes; // Still only in the journals
+        printf(RED "? Warning: Autosave failed; the journal still holds every change.\n" RESET_COLOR);
+    }
+    return 1;
+}
+
+// Starts a checkpoint if one is due. Called between operations by
+// whichever thread makes changes.
+void autosavePoll() {
+    if (!autosaveSeconds && !autosaveChanges) return;
+    viewPublish(); // Also frees memory the last checkpoint held on to
+    if (!checkpointFinish(0) || journalChanges == 0) return;
+    unsigned long long now = nowNanos();
+    if (!(autosaveChanges && journalChanges >= autosaveChanges) &&
+        !(autosaveSeconds && now - lastCheckpoint >= (unsigned long long)autosaveSeconds * 1000000000ull)) return;
+
+    Checkpoint *c = &checkpoint;
+    snapshotPrepare();
+    snapshotCutNow(&c->cut);
+    journalRotate();
+    __atomic_store_n(&viewPins[CHECKPOINT_PIN].version, c->cut.version, __ATOMIC_SEQ_CST);
+    c->changes = journalChanges;
+    journalChanges = 0;
+    lastCheckpoint = now;
+    c->running = 1;
+    c->done = 0;
+#ifdef HAVE_THREADS
+    c->threaded = pthread_create(&c->thread, NULL, checkpointThread, c) == 0;
+    if (c->threaded) return;
+#endif
+    checkpointThread(c); // No threads: write it now
+}
+
+void saveData() {
+    unsigned long long t = metricStart();
+    checkpointFinish(1); // Never two writers on the file
+    snapshotPrepare();
+    SnapshotCut cut;
+    snapshotCutNow(&cut);
+    int ok = snapshotCommit(&cut);
+    if (!ok) {
+        // Keep the journal: it still holds everything since the last good save
+        printf(RED "? Error: Could not write the save file.\n" RESET_COLOR);
+        return;
+    }
+    journalReset(); // The snapshot now covers every journaled change
+    lastCheckpoint = nowNanos();
+    metricStop(MT_SAVE, t);
+    printf(GREEN "?? Data saved successfully.\n" RESET_COLOR);
+}
+
+// Reads 'count' whole records of table t as written by versions 1 and 2
+// and adds them as rows. Returns the CRC of the bytes read, or sets
+// *short_ if the file ends early.
+static unsigned loadLegacyRows(FILE *fp, int t, int count, int *short_) {
+    union { Patient p; Disease s; Doctor d; Appointment a; } r;
+    unsigned crc = 0;
+    for (int i = 0; i < count; i++) {
+        if (fread(&r, legacyRecSizes[t], 1, fp) != 1) { *short_ = 1; break; }
+        crc = crc32Update(crc, &r, legacyRecSizes[t]);
+        snapshotTouched = 1;
+        int ok = 1;
+        switch (t) {
+            case T_PATIENTS: ok = appendPatientRow(&r.p) >= 0; break;
+            case T_DISEASES: ok = insertRecord(&diseaseStore, NULL, &r.s, 0) != NULL; break;
+            case T_DOCTORS: {
+                DoctorRecord dr;
+                ok = doctorRecord(&r.d, &dr) && insertRecord(&doctorStore, NULL, &dr, 0);
+                break;
+            }
+            case T_APPOINTMENTS: ok = appendAppointmentRow(&r.a) >= 0; break;
+        }
+        if (!ok) {
+            printf(RED "? Error: Out of memory while loading records.\n" RESET_COLOR);
+            exit(1);
+        }
+    }
+    return crc;
+}
+
+// Reads a version 1 file (no header). Returns NULL on success, otherwise
+// a description of the problem.
+static const char* loadLegacySnapshot(FILE *fp) {
+    int counts[T_COUNT], ids[T_COUNT];
+    if (fread(counts, sizeof(int), T_COUNT, fp) != T_COUNT || fread(ids, sizeof(int), T_COUNT, fp) != T_COUNT) {
+        return "file ends early";
+    }
+    for (int t = 0; t < T_COUNT; t++) *snapshotNextIds[t] = ids[t];
+
+    int short_ = 0;
+    for (int t = 0; t < T_COUNT && !short_; t++) loadLegacyRows(fp, t, counts[t], &short_);
+    for (int t = 0; t < T_COUNT; t++) *snapshotNextIds[t] = ids[t];
+    return short_ ? "file ends early" : NULL;
+}
+
+// Reads a version 2 file (header over four record tables). Returns NULL
+// on success, otherwise a description of the problem.
+static const char* loadVersion2(FILE *fp, const SnapshotHeader *h, long long size) {
+    if (h->sectionCount != T_COUNT) return "unexpected table count";
+    for (int t = 0; t < T_COUNT; t++) {
+        const SnapshotSection *tb = &h->sections[t];
+        if (tb->recSize != (int)legacyRecSizes[t]) return "record layout differs from this build";
+        if (tb->count < 0 || tb->offset + (long long)tb->count * tb->recSize > size) return "table extends past end of file";
+    }
+    for (int t = 0; t < T_COUNT; t++) {
+        int short_ = 0;
+        fseek(fp, (long)h->sections[t].offset, SEEK_SET);
+        if (loadLegacyRows(fp, t, h->sections[t].count, &short_) != h->sections[t].crc || short_) {
+            return "table checksum mismatch";
+        }
+    }
+    for (int t = 0; t < T_COUNT; t++) *snapshotNextIds[t] = h->nextIds[t];
+    return NULL;
+}
+
+// Checks a version 3 to 5 header read from a file of 'size' bytes, given
+// the element size of each of its sections. Returns NULL if it is usable,
+// otherwise a description of the problem.
+static const char* snapshotCheckHeader(const SnapshotHeader *h, long long size, int count, const int *recSizes) {
+    if (h->sectionCount != count) return "unexpected section count";
+    for (int sc = 0; sc < count; sc++) {
+        const SnapshotSection *sec = &h->sections[sc];
+        if (sec->recSize != recSizes[sc]) return "record layout differs from this build";
+        if (sec->count < 0 || sec->offset < (long long)SNAPSHOT_HEADER_SIZE(count) || sec->offset % SNAPSHOT_ALIGN ||
+            (sec->count && sec->offset + (long long)sec->count * sec->recSize > size)) {
+            return "section extends past end of file"; // Files saved empty by older builds end short of their layout
+        }
+    }
+    if (h->version < 5) return NULL;
+    int segments = 0;
+    for (int sc = 0; sc < S_SEGMENTS; sc++) {
+        if (h->sections[sc].firstSegment != segments) return "segment table damaged";
+        segments += sectionSegments(&h->sections[sc]);
+    }
+    return h->sections[S_SEGMENTS].count == segments ? NULL : "segment table damaged";
+}
+
+// Points section sc's store (or the pool) at its bytes
+static void snapshotAttachSection(int sc, char *bytes, const SnapshotSection *sec) {
+    snapshotTouched = 1;
+    if (sc == S_STRINGS) poolAttach(&stringPool, bytes + sec->offset, (unsigned)sec->count);
+    else if (snapshotStores[sc]) storeAttach(snapshotStores[sc], bytes + sec->offset, sec->count);
+}
+
+// A run of file bytes and the CRC it should have
+typedef struct {
+    long long offset;
+    size_t len;
+    unsigned crc;
+} SnapshotSpan;
+
+typedef struct {
+    const char *bytes;
+    const SnapshotSpan *spans;
+    int bad;
+} SnapshotCheck;
+
+static void snapshotCheckTask(void *arg, int k) {
+    SnapshotCheck *c = arg;
+    const SnapshotSpan *sp = &c->spans[k];
+    if (crc32Update(0, c->bytes + sp->offset, sp->len) != sp->crc) __atomic_store_n(&c->bad, 1, __ATOMIC_RELAXED);
+}
+
+// Checks the segment table of a version 5 file against its CRC, and each
+// section's run of segment CRCs against the section's. Only the table is
+// read, so this runs on every load.
+static const char* snapshotCheckSegments(const SnapshotHeader *h, const char *bytes) {
+    const SnapshotSection *table = &h->sections[S_SEGMENTS];
+    const unsigned *segCrcs = (const unsigned*)(bytes + table->offset);
+    if (crc32Update(0, segCrcs, (size_t)table->count * sizeof(unsigned)) != table->crc) {
+        return "segment table checksum mismatch";
+    }
+    for (int sc = 0; sc < S_SEGMENTS; sc++) {
+        const SnapshotSection *sec = &h->sections[sc];
+        if (crc32Update(0, segCrcs + sec->firstSegment, (size_t)sectionSegments(sec) * sizeof(unsigned)) != sec->crc) {
+            return "section checksum mismatch";
+        }
+    }
+    return NULL;
+}
+
+// Full CRC check, segments (or, before version 5, whole sections) in
+// parallel. This reads every page, so a mapped version 5 file only gets
+// it when HMS_VERIFY is set in the environment. Older files have no
+// segment table to check cheaply, and a file read rather than mapped has
+// had every page read anyway, so those are always checked in full.
+static const char* snapshotVerifySections(const SnapshotHeader *h, const char *bytes, int strings) {
+    int segmented = h->version >= 5;
+    const SnapshotSection *table = &h->sections[S_SEGMENTS];
+    const unsigned *segCrcs = segmented ? (const unsigned*)(bytes + table->offset) : NULL;
+    int data = segmented ? S_SEGMENTS : h->sectionCount;
+    int n = segmented ? table->count : data;
+    crc32Update(0, NULL, 0); // Fills the CRC table before threads share it
+    const char *problem = segmented ? snapshotCheckSegments(h, bytes) : NULL;
+    if (problem) return problem;
+
+    SnapshotSpan *spans = malloc((size_t)(n + 1) * sizeof(SnapshotSpan));
+    if (!spans) return "out of memory";
+    for (int sc = 0, k = 0; sc < data; sc++) {
+        const SnapshotSection *sec = &h->sections[sc];
+        long long bytesLeft = (long long)sec->count * sec->recSize;
+        if (!segmented) {
+            spans[k++] = (SnapshotSpan){ sec->offset, (size_t)bytesLeft, sec->crc };
+            continue;
+        }
+        int segs = sectionSegments(sec);
+        long long per = segmentBytes(sec->recSize);
+        for (int g = 0; g < segs; g++, k++) {
+            long long at = (long long)g * per;
+            spans[k] = (SnapshotSpan){ sec->offset + at, (size_t)(bytesLeft - at < per ? bytesLeft - at : per), segCrcs[k] };
+        }
+    }
+    SnapshotCheck c = { bytes, spans, 0 };
+    runTasks(n, snapshotCheckTask, &c);
+    free(spans);
+    if (c.bad) return "section checksum mismatch";
+    if (h->sections[strings].count && bytes[h->sections[strings].offset] != '\0') return "string pool damaged";
+    return NULL;
+}
+
+// Section sc of a version 4 or 5 file as an array of elements
+#define SNAPSHOT_SECTION(h, bytes, sc, type) ((const type*)((bytes) + (h)->sections[sc].offset))
+
+static inline int fieldTerminated(const char *field, size_t size) { return memchr(field, '\0', size) != NULL; }
+
+// The checks a mapped file gets in place of the full CRC check: everything
+// that is followed to other memory must stay in bounds. The pool has to
+// start and end with '\0', every StrRef must lie inside it, every
+// interned handle must be one the file defines, and the fixed-size
+// strings of doctors and diseases must be terminated. This reads only
+// those sections; damage to a column of plain numbers still loads, as
+// wrong numbers, unless HMS_VERIFY is set.
+static const char* snapshotCheckRefs(const SnapshotHeader *h, const char *bytes) {
+    unsigned poolLen = (unsigned)h->sections[S_STRINGS].count;
+    const char *pool = bytes + h->sections[S_STRINGS].offset;
+    if (poolLen && (pool[0] != '\0' || pool[poolLen - 1] != '\0')) return "string pool damaged";
+    int handles = h->sections[S_INTERNED].count;
+
+    const StrRef *refs = SNAPSHOT_SECTION(h, bytes, S_INTERNED, StrRef);
+    for (int i = 0; i < handles; i++) if (refs[i] >= poolLen) return "interned string outside the pool";
+    const PatientText *texts = SNAPSHOT_SECTION(h, bytes, S_PATIENT_TEXT, PatientText);
+    for (int i = 0; i < h->sections[S_PATIENT_TEXT].count; i++) {
+        if ((texts[i].name && texts[i].name >= poolLen) || (texts[i].phone && texts[i].phone >= poolLen)) {
+            return "patient text outside the pool";
+        }
+    }
+    const StrRef *oldText = SNAPSHOT_SECTION(h, bytes, S_APPOINT_OLDTEXT, StrRef);
+    for (int i = 0; i < h->sections[S_APPOINT_OLDTEXT].count; i++) {
+        if (oldText[i] && oldText[i] >= poolLen) return "appointment text outside the pool";
+    }
+
+    static const int handleSections[] = { S_PATIENT_GENDERS, S_PATIENT_DISEASES };
+    for (int k = 0; k < 2; k++) {
+        const int *column = SNAPSHOT_SECTION(h, bytes, handleSections[k], int);
+        for (int i = 0; i < h->sections[handleSections[k]].count; i++) {
+            if (column[i] < 0 || column[i] > handles) return "unknown interned handle";
+        }
+    }
+    const DoctorRecord *doctors = SNAPSHOT_SECTION(h, bytes, S_DOCTORS, DoctorRecord);
+    for (int i = 0; i < h->sections[S_DOCTORS].count; i++) {
+        const DoctorRecord *d = &doctors[i];
+        if (d->specialization < 0 || d->specialization > handles) return "unknown interned handle";
+        if (!fieldTerminated(d->name, sizeof(d->name)) || !fieldTerminated(d->phone, sizeof(d->phone))) {
+            return "doctor record damaged";
+        }
+    }
+    const Disease *diseases = SNAPSHOT_SECTION(h, bytes, S_DISEASES, Disease);
+    for (int i = 0; i < h->sections[S_DISEASES].count; i++) {
+        const Disease *d = &diseases[i];
+        if (!fieldTerminated(d->name, sizeof(d->name)) || !fieldTerminated(d->symptoms, sizeof(d->symptoms)) ||
+            !fieldTerminated(d->treatment, sizeof(d->treatment))) {
+            return "disease record damaged";
+        }
+    }
+    return NULL;
+}
+
+// Converts the two version 3 sections whose layout changed; the rest were
+// attached as they are. Returns NULL or a description of the problem.
+static const char* loadVersion3(const SnapshotHeader *h, char *bytes) {
+    const SnapshotSection *pt = &h->sections[V3_PATIENT_TEXT];
+    const PatientTextV3 *texts = (const PatientTextV3*)(bytes + pt->offset);
+    if (pt->count != patientIds.count) return "column lengths differ";
+    for (int i = 0; i < pt->count; i++) {
+        PatientText *t = storeAppend(&patientTexts);
+        int *gender = storeAppend(&patientGenders);
+        int *disease = storeAppend(&patientDiseases);
+        if (!t || !gender || !disease) return "out of memory";
+        t->name = texts[i].name;
+        t->phone = texts[i].phone;
+        const char *g = poolStr(&stringPool, texts[i].gender);
+        const char *d = poolStr(&stringPool, texts[i].disease);
+        *gender = intern(&interned, g, strlen(g));
+        *disease = intern(&interned, d, strlen(d));
+        if (*gender < 0 || *disease < 0) return "out of memory";
+        poolRelease(&stringPool, texts[i].gender); // Now held by the interned copy
+        poolRelease(&stringPool, texts[i].disease);
+    }
+    const SnapshotSection *ds = &h->sections[V3_DOCTORS];
+    const Doctor *doctors = (const Doctor*)(bytes + ds->offset);
+    for (int i = 0; i < ds->count; i++) {
+        DoctorRecord r;
+        if (!doctorRecord(&doctors[i], &r) || !insertRecord(&doctorStore, NULL, &r, 0)) return "out of memory";
+    }
+    return NULL;
+}
+
+typedef struct {
+    const PackedHeader *h;
+    const unsigned char *packed; // the whole file
+    char *image;
+    const SnapshotSection *layout; // where each section goes in image
+    const char *problem;
+} PackedLoad;
+
+static void unpackTask(void *arg, int sc) {
+    PackedLoad *pl = arg;
+    const PackedSection *sec = &pl->h->sections[sc];
+    const unsigned char *bytes = pl->packed + sec->offset;
+    PackBuf stream = { NULL, 0, 0, 0 };
+    const char *problem = NULL;
+    if (crc32Update(0, bytes, (size_t)sec->length) != sec->crc) {
+        problem = "section checksum mismatch";
+    } else if (!unpackBlocks(bytes, (size_t)sec->length, &stream)) {
+        problem = "section does not decompress";
+    } else {
+        PackReader r = { stream.data, stream.data + stream.len, 0 };
+        if (!unpackElements(sc, &r, pl->image + pl->layout[sc].offset, sec->count)) problem = "section does not decode";
+    }
+    free(stream.data);
+    if (problem) pl->problem = problem; // Any one of them will do
+}
+
+// Reads a packed snapshot whose header starts with *prefix. Returns NULL
+// on success, otherwise a description of the problem.
+static const char* loadPacked(FILE *fp, const SnapshotHeader *prefix) {
+    PackedHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(&h, prefix, offsetof(PackedHeader, sections));
+    if (h.version != PACKED_VERSION) return "unsupported packed version";
+    if (h.sectionCount != S_SEGMENTS) return "unexpected section count";
+    if (fread(h.sections, sizeof(PackedSection), S_SEGMENTS, fp) != S_SEGMENTS || h.headerCrc != packedHeaderCrc(h)) {
+        return "header checksum mismatch";
+    }
+    fseek(fp, 0, SEEK_END);
+    long long size = ftell(fp);
+
+    // Lay the sections out as a version 5 file would, in one image
+    SnapshotSection layout[S_SEGMENTS];
+    long long pos = 0;
+    for (int sc = 0; sc < S_SEGMENTS; sc++) {
+        const PackedSection *sec = &h.sections[sc];
+        if (sec->recSize != sectionRecSize(sc)) return "record layout differs from this build";
+        if (sec->count < 0 || sec->offset < 0 || sec->length < 0 || sec->offset + sec->length > size) {
+            return "section extends past end of file";
+        }
+        pos += (SNAPSHOT_ALIGN - pos % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN;
+        layout[sc].offset = pos;
+        layout[sc].count = sec->count;
+        pos += (long long)sec->count * sec->recSize;
+    }
+    unsigned char *packed = malloc((size_t)size);
+    char *image = snapshotCopy = calloc((size_t)pos + 1, 1);
+    rewind(fp);
+    if (!packed || !image || fread(packed, 1, (size_t)size, fp) != (size_t)size) {
+        free(packed);
+        return "could not read file";
+    }
+    PackedLoad pl = { &h, packed, image, layout, NULL };
+    crc32Update(0, NULL, 0); // Fills the CRC table before threads share it
+    runTasks(S_SEGMENTS, unpackTask, &pl);
+    free(packed);
+    if (pl.problem) return pl.problem;
+    if (layout[S_STRINGS].count && image[layout[S_STRINGS].offset] != '\0') return "string pool damaged";
+    for (int sc = 0; sc < S_SEGMENTS; sc++) snapshotAttachSection(sc, image, &layout[sc]);
+    for (int t = 0; t < T_COUNT; t++) *snapshotNextIds[t] = h.nextIds[t];
+    return NULL;
+}
+
+// True if every column of t has the same number of rows
+static int tableConsistent(const Table *t) {
+    for (int c = 1; c < t->ncols; c++) if (t->cols[c]->count != t->cols[0]->count) return 0;
+    return 1;
+}
+
+// Maps DATA_FILE (or reads it whole where mmap is unavailable). Sets
+// *verify if every page must be CRC-checked now: because HMS_VERIFY asks
+// for it, or because the bytes were read anyway.
+static char* snapshotBytes(FILE *fp, long long size, int *verify) {
+    *verify = 1;
+#ifdef HAVE_MMAP
+    void *map = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), 0);
+    if (map != MAP_FAILED) {
+        snapshotMap = map;
+        snapshotMapLen = (size_t)size;
+        *verify = getenv("HMS_VERIFY") != NULL;
+        return map;
+    }
+#endif
+    char *bytes = snapshotCopy = malloc((size_t)size);
+    rewind(fp);
+    if (!bytes || fread(bytes, 1, (size_t)size, fp) != (size_t)size) return NULL;
+    return bytes;
+}
+
+// Builds index x from the rows. Returns 0 if memory ran out.
+static int buildIndex(int x) {
+    switch (x) {
+        case X_INTERNED: return internRebuild(&interned);
+        case X_DOCTORS: return idIndexRebuild(&doctorIndex, &doctorStore);
+        case X_PATIENT_IDS: return idIndexRebuild(&patientIndex, &patientIds);
+        case X_APPOINTMENT_IDS: return idIndexRebuild(&appointmentIndex, &appointmentIds);
+        case X_SCHEDULES: return scheduleRebuild();
+        case X_CALENDAR: return calendarRebuild();
+        case X_NAMES: return nameIndexRebuild(&patientNameIndex);
+        case X_TRIGRAMS: return trigramIndexRebuild(&patientTrigrams);
+        case X_AGGREGATES: return aggregatesRebuild();
+    }
+    return 1;
+}
+
+// Leaves index x to be built by the next reader (see DEFERRED INDEXES)
+void indexDefer(int x) {
+    indexBuild = buildIndex;
+    __atomic_or_fetch(&indexesPending, 1u << x, __ATOMIC_RELEASE);
+}
+
+// Rebuilds the doctor and interned-string indexes after a load and
+// defers the rest. Returns 0 if memory ran out.
+static int rebuildIndexes() {
+    for (int x = X_PATIENT_IDS; x < X_COUNT; x++) indexDefer(x);
+    return buildIndex(X_INTERNED) && buildIndex(X_DOCTORS);
+}
+
+// Loads the snapshot at path. Returns NULL on success (or if there is no
+// such file, leaving *found clear), otherwise a description of the problem.
+// A mapped file is checked (see snapshotCheckRefs) before any of it is
+// attached, so one with a damaged body leaves the stores empty and
+// loadSnapshot can still fall back to an older generation.
+static const char* loadSnapshotFile(const char *path, int *found) {
+    FILE *fp = fopen(path, "rb");
+    *found = fp != NULL;
+    if (!fp) return NULL;
+
+    SnapshotHeader h;
+    memset(&h, 0, sizeof(h));
+    size_t prefix = offsetof(SnapshotHeader, sections);
+    int haveHeader = fread(&h, prefix, 1, fp) == 1 && (h.magic == SNAPSHOT_MAGIC || h.magic == SNAPSHOT_PACKED_MAGIC);
+    const char *problem = NULL;
+    if (!haveHeader) {
+        rewind(fp);
+        problem = loadLegacySnapshot(fp);
+    } else if (h.magic == SNAPSHOT_PACKED_MAGIC) {
+        problem = loadPacked(fp, &h);
+        if (!problem && (!tableConsistent(&patientTable) || !tableConsistent(&appointmentTable))) {
+            problem = "column lengths differ";
+        }
+    } else if (h.sectionCount < 0 || h.sectionCount > SNAPSHOT_MAX_SECTIONS ||
+               fread(h.sections, sizeof(SnapshotSection), (size_t)h.sectionCount, fp) != (size_t)h.sectionCount ||
+               h.headerCrc != snapshotHeaderCrc(h)) {
+        problem = "header checksum mismatch";
+    } else if (h.version == 2) {
+        fseek(fp, 0, SEEK_END);
+        problem = loadVersion2(fp, &h, ftell(fp));
+    } else if (h.version >= 3 && h.version <= SNAPSHOT_VERSION) {
+        int v3 = h.version == 3;
+        int recSizes[SNAPSHOT_MAX_SECTIONS];
+        int count = v3 ? V3_COUNT : h.version == 4 ? S_SEGMENTS : S_COUNT;
+        for (int sc = 0; sc < count; sc++) {
+            int to = v3 ? v3Sections[sc] : sc;
+            recSizes[sc] = to >= 0 ? sectionRecSize(to) : sc == V3_DOCTORS ? (int)sizeof(Doctor) : (int)sizeof(PatientTextV3);
+        }
+        fseek(fp, 0, SEEK_END);
+        long long size = ftell(fp);
+        problem = snapshotCheckHeader(&h, size, count, recSizes);
+
+        int verify = 1;
+        char *bytes = problem ? NULL : snapshotBytes(fp, size, &verify);
+        if (!problem && !bytes) problem = "could not read file";
+        if (!problem && (verify || h.version < 5)) problem = snapshotVerifySections(&h, bytes, v3 ? V3_COUNT - 1 : S_STRINGS);
+        else if (!problem) problem = snapshotCheckSegments(&h, bytes);
+        if (!problem && !v3) problem = snapshotCheckRefs(&h, bytes);
+        if (!problem) {
+            for (int sc = 0; sc < count; sc++) {
+                int to = v3 ? v3Sections[sc] : sc;
+                if (to >= 0) snapshotAttachSection(to, bytes, &h.sections[sc]);
+            }
+            for (int t = 0; t < T_COUNT; t++) *snapshotNextIds[t] = h.nextIds[t];
+            if (v3) problem = loadVersion3(&h, bytes);
+        }
+        if (!problem && (!tableConsistent(&patientTable) || !tableConsistent(&appointmentTable))) {
+            problem = "column lengths differ";
+        }
+    } else {
+        problem = "unsupported file version";
+    }
+    fclose(fp);
+    return problem;
+}
+
+// Drops the bytes of a snapshot that failed to load
+static void snapshotRelease() {
+#ifdef HAVE_MMAP
+    if (snapshotMap) munmap(snapshotMap, snapshotMapLen);
+    snapshotMap = NULL;
+    snapshotMapLen = 0;
+#endif
+    free(snapshotCopy);
+    snapshotCopy = NULL;
+}
+
+// Loads DATA_FILE or, if it is missing or will not load, the newest
+// generation that does (see snapshotInstall). A DATA_FILE that will not
+// load is moved aside so the next save does not keep it as a generation.
+// Returns 0 if there is no save file at all.
+static int loadSnapshot() {
+    char path[64];
+    int loaded = 0, damaged = 0, headDamaged = 0;
+    for (int g = 0; g <= snapshotGenerations && !loaded; g++) {
+        generationName(g, path, sizeof(path));
+        int found;
+        const char *problem = loadSnapshotFile(path, &found);
+        if (!found) continue;
+        if (!problem) {
+            loaded = 1;
+            break;
+        }
+        printf(RED "? Error: %s is damaged or incompatible (%s).\n" RESET_COLOR, path, problem);
+        if (snapshotTouched) {
+            // Part of it is in the stores already, so nothing else can load cleanly
+            printf(RED "  Move it aside to start from an older save file or a new database.\n" RESET_COLOR);
+            exit(1);
+        }
+        snapshotRelease();
+        damaged = 1;
+        headDamaged |= g == 0;
+    }
+    if (damaged && !loaded) {
+        printf(RED "  No older save file could be loaded either. Move them aside to start a new database.\n" RESET_COLOR);
+        exit(1);
+    }
+    if (!loaded) return 0;
+    if (strcmp(path, DATA_FILE) != 0) {
+        printf(YELLOW "?? Loaded %s, the newest save file that is intact. Changes saved after it\n"
+               "   are lost, apart from those still in the journal.\n" RESET_COLOR, path);
+    }
+    if (headDamaged && rename(DATA_FILE, SNAPSHOT_DAMAGED_FILE) == 0) {
+        printf(YELLOW "   The damaged %s was moved aside to %s.\n" RESET_COLOR, DATA_FILE, SNAPSHOT_DAMAGED_FILE);
+    }
+
+    if (!rebuildIndexes()) printf(RED "? Error: Out of memory while indexing records.\n" RESET_COLOR);
+    return 1;
+}
+
+// Reads the snapshot, then replays the journal written since it was taken
 void loadData() {
-    FILE *fp = fopen("hospital_data.bin", "rb");
-    if (!fp) {
+    unsigned long long t = metricStart();
+    int haveSnapshot = loadSnapshot();
+
+    int replayed = journalReplay();
+    if (!haveSnapshot && replayed == 0) {
         printf(YELLOW "No save file found. Starting new database.\n" RESET_COLOR);
         return;
     }
+    if (replayed < 0) {
+        // Fold what was recovered into a fresh snapshot so new records
+        // are not appended after the damaged tail
+        printf(YELLOW "?? Journal ends in an incomplete record (crash during write?). Recovered everything before it.\n" RESET_COLOR);
+        saveData();
+    } else if (replayed > 0) {
+        printf(CYAN "?? Replayed %d journaled change(s) since the last save.\n" RESET_COLOR, replayed);
+    }
+
+    metricStop(MT_LOAD, t);
+    printf(CYAN "?? Data loaded. Patients: %d, Diseases: %d, Doctors: %d, Appointments: %d\n" RESET_COLOR,
+           tableLive(&patientTable), diseaseStore.count, doctorStore.count, tableLive(&appointmentTable));
+    if (batchMode) return;
+    
+    printf("Press Enter to continue...");
+    getchar(); // Wait for user
+}
+
+/* --------------------- INTAKE --------------------- */
+// The checks every new record must pass, shared by the interactive
+// screens and batch mode. Each one validates a filled-in record, gives it
+// the next id unless it already has one, stores it and journals it.
+// Returns NULL on success, otherwise a message saying why it was refused.
+
+static char intakeError[200];
+
+int autoAssign = 0; // Set by --auto-assign: patients without a doctor get the least-loaded specialist
+int siteFirstId = 1, siteLastId = INT_MAX; // Set by --id-range: the ids this site hands out (see ROUTER)
+
+// Gives a new record the next id of its table (next) unless it has one,
+// keeping to this site's range so a router can tell where it lives.
+static const char* siteId(int *id, int next) {
+    if (!*id) *id = next < siteFirstId ? siteFirstId : next;
+    if (*id >= siteFirstId && *id <= siteLastId) return NULL;
+    snprintf(intakeError, sizeof(intakeError), "ID %d is outside this site's range %d-%d.", *id, siteFirstId, siteLastId);
+    return intakeError;
+}
+
+// Spells p's condition as the matching disease reference does (if any),
+// so both share one interned value. Returns the reference slot or -1.
+int linkPatientDisease(Patient *p) {
+    int ref = findDiseaseByName(p->disease);
+    if (ref != -1) memcpy(p->disease, diseaseAt(ref)->name, sizeof(p->disease));
+    return ref;
+}
+
+const char* admitPatient(Patient *p) {
+    unsigned long long t = metricStart();
+    if (p->id < 0 || (p->id && findPatientIndex(p->id) != -1)) return "Patient ID is invalid or already in use.";
+    if (p->doctorId && findDoctorIndex(p->doctorId) == -1) {
+        snprintf(intakeError, sizeof(intakeError), "No doctor found with ID %d.", p->doctorId);
+        return intakeError;
+    }
+    linkPatientDisease(p);
+    if (autoAssign && !p->doctorId) {
+        int di = leastLoadedDoctor(p->disease, sizeof(p->disease));
+        if (di != -1) p->doctorId = doctorAt(di)->id;
+    }
+    const char *e = siteId(&p->id, nextPatientId);
+    if (e) return e;
+    if (insertPatient(p) < 0) return "Out of memory. Patient not added.";
+    journalPatient(p);
+    metricStop(MT_INTAKE, t); // Successful intakes only
+    return NULL;
+}
+
+const char* registerDoctor(Doctor *d) {
+    if (d->id < 0 || (d->id && findDoctorIndex(d->id) != -1)) return "Doctor ID is invalid or already in use.";
+    const char *e = siteId(&d->id, nextDoctorId);
+    if (e) return e;
+    if (!insertDoctor(d)) return "Out of memory. Doctor not added.";
+    journalDoctor(d);
+    return NULL;
+}
+
+const char* registerDisease(Disease *d) {
+    if (d->id < 0 || (d->id && d->id < nextDiseaseId)) return "Disease ID is invalid or already in use.";
+    const char *e = siteId(&d->id, nextDiseaseId);
+    if (e) return e;
+    if (!insertDisease(d)) return "Out of memory. Disease not added.";
+    journalDisease(d);
+    return NULL;
+}
+
+// Also makes the doctor the patient's primary doctor if they have none;
+// *primarySet (if given) tells whether that happened.
+const char* bookAppointment(Appointment *a, int *primarySet) {
+    unsigned long long t = metricStart();
+    if (primarySet) *primarySet = 0;
+    int pi = findPatientIndex(a->patientId);
+    int di = findDoctorIndex(a->doctorId);
+    if (pi == -1 || di == -1) return "Invalid patient or doctor ID.";
+    if (a->id < 0 || (a->id && findAppointmentIndex(a->id) != -1)) return "Appointment ID is invalid or already in use.";
+
+    int when = parseDateTime(a->date, a->time);
+    if (when < 0) return "Invalid date or time. Use YYYY-MM-DD (years 1970 to 5999) and 24-hour HH:MM.";
+    int clash = scheduleConflict(di, when);
+    if (clash) {
+        char cdate[20], ctime[20];
+        appointmentDateTime(findAppointmentIndex(clash), cdate, sizeof(cdate), ctime, sizeof(ctime));
+        snprintf(intakeError, sizeof(intakeError), "%s already has appointment %d at %s %s (visits are %d minutes).",
+                 doctorAt(di)->name, clash, cdate, ctime, APPOINT_SLOT_MINUTES);
+        return intakeError;
+    }
+
+    const char *e = siteId(&a->id, nextAppointmentId);
+    if (e) return e;
+    if (insertAppointment(a) < 0) return "Out of memory. Appointment not scheduled.";
+    journalAppointment(a);
+
+    // If the patient doesn't have a primary doctor,
+    // assign the doctor from the appointment.
+    if (patientDoctorId(pi) == 0) {
+        reassignPatientDoctor(pi, a->doctorId);
+        journalIds(J_SET_PATIENT_DOCTOR, a->patientId, a->doctorId);
+        if (primarySet) *primarySet = 1;
+    }
+    metricStop(MT_BOOKING, t);
+    return NULL;
+}
+
+/* --------------------- DOCTOR OPERATIONS --------------------- */
+
+void displayDoctors() {
+    if (doctorStore.count == 0) {
+        printf(YELLOW "?? No doctors added yet.\n" RESET_COLOR);
+        return;
+    }
+    printf("\n" MAGENTA "========== DOCTOR LIST ==========\n" RESET_COLOR);
+    for (int i = 0; i < doctorStore.count; i++) {
+        printf(CYAN "ID: %d" RESET_COLOR " | Name: %s | Specialization: %s\n", 
+               doctorAt(i)->id, doctorAt(i)->name, doctorSpecialization(i));
+        printf("----------------------------------\n");
+    }
+}
+
+void addDoctor() {
+    clear_screen();
+    Doctor d = { 0 }; // Id assigned by registerDoctor()
+
+    printf(CYAN "\n--- New Doctor Registration ---\n" RESET_COLOR);
+    getLine("Enter doctor name (e.g., Dr. Smith): ", d.name, sizeof(d.name));
+    getLine("Enter specialization: ", d.specialization, sizeof(d.specialization));
+    getLine("Enter phone: ", d.phone, sizeof(d.phone));
+
+    const char *err = registerDoctor(&d);
+    if (err) {
+        printf(RED "? %s\n" RESET_COLOR, err);
+        return;
+    }
+    printf(GREEN "? Doctor added successfully! (ID: %d)\n" RESET_COLOR, d.id);
+}
+
+void viewDoctors() {
+    clear_screen();
+    displayDoctors(); // Use the helper
+}
+
+/* --------------------- PATIENT OPERATIONS --------------------- */
+
+void addPatient() {
+    clear_screen();
+    Patient p = { 0 }; // Id assigned by admitPatient()
+
+    // Fields are read straight into the record; only the text columns are
+    // copied once more, into the string pool, when it is stored
+    printf(CYAN "\n--- New Patient Registration ---\n" RESET_COLOR);
+    getLine("Enter patient name: ", p.name, sizeof(p.name));
+    p.age = get_int_from_user("Enter age: "); // Robust input
+    getLine("Enter gender: ", p.gender, sizeof(p.gender));
+    getLine("Enter phone number: ", p.phone, sizeof(p.phone));
+
+    // --- STREAMLINED WORKFLOW ---
+    printf(CYAN "\n--- Diagnosis & Assignment ---\n" RESET_COLOR);
+    getLine("Enter patient's disease/condition: ", p.disease, sizeof(p.disease));
+    int ref = linkPatientDisease(&p);
+    if (ref != -1) printf(CYAN "Linked to disease reference #%d.\n" RESET_COLOR, diseaseAt(ref)->id);
+    
+    // Automatically show doctor list for assignment
+    int best = autoAssign ? leastLoadedDoctor(p.disease, sizeof(p.disease)) : -1;
+    if (best != -1) {
+        p.doctorId = doctorAt(best)->id;
+        printf(GREEN "? Doctor %s (ID: %d, %d patients) assigned automatically.\n" RESET_COLOR,
+               doctorAt(best)->name, p.doctorId, doctorLoad(best).patients);
+    } else if (doctorStore.count > 0) {
+        printf(YELLOW "\n--- Assign a Doctor ---" RESET_COLOR);
+        displayDoctors(); // Show list
+        int docId = get_int_from_user("Enter Doctor ID to assign (or 0 for none): ");
+        
+        if (docId != 0 && findDoctorIndex(docId) != -1) {
+            p.doctorId = docId;
+            printf(GREEN "? Doctor (ID: %d) assigned.\n" RESET_COLOR, docId);
+        } else {
+            p.doctorId = 0;
+            if (docId != 0) {
+                 printf(RED "?? No doctor found with ID %d. Patient assigned 'None'.\n" RESET_COLOR, docId);
+            } else {
+                 printf(YELLOW "?? Patient assigned 'None'.\n" RESET_COLOR);
+            }
+        }
+    } else {
+        printf(YELLOW "?? No doctors in system. Patient assigned 'None'.\n" RESET_COLOR);
+        p.doctorId = 0; // No doctors to assign
+    }
+
+    const char *err = admitPatient(&p);
+    if (err) {
+        printf(RED "? %s\n" RESET_COLOR, err);
+        return;
+    }
+    printf(GREEN "\n? Patient added successfully! (ID: %d)\n" RESET_COLOR, p.id);
+}
+
+// Formats one patient entry of a listing
+void printPatient(OutBuf *ob, int i) {
+    obPrintf(ob, BLUE "ID: %d\n" RESET_COLOR "Name: %s\nAge: %d\nGender: %s\nPhone: %s\n",
+             patientId(i), patientName(i), patientAge(i), patientGender(i), patientPhone(i));
+    int ref = findDiseaseByName(patientDisease(i));
+    if (ref != -1) obPrintf(ob, YELLOW "Disease: %s (reference #%d)\n" RESET_COLOR, patientDisease(i), diseaseAt(ref)->id);
+    else obPrintf(ob, YELLOW "Disease: %s\n" RESET_COLOR, patientDisease(i));
+    
+    if (patientDoctorId(i) != 0) {
+        int doc_idx = findDoctorIndex(patientDoctorId(i));
+        obPrintf(ob, GREEN "Doctor: %s (ID: %d)\n" RESET_COLOR,
+                 doc_idx != -1 ? doctorAt(doc_idx)->name : "Unknown", patientDoctorId(i));
+    } else {
+        obPrintf(ob, RED "Doctor: Not Assigned\n" RESET_COLOR);
+    }
+    obPrintf(ob, "----------------------------------\n");
+}
+
+// Listing over patient slots, skipping deleted ones
+static int seekPatientSlot(int pos) {
+    for (; pos < patientIds.count; pos++) if (patientId(pos) != 0) return pos;
+    return -1;
+}
+
+void viewPatients() {
+    clear_screen();
+    if (tableLive(&patientTable) == 0) {
+        printf(YELLOW "?? No patients available.\n" RESET_COLOR);
+        return;
+    }
+    Listing l = { "PATIENT LIST", tableLive(&patientTable), seekPatientSlot, printPatient };
+    showListing(&l);
+}
+
+void searchPatientById() {
+    clear_screen();
+    int id = get_int_from_user("\nEnter patient ID to search: ");
+    if (id <= 0) { printf(RED "? Invalid ID.\n" RESET_COLOR); return; }
+
+    int i = findPatientIndex(id);
+    if (i != -1) {
+        printf(GREEN "\n? Patient Found!\n" RESET_COLOR);
+        printf("ID: %d\n", patientId(i));
+        printf("Name: %s\n", patientName(i));
+        printf("Age: %d\n", patientAge(i));
+        printf("Gender: %s\n", patientGender(i));
+        printf("Phone: %s\n", patientPhone(i));
+        printf(YELLOW "Disease: %s\n" RESET_COLOR, patientDisease(i));
+        int ref = findDiseaseByName(patientDisease(i));
+        if (ref != -1) {
+            printf("  Symptoms: %s\n", diseaseAt(ref)->symptoms);
+            printf("  Treatment: %s\n", diseaseAt(ref)->treatment);
+        }
+        if (patientDoctorId(i)) {
+            int j = findDoctorIndex(patientDoctorId(i));
+            if (j != -1) {
+                printf(GREEN "Doctor: %s (ID: %d)\n" RESET_COLOR, doctorAt(j)->name, doctorAt(j)->id);
+            } else {
+                 printf(RED "Doctor: Unknown (ID: %d)\n" RESET_COLOR, patientDoctorId(i));
+            }
+        } else {
+            printf(RED "Doctor: Not Assigned\n" RESET_COLOR);
+        }
+        return;
+    }
+    printf(YELLOW "? Patient with ID %d not found.\n" RESET_COLOR, id);
+}
+
+// Case-insensitive "does name start with prefix"
+int hasPrefix_custom(const char *name, const char *prefix) {
+    for (; *prefix; name++, prefix++) {
+        if (tolower((unsigned char)*name) != tolower((unsigned char)*prefix)) return 0;
+    }
+    return 1;
+}
+
+// Exact matches first, then other names starting with the text, and
+// only if neither turns anything up, close spellings
+void searchPatientByName() {
+    clear_screen();
+    char name[100];
+    getLine("\nEnter patient name (or the start of it) to search: ", name, sizeof(name));
+    if (name[0] == '\0') { printf(RED "? Please enter a name.\n" RESET_COLOR); return; }
+
+    // Names sharing a prefix are adjacent in the name index, and exact
+    // matches sort first among them (a prefix orders before its extensions)
+    unsigned long long t = metricStart();
+    indexNeed(X_NAMES);
+    const NameIndex *ix = &patientNameIndex;
+    int found = 0, shown = 0, more = 0;
+    for (int k = nameIndexLowerBound(ix, name, 0); k < ix->count; k++) {
+        int slot = ix->slots[k];
+        if (!hasPrefix_custom(patientName(slot), name)) break;
+        int exact = stricmp_custom(patientName(slot), name) == 0;
+        if (!exact && shown >= SEARCH_MAX_RESULTS) { more = 1; break; }
+        if (!found) { printf(GREEN "\n? Matches:\n" RESET_COLOR); }
+        found = 1;
+        if (!exact && shown == 0) printf(CYAN "Names starting with '%s':\n" RESET_COLOR, name);
+        if (!exact) shown++;
+        printf("ID: %d | Name: %s | Disease: %s\n", patientId(slot), patientName(slot), patientDisease(slot));
+    }
+    if (more) printf(CYAN "(more names start with '%s'; type more of the name to narrow it down)\n" RESET_COLOR, name);
+    if (found) { metricStop(MT_NAME_SEARCH, t); return; }
+
+    FuzzyMatch close[SEARCH_MAX_RESULTS];
+    int n = fuzzyFindPatients(name, close, SEARCH_MAX_RESULTS);
+    metricStop(MT_NAME_SEARCH, t);
+    if (n == 0) {
+        printf(YELLOW "? No patient named '%s' found.\n" RESET_COLOR, name);
+        return;
+    }
+    printf(YELLOW "? No patient named '%s'. Did you mean:\n" RESET_COLOR, name);
+    for (int k = 0; k < n; k++) {
+        int slot = close[k].slot;
+        printf("ID: %d | Name: %s | Disease: %s\n", patientId(slot), patientName(slot), patientDisease(slot));
+    }
+}
+
+void deletePatient() {
+    clear_screen();
+    int id = get_int_from_user("\nEnter patient ID to delete: ");
+    if (id <= 0) { printf(RED "? Invalid ID.\n" RESET_COLOR); return; }
+
+    int i = findPatientIndex(id);
+    if (i != -1) {
+        printf(YELLOW "Found: %s. Are you sure you want to delete? (y/n): " RESET_COLOR, patientName(i));
+        char confirm[10];
+        getLine("", confirm, sizeof(confirm));
+        
+        if (confirm[0] == 'y' || confirm[0] == 'Y') {
+            removePatient(i);
+            journalIds(J_DELETE_PATIENT, id, 0);
+            printf(GREEN "??? Patient deleted successfully.\n" RESET_COLOR);
+        } else {
+            printf(CYAN "Deletion canceled.\n" RESET_COLOR);
+        }
+        return;
+    }
+    printf(YELLOW "? No patient found with ID %d.\n" RESET_COLOR, id);
+}
+
+// Listing over name index positions
+static int seekNameIndex(int pos) { return pos < patientNameIndex.count ? pos : -1; }
+static void printPatientByName(OutBuf *ob, int pos) { printPatient(ob, patientNameIndex.slots[pos]); }
+
+// Lists patients in name order straight from the name index; the
+// stored records (and 'View All Patients' order) are left untouched
+void sortPatientsByName() {
+    clear_screen();
+    if (tableLive(&patientTable) == 0) {
+        printf(YELLOW "?? No patients available.\n" RESET_COLOR);
+        return;
+    }
+    indexNeed(X_NAMES);
+    Listing l = { "PATIENTS BY NAME", patientNameIndex.count, seekNameIndex, printPatientByName };
+    showListing(&l);
+}
+
+/* --------------------- DISEASE REFERENCE OPERATIONS --------------------- */
+void addDisease() {
+    clear_screen();
+    Disease *d = diseaseDraft(); // Typed straight into its slot; id assigned by registerDisease()
+    if (!d) { printf(RED "? Error: Out of memory.\n" RESET_COLOR); return; }
+
+    printf(CYAN "\n--- Add to Disease Reference Database ---\n" RESET_COLOR);
+    getLine("Enter disease name: ", d->name, sizeof(d->name));
+    getLine("Enter common symptoms: ", d->symptoms, sizeof(d->symptoms));
+    getLine("Enter common treatment: ", d->treatment, sizeof(d->treatment));
+
+    const char *err = registerDisease(d);
+    if (err) {
+        printf(RED "? %s\n" RESET_COLOR, err);
+        return;
+    }
+    printf(GREEN "? Disease reference added successfully! (ID: %d)\n" RESET_COLOR, d->id);
+}
+
+void displayDiseases() {
+    clear_screen();
+    if (diseaseStore.count == 0) {
+        printf(YELLOW "?? No diseases recorded in reference database.\n" RESET_COLOR);
+        return;
+    }
+    printf("\n" MAGENTA "========== DISEASE REFERENCE DATABASE ==========\n" RESET_COLOR);
+    for (int i = 0; i < diseaseStore.count; i++) {
+        printf(BLUE "ID: %d\nName: %s\n" RESET_COLOR, diseaseAt(i)->id, diseaseAt(i)->name);
+        printf("Symptoms: %s\nTreatment: %s\n", diseaseAt(i)->symptoms, diseaseAt(i)->treatment);
+        printf("----------------------------------\n");
+    }
+}
+
+/* --------------------- APPOINTMENTS --------------------- */
+
+void addAppointment() {
+    clear_screen();
+    if (tableLive(&patientTable) == 0 || doctorStore.count == 0) {
+        printf(YELLOW "?? Need at least one patient and one doctor to schedule.\n" RESET_COLOR);
+        return;
+    }
+    
+    printf(CYAN "\n--- Schedule New Appointment ---\n" RESET_COLOR);
+
+    int pid = get_int_from_user("Enter patient ID: ");
+    int did = get_int_from_user("Enter doctor ID: ");
+
+    int pi = findPatientIndex(pid);
+    int di = findDoctorIndex(did);
+
+    if (pi == -1 || di == -1) { 
+        printf(YELLOW "? Invalid patient or doctor ID.\n" RESET_COLOR); 
+        return; 
+    }
+
+    Appointment a;
+    a.id = 0; // Assigned by bookAppointment()
+    a.patientId = pid;
+    a.doctorId = did;
+
+    getLine("Enter date (YYYY-MM-DD): ", a.date, sizeof(a.date));
+    getLine("Enter time (HH:MM): ", a.time, sizeof(a.time));
+
+    int primarySet;
+    const char *err = bookAppointment(&a, &primarySet);
+    if (err) {
+        printf(RED "? %s\n" RESET_COLOR, err);
+        return;
+    }
+    if (primarySet) {
+        printf(CYAN "Note: %s has been set as the primary doctor for %s.\n" RESET_COLOR, doctorAt(di)->name, patientName(pi));
+    }
+
+    printf(GREEN "? Appointment scheduled (ID: %d) for patient %s with %s on %s %s\n" RESET_COLOR,
+           a.id, patientName(pi), doctorAt(di)->name, a.date, a.time);
+}
+
+// Formats one appointment entry of a listing
+static void printAppointment(OutBuf *ob, int i) {
+    int pid = appointmentPatientId(i);
+    int did = appointmentDoctorId(i);
+    int di = findDoctorIndex(did);
+    char date[40], time[20];
+    appointmentDateTime(i, date, sizeof(date), time, sizeof(time));
+    obPrintf(ob, BLUE "Appointment ID: %d\n" RESET_COLOR "Patient: %s (ID: %d)\nDoctor: %s (ID: %d)\nDate: %s\nTime: %s\n"
+             "----------------------------------\n",
+             appointmentId(i), getPatientName(pid), pid, di != -1 ? doctorAt(di)->name : "Unknown", did, date, time);
+}
+
+// Listing over appointment slots, skipping canceled ones
+static int seekAppointmentSlot(int pos) {
+    for (; pos < appointmentIds.count; pos++) if (appointmentId(pos) != 0) return pos;
+    return -1;
+}
+
+// Slots of the appointments of the days being listed, in time order
+static int *daySlots = NULL;
+static int daySlotCount = 0;
+static int seekDaySlot(int pos) { return pos < daySlotCount ? pos : -1; }
+static void printDaySlot(OutBuf *ob, int pos) { printAppointment(ob, daySlots[pos]); }
+
+// Lists the appointments of days first to first + days - 1 from their
+// calendar buckets
+static void showDays(const char *title, int first, int days) {
+    int n = 0;
+    indexNeed(X_CALENDAR);
+    for (int d = first; d < first + days; d++) n += appointmentsOn(d);
+    if (n == 0) {
+        printf(YELLOW "?? No appointments in this period.\n" RESET_COLOR);
+        return;
+    }
+    daySlots = malloc((size_t)n * sizeof(int));
+    if (!daySlots) { printf(RED "? Out of memory.\n" RESET_COLOR); return; }
+    daySlotCount = 0;
+    for (int d = first; d < first + days; d++) {
+        const DoctorSchedule *bucket = calendarDay(d);
+        for (int k = 0; bucket && k < bucket->count; k++) {
+            int ai = findAppointmentIndex(bucket->entries[k].apptId);
+            if (ai != -1) daySlots[daySlotCount++] = ai;
+        }
+    }
+    Listing l = { title, daySlotCount, seekDaySlot, printDaySlot };
+    showListing(&l);
+    free(daySlots);
+    daySlots = NULL;
+}
+
+void displayAppointments() {
+    clear_screen();
+    if (tableLive(&appointmentTable) == 0) {
+        printf(YELLOW "?? No appointments scheduled.\n" RESET_COLOR);
+        return;
+    }
+    int choice = get_int_from_user("Show 1) all, 2) today or 3) this week? ");
+    int day = today();
+    if (choice == 2) showDays("TODAY'S APPOINTMENTS", day, 1);
+    else if (choice == 3) showDays("THIS WEEK'S APPOINTMENTS", day - (day + 3) % 7, 7); // Day 0 was a Thursday
+    else {
+        Listing l = { "APPOINTMENTS", tableLive(&appointmentTable), seekAppointmentSlot, printAppointment };
+        showListing(&l);
+    }
+}
+
+void cancelAppointment() {
+    clear_screen();
+    int id = get_int_from_user("\nEnter appointment ID to cancel: ");
+    if (id <= 0) { printf(RED "? Invalid ID.\n" RESET_COLOR); return; }
+
+    int i = findAppointmentIndex(id);
+    if (i != -1) {
+        // *** BUG FIX ***: Used new getPatientName helper function
+        printf(YELLOW "Found appointment for %s. Are you sure? (y/n): " RESET_COLOR, getPatientName(appointmentPatientId(i)));
+        char confirm[10];
+        getLine("", confirm, sizeof(confirm));
+
+        if (confirm[0] == 'y' || confirm[0] == 'Y') {
+            removeAppointment(i);
+            journalIds(J_CANCEL_APPOINTMENT, id, 0);
+            printf(GREEN "? Appointment canceled.\n" RESET_COLOR);
+        } else {
+            printf(CYAN "Canceled.\n" RESET_COLOR);
+        }
+        return;
+    }
+    printf(YELLOW "? No appointment found with ID %d.\n" RESET_COLOR, id);
+}
+
+// Lists one doctor's appointments for a day or a week, straight from the
+// doctor's time-ordered schedule
+void viewDoctorSchedule() {
+    clear_screen();
+    int did = get_int_from_user("\nEnter doctor ID: ");
+    int di = findDoctorIndex(did);
+    if (di == -1) { printf(YELLOW "? No doctor found with ID %d.\n" RESET_COLOR, did); return; }
+
+    char date[20];
+    getLine("Enter start date (YYYY-MM-DD): ", date, sizeof(date));
+    int day = parseDate(date);
+    if (day < 0) { printf(RED "? Invalid date. Use YYYY-MM-DD (years 1970 to 5999).\n" RESET_COLOR); return; }
+    int days = get_int_from_user("Show 1 day or 7 days? ") == 7 ? 7 : 1;
+
+    char last[20];
+    formatDate(day + days - 1, last, sizeof(last));
+    printf("\n" MAGENTA "========== %s: %s%s%s ==========\n" RESET_COLOR,
+           doctorAt(di)->name, date, days > 1 ? " to " : "", days > 1 ? last : "");
+
+    indexNeed(X_SCHEDULES);
+    const DoctorSchedule *ds = di < scheduleCap ? &schedules[di] : NULL;
+    int from = day * MINUTES_PER_DAY, to = (day + days) * MINUTES_PER_DAY;
+    int shown = 0;
+    for (int k = ds ? scheduleLowerBound(ds, from) : 0; ds && k < ds->count && ds->entries[k].when < to; k++) {
+        int ai = findAppointmentIndex(ds->entries[k].apptId);
+        if (ai == -1) continue;
+        char adate[20], atime[20];
+        appointmentDateTime(ai, adate, sizeof(adate), atime, sizeof(atime));
+        int pid = appointmentPatientId(ai);
+        printf(CYAN "%s %s" RESET_COLOR " | Appointment ID: %d | Patient: %s (ID: %d)\n",
+               adate, atime, ds->entries[k].apptId, getPatientName(pid), pid);
+        shown++;
+    }
+    if (!shown) printf(YELLOW "?? No appointments in this period.\n" RESET_COLOR);
+}
+
+/* --------------------- STATISTICS --------------------- */
+
+// Writes the metrics in Prometheus text format. Histogram bounds are
+// powers of 4 nanoseconds (about 1 us to 17 s), which fall on bucket
+// edges, so the counts under each are exact.
+void metricsPrometheus(OutBuf *ob) {
+    for (int m = 0; m < MT_COUNT; m++) {
+        LatencyHistogram h;
+        metricRead(m, &h);
+        const char *name = timerNames[m][0];
+        obPrintf(ob, "# HELP hms_%s %s.\n# TYPE hms_%s histogram\n", name, timerNames[m][1], name);
+        long long below = 0;
+        int b = 0;
+        for (int e = 10; e <= 34; e += 2) {
+            for (int upTo = latBucket(1ull << e); b < upTo; b++) below += h.counts[b];
+            obPrintf(ob, "hms_%s_bucket{le=\"%.10g\"} %lld\n", name, (double)(1ull << e) / 1e9, below);
+        }
+        obPrintf(ob, "hms_%s_bucket{le=\"+Inf\"} %lld\n", name, h.total);
+        obPrintf(ob, "hms_%s_sum %.9f\nhms_%s_count %lld\n", name, (double)h.sum / 1e9, name, h.total);
+    }
+    for (int c = 0; c < MC_COUNT; c++) {
+        const char *name = counterNames[c][0];
+        obPrintf(ob, "# HELP hms_%s %s.\n# TYPE hms_%s counter\nhms_%s %lld\n", name, counterNames[c][1], name, name,
+                 __atomic_load_n(&counters[c], __ATOMIC_RELAXED));
+    }
+    obPrintf(ob, "# HELP hms_records Records held, by kind.\n# TYPE hms_records gauge\n");
+    obPrintf(ob, "hms_records{kind=\"patient\"} %d\n", tableLive(&patientTable));
+    obPrintf(ob, "hms_records{kind=\"appointment\"} %d\n", tableLive(&appointmentTable));
+    obPrintf(ob, "hms_records{kind=\"doctor\"} %d\n", doctorStore.count);
+    obPrintf(ob, "hms_records{kind=\"disease\"} %d\n", diseaseStore.count);
+}
+
+// Formats ns with a unit that keeps it short
+static const char* formatNanos(double ns, char *buf, size_t size) {
+    if (ns < 1e3) snprintf(buf, size, "%.0f ns", ns);
+    else if (ns < 1e6) snprintf(buf, size, "%.1f us", ns / 1e3);
+    else if (ns < 1e9) snprintf(buf, size, "%.1f ms", ns / 1e6);
+    else snprintf(buf, size, "%.2f s", ns / 1e9);
+    return buf;
+}
+
+// Busiest doctors (by patients, then appointments) first
+static int compareLoad(const void *a, const void *b) {
+    DoctorLoad x = doctorLoad(*(const int*)a), y = doctorLoad(*(const int*)b);
+    if (x.patients != y.patients) return y.patients - x.patients;
+    return y.appointments - x.appointments;
+}
+
+static int compareCensus(const void *a, const void *b) {
+    return censusOf(*(const int*)b) - censusOf(*(const int*)a);
+}
+
+static void reportWorkload() {
+    indexNeed(X_AGGREGATES);
+    int n = doctorStore.count;
+    int *order = malloc((size_t)(n ? n : 1) * sizeof(int));
+    if (!order) { printf(RED "? Error: Out of memory.\n" RESET_COLOR); return; }
+    for (int i = 0; i < n; i++) order[i] = i;
+    qsort(order, (size_t)n, sizeof(int), compareLoad);
+    printf(CYAN "%-6s %-30s %10s %14s\n" RESET_COLOR, "ID", "Doctor", "Patients", "Appointments");
+    for (int k = 0; k < n; k++) {
+        DoctorLoad l = doctorLoad(order[k]);
+        printf("%-6d %-30s %10d %14d\n", doctorAt(order[k])->id, doctorAt(order[k])->name, l.patients, l.appointments);
+    }
+    printf("%-6s %-30s %10d\n", "-", "(no doctor)", aggregates.unassigned);
+    free(order);
+}
+
+static void reportCensus() {
+    indexNeed(X_AGGREGATES);
+    int n = 0, *order = malloc((size_t)(interned.refs.count + 1) * sizeof(int));
+    if (!order) { printf(RED "? Error: Out of memory.\n" RESET_COLOR); return; }
+    for (int h = 0; h <= interned.refs.count; h++) if (censusOf(h)) order[n++] = h;
+    qsort(order, (size_t)n, sizeof(int), compareCensus);
+    printf(CYAN "%-34s %10s\n" RESET_COLOR, "Condition", "Patients");
+    for (int k = 0; k < n; k++) {
+        printf("%-34s %10d\n", order[k] ? internStr(&interned, order[k]) : "(none)", censusOf(order[k]));
+    }
+    if (!n) printf(YELLOW "?? No patients on record.\n" RESET_COLOR);
+    free(order);
+}
+
+static void reportDaily() {
+    char date[20];
+    getLine("Enter start date (YYYY-MM-DD): ", date, sizeof(date));
+    int day = parseDate(date);
+    if (day < 0) { printf(RED "? Invalid date. Use YYYY-MM-DD (years 1970 to 5999).\n" RESET_COLOR); return; }
+    int days = get_int_from_user("Number of days (1-366): ");
+    if (days < 1 || days > MAX_REPORT_DAYS) days = 7;
+    indexNeed(X_CALENDAR);
+    int most = 1;
+    for (int d = day; d < day + days; d++) if (appointmentsOn(d) > most) most = appointmentsOn(d);
+    for (int d = day; d < day + days; d++) {
+        char shown[20], bar[41];
+        int n = appointmentsOn(d), len = (int)((long long)n * 40 / most);
+        memset(bar, '#', (size_t)len);
+        bar[len] = '\0';
+        formatDate(d, shown, sizeof(shown));
+        printf("%s %6d " GREEN "%s" RESET_COLOR "\n", shown, n, bar);
+    }
+}
+
+// Appointments of closed days, read back from the archive on request
+static void reportArchived() {
+    char date[20];
+    getLine("Enter start date (YYYY-MM-DD): ", date, sizeof(date));
+    int day = parseDate(date);
+    if (day < 0) { printf(RED "? Invalid date. Use YYYY-MM-DD (years 1970 to 5999).\n" RESET_COLOR); return; }
+    int days = get_int_from_user("Number of days (1-366): ");
+    if (days < 1 || days > MAX_REPORT_DAYS) days = 7;
+    ArchivedAppointment *rows;
+    int n = archiveRead(day, day + days, &rows);
+    if (n == 0) printf(YELLOW "?? No archived appointments in this period.\n" RESET_COLOR);
+    for (int k = 0; k < n; k++) {
+        char adate[20], atime[20];
+        formatWhen(rows[k].when, adate, sizeof(adate), atime, sizeof(atime));
+        int di = findDoctorIndex(rows[k].doctorId);
+        printf(CYAN "%s %s" RESET_COLOR " | Appointment ID: %d | Patient: %s (ID: %d) | Doctor: %s (ID: %d)\n",
+               adate, atime, rows[k].id, getPatientName(rows[k].patientId), rows[k].patientId,
+               di != -1 ? doctorAt(di)->name : "Unknown", rows[k].doctorId);
+    }
+    free(rows);
+}
+
+// Matches of the filter being listed (see FILTERS)
+static unsigned long long *filterHits = NULL;
+static int seekFilterHit(int pos) { return filterNext(filterHits, patientIds.count, pos); }
+
+static void reportFilter() {
+    char gender[10], disease[100];
+    printf(CYAN "Leave a field blank to match any value.\n" RESET_COLOR);
+    int minAge = get_optional_int_from_user("Minimum age: ", INT_MIN);
+    int maxAge = get_optional_int_from_user("Maximum age: ", INT_MAX);
+    getLine("Gender: ", gender, sizeof(gender));
+    getLine("Disease/condition: ", disease, sizeof(disease));
+    int did = get_optional_int_from_user("Doctor ID: ", 0);
+
+    PatientQuery q;
+    queryPatients(&q, minAge, maxAge, gender, disease, did);
+    int matches;
+    unsigned long long t = nowNanos();
+    unsigned long long *bits = filterPatients(&q, &matches);
+    if (!bits) { printf(RED "? Error: Out of memory.\n" RESET_COLOR); return; }
+    printf(GREEN "\n? %d patient(s) match (%.2f ms).\n" RESET_COLOR, matches, (double)(nowNanos() - t) / 1e6);
+    if (matches) {
+        filterHits = bits;
+        Listing l = { "MATCHING PATIENTS", matches, seekFilterHit, printPatient };
+        showListing(&l);
+        filterHits = NULL;
+    }
+    free(bits);
+}
+
+// Workload, census and per-day counts, all read from AGGREGATES, and
+// patient filters (see FILTERS)
+void viewReports() {
+    clear_screen();
+    printf(MAGENTA "\n========== REPORTS ==========\n" RESET_COLOR);
+    printf(BLUE " 1." RESET_COLOR " Doctor Workload\n");
+    printf(BLUE " 2." RESET_COLOR " Patients by Condition\n");
+    printf(BLUE " 3." RESET_COLOR " Appointments per Day\n");
+    printf(BLUE " 4." RESET_COLOR " Filter Patients\n");
+    printf(BLUE " 5." RESET_COLOR " Archived Appointments\n");
+    int choice = get_int_from_user("\nEnter your choice: ");
+    printf("\n");
+    switch (choice) {
+        case 1: reportWorkload(); break;
+        case 2: reportCensus(); break;
+        case 3: reportDaily(); break;
+        case 4: reportFilter(); break;
+        case 5: reportArchived(); break;
+        default: printf(RED "?? Invalid choice.\n" RESET_COLOR);
+    }
+}
+
+void viewStatistics() {
+    clear_screen();
+    printf(MAGENTA "\n========== STATISTICS ==========\n" RESET_COLOR);
+    if (!metricsOn) {
+        printf(YELLOW "?? Metrics are off. Start the program with --metrics to collect them.\n" RESET_COLOR);
+        return;
+    }
+    printf(CYAN "%-34s %10s %10s %10s %10s %10s\n" RESET_COLOR, "Operation", "Count", "Mean", "p50", "p99", "Max");
+    for (int m = 0; m < MT_COUNT; m++) {
+        LatencyHistogram h;
+        metricRead(m, &h);
+        if (h.total == 0) continue;
+        char mean[20], p50[20], p99[20], max[20];
+        printf("%-34s %10lld %10s %10s %10s %10s\n", timerNames[m][1], h.total,
+               formatNanos((double)h.sum / (double)h.total, mean, sizeof(mean)),
+               formatNanos(latPercentile(&h, 0.5), p50, sizeof(p50)),
+               formatNanos(latPercentile(&h, 0.99), p99, sizeof(p99)),
+               formatNanos((double)h.max, max, sizeof(max)));
+    }
+    printf("\n");
+    for (int c = 0; c < MC_COUNT; c++) printf("%-34s %10lld\n", counterNames[c][1], counters[c]);
+}
+
+/* --------------------- MENU / UI --------------------- */
+
+void display_menu() {
+    clear_screen();
+    printf(CYAN "============================================\n" RESET_COLOR);
+    printf(CYAN "    Professional Hospital Management System\n" RESET_COLOR);
+    printf(CYAN "============================================\n\n" RESET_COLOR);
+
+    printf(YELLOW "Patient Management\n" RESET_COLOR);
+    printf(BLUE " 1." RESET_COLOR " Add Patient (Full Intake)\n");
+    printf(BLUE " 2." RESET_COLOR " View All Patients\n");
+    printf(BLUE " 3." RESET_COLOR " Search Patient by ID\n");
+    printf(BLUE " 4." RESET_COLOR " Search Patient by Name\n");
+    printf(BLUE " 5." RESET_COLOR " Delete Patient\n");
+    printf(BLUE " 6." RESET_COLOR " List Patients by Name\n");
+    
+    printf(YELLOW "\nStaff & Reference\n" RESET_COLOR);
+    printf(BLUE " 7." RESET_COLOR " Add Doctor\n");
+    printf(BLUE " 8." RESET_COLOR " View Doctors\n");
+    printf(BLUE " 9." RESET_COLOR " Add Disease (Reference)\n");
+    printf(BLUE " 10." RESET_COLOR " View Diseases (Reference)\n");
+    
+    printf(YELLOW "\nScheduling\n" RESET_COLOR);
+    printf(BLUE " 11." RESET_COLOR " Schedule Appointment\n");
+    printf(BLUE " 12." RESET_COLOR " View Appointments\n");
+    printf(BLUE " 13." RESET_COLOR " Cancel Appointment\n");
+    printf(BLUE " 14." RESET_COLOR " Doctor's Day/Week Schedule\n");
+
+    printf(YELLOW "\nSystem\n" RESET_COLOR);
+    printf(BLUE " 15." RESET_COLOR " Save Data Now\n");
+    printf(BLUE " 16." RESET_COLOR " Reports\n");
+    printf(BLUE " 17." RESET_COLOR " Statistics\n");
+    printf(BLUE " 18." RESET_COLOR " Exit\n");
+}
+
+/* --------------------- BATCH MODE --------------------- */
+// hms --batch [FILE]   (stdin if FILE is missing or "-")
+// Applies one record or command per line through the same INTAKE checks
+// as the screens, with no prompts or screen clears. A line is CSV, or a
+// JSON object if it starts with '{':
+//   patient,NAME,AGE,GENDER,PHONE,DISEASE[,DOCTOR_ID]
+//   doctor,NAME,SPECIALIZATION,PHONE
+//   disease,NAME,SYMPTOMS,TREATMENT
+//   appointment,PATIENT_ID,DOCTOR_ID,YYYY-MM-DD,HH:MM
+//   delete-patient,ID
+//   cancel-appointment,ID
+//   {"type":"patient","name":"Ann Lee","age":34,"disease":"Flu"}
+// Queries write CSV rows (id first) to stdout:
+//   get-patient,ID          find-patient,NAME[,LIMIT]
+//   list-patients[,OFFSET,LIMIT]   (also list-doctors, list-diseases,
+//   list-appointments; LIMIT defaults to the page size)
+//   doctor-schedule,DOCTOR_ID,YYYY-MM-DD[,DAYS]
+//   appointments-on,YYYY-MM-DD[,DAYS]        (in time order; see CALENDAR)
+//   archived-appointments,YYYY-MM-DD[,DAYS]  (read from the ARCHIVE)
+//   workload                (doctor id, name, patients, appointments)
+//   census                  (condition, patients)
+//   daily-appointments,YYYY-MM-DD[,DAYS]   (date, appointments)
+//   filter-patients,MIN_AGE,MAX_AGE,GENDER,DISEASE,DOCTOR_ID[,OFFSET,LIMIT]
+//                           (blank fields match anything; see FILTERS)
+//   metrics                 (Prometheus text; see METRICS)
+//   save                    quit
+// A CSV line starting with "type," is a header naming the columns of the
+// CSV lines after it (e.g. type,id,name,age,disease), so columns can come
+// in any order and records can carry their own ids. JSON keys are the
+// same column names. Blank lines and lines starting with '#' are skipped.
+// Refused lines and the closing summary go to stderr; the run carries on
+// past refused lines.
+// Journal records are not synced one by one and the name indexes are
+// rebuilt once at the end; the run finishes with a sync and a snapshot.
+
+#define BATCH_LINE_MAX 4096
+#define BATCH_MAX_FIELDS 16
+
+typedef struct {
+    int n;
+    const char *keys[BATCH_MAX_FIELDS];
+    const char *values[BATCH_MAX_FIELDS];
+} BatchRecord;
+
+enum {
+    B_PATIENT, B_DOCTOR, B_DISEASE, B_APPOINTMENT, B_DELETE_PATIENT, B_CANCEL_APPOINTMENT,
+    B_GET_PATIENT, B_FIND_PATIENT, B_LIST_PATIENTS, B_LIST_DOCTORS, B_LIST_DISEASES,
+    B_LIST_APPOINTMENTS, B_DOCTOR_SCHEDULE, B_APPOINTMENTS_ON, B_ARCHIVED_APPOINTMENTS, B_WORKLOAD, B_CENSUS,
+    B_DAILY_APPOINTMENTS, B_FILTER_PATIENTS, B_METRICS, B_SAVE, B_QUIT, B_KINDS
+};
+
+// Record type, then its CSV columns when there is no header line
+static const char *const batchLayouts[B_KINDS][8] = {
+    { "patient", "name", "age", "gender", "phone", "disease", "doctor", NULL },
+    { "doctor", "name", "specialization", "phone", NULL },
+    { "disease", "name", "symptoms", "treatment", NULL },
+    { "appointment", "patient", "doctor", "date", "time", NULL },
+    { "delete-patient", "id", NULL },
+    { "cancel-appointment", "id", NULL },
+    { "get-patient", "id", NULL },
+    { "find-patient", "name", "limit", NULL },
+    { "list-patients", "offset", "limit", NULL },
+    { "list-doctors", "offset", "limit", NULL },
+    { "list-diseases", "offset", "limit", NULL },
+    { "list-appointments", "offset", "limit", NULL },
+    { "doctor-schedule", "doctor", "date", "days", NULL },
+    { "appointments-on", "date", "days", NULL },
+    { "archived-appointments", "date", "days", NULL },
+    { "workload", NULL },
+    { "census", NULL },
+    { "daily-appointments", "date", "days", NULL },
+    { "filter-patients", "min-age", "max-age", "gender", "disease", "doctor", "offset", "limit" },
+    { "metrics", NULL },
+    { "save", NULL },
+    { "quit", NULL },
+};
+
+static int batchKind(const char *type) {
+    for (int k = 0; k < B_KINDS; k++) if (strcmp(batchLayouts[k][0], type) == 0) return k;
+    return -1;
+}
+
+// Splits a CSV line in place (RFC 4180 quoting). Returns the field
+// count, or -1 on a bad quote or too many fields.
+static int csvSplit(char *line, char **fields, int max) {
+    int n = 0;
+    char *r = line, *w = line;
+    for (;;) {
+        if (n == max) return -1;
+        fields[n++] = w;
+        if (*r == '"') {
+            for (r++; ; ) {
+                if (*r == '\0') return -1; // Unterminated quote
+                if (*r == '"' && r[1] == '"') { *w++ = '"'; r += 2; continue; }
+                if (*r == '"') { r++; break; }
+                *w++ = *r++;
+            }
+            if (*r != ',' && *r != '\0') return -1;
+        } else {
+            while (*r != ',' && *r != '\0') *w++ = *r++;
+        }
+        int last = *r == '\0';
+        *w++ = '\0'; // w never passes r, so this only overwrites consumed bytes
+        if (last) return n;
+        r++;
+    }
+}
+
+static const char* skipSpace(const char *p) {
+    while (*p == ' ' || *p == '\t') p++;
+    return p;
+}
+
+// Decodes the JSON string starting at the quote *pp, in place. Leaves *pp
+// after the closing quote. Returns the decoded string or NULL.
+static char* jsonString(char **pp) {
+    char *r = *pp + 1, *w = *pp, *start = w;
+    while (*r != '"') {
+        if (*r == '\0') return NULL;
+        if (*r != '\\') { *w++ = *r++; continue; }
+        r++;
+        switch (*r++) {
+            case '"': *w++ = '"'; break;
+            case '\\': *w++ = '\\'; break;
+            case '/': *w++ = '/'; break;
+            case 'b': *w++ = '\b'; break;
+            case 'f': *w++ = '\f'; break;
+            case 'n': *w++ = '\n'; break;
+            case 'r': *w++ = '\r'; break;
+            case 't': *w++ = '\t'; break;
+            case 'u': {
+                unsigned c = 0;
+                for (int k = 0; k < 4; k++, r++) {
+                    if (!isxdigit((unsigned char)*r)) return NULL;
+                    c = c * 16 + (unsigned)(isdigit((unsigned char)*r) ? *r - '0' : tolower((unsigned char)*r) - 'a' + 10);
+                }
+                // Encoded as UTF-8; surrogate pairs are not combined
+                if (c < 0x80) *w++ = (char)c;
+                else if (c < 0x800) { *w++ = (char)(0xC0 | c >> 6); *w++ = (char)(0x80 | (c & 0x3F)); }
+                else { *w++ = (char)(0xE0 | c >> 12); *w++ = (char)(0x80 | (c >> 6 & 0x3F)); *w++ = (char)(0x80 | (c & 0x3F)); }
+                break;
+            }
+            default: return NULL;
+        }
+    }
+    *w = '\0';
+    *pp = r + 1;
+    return start;
+}
+
+// Parses a flat JSON object in place. Values may be strings, numbers or
+// true/false; null leaves the key out. Returns 0 if the line is not one.
+static int jsonSplit(char *line, BatchRecord *rec) {
+    char *p = (char*)skipSpace(line);
+    if (*p++ != '{') return 0;
+    p = (char*)skipSpace(p);
+    if (*p == '}') return *skipSpace(p + 1) == '\0';
+    for (;;) {
+        if (*p != '"') return 0;
+        char *key = jsonString(&p);
+        if (!key) return 0;
+        p = (char*)skipSpace(p);
+        if (*p++ != ':') return 0;
+        p = (char*)skipSpace(p);
+        char *value;
+        if (*p == '"') {
+            if (!(value = jsonString(&p))) return 0;
+        } else {
+            value = p;
+            while (isalnum((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.') p++;
+            if (p == value) return 0;
+        }
+        char *end = p;
+        p = (char*)skipSpace(p);
+        char sep = *p;
+        *end = '\0'; // After reading the separator, which may sit at 'end'
+        if (sep != ',' && sep != '}') return 0;
+        if (strcmp(value, "null") != 0) {
+            if (rec->n == BATCH_MAX_FIELDS) return 0;
+            rec->keys[rec->n] = key;
+            rec->values[rec->n++] = value;
+        }
+        p = (char*)skipSpace(p + 1);
+        if (sep == '}') return *p == '\0';
+    }
+}
+
+static const char* batchField(const BatchRecord *rec, const char *key) {
+    for (int i = 0; i < rec->n; i++) if (strcmp(rec->keys[i], key) == 0) return rec->values[i];
+    return NULL;
+}
+
+// Reads an int column. A missing or empty column gives def; returns 0
+// only if the column holds something other than an int.
+static int batchInt(const BatchRecord *rec, const char *key, int def, int *out) {
+    const char *v = batchField(rec, key);
+    *out = def;
+    if (!v || !*v) return 1;
+    char *end;
+    errno = 0;
+    long value = strtol(v, &end, 10);
+    if (*end != '\0' || errno == ERANGE || value > INT_MAX || value < INT_MIN) return 0;
+    *out = (int)value;
+    return 1;
+}
+
+// Reads the days column (default 1), held to 1..MAX_REPORT_DAYS so one
+// request cannot walk years of empty days under storeLock
+static int batchDays(const BatchRecord *rec, int *days) {
+    if (!batchInt(rec, "days", 1, days)) return 0;
+    if (*days < 1) *days = 1;
+    if (*days > MAX_REPORT_DAYS) *days = MAX_REPORT_DAYS;
+    return 1;
+}
+
+// Copies a text column into dst (truncating like the intake screens)
+static void batchText(const BatchRecord *rec, const char *key, char *dst, size_t size) {
+    const char *v = batchField(rec, key);
+    snprintf(dst, size, "%s", v ? v : "");
+}
+
+// Writes s as one CSV field, quoted if it needs to be
+static void obCsv(OutBuf *ob, const char *s, char after) {
+    if (!strpbrk(s, ",\"\n\r")) {
+        obPrintf(ob, "%s%c", s, after);
+        return;
+    }
+    obPrintf(ob, "\"");
+    for (const char *q; (q = strchr(s, '"')); s = q + 1) obPrintf(ob, "%.*s\"\"", (int)(q - s), s);
+    obPrintf(ob, "%s\"%c", s, after);
+}
+
+// Query results are CSV rows starting with the record's id
+static void patientRow(OutBuf *ob, int i) {
+    obPrintf(ob, "%d,", tableRowId(&patientTable, i));
+    obCsv(ob, patientName(i), ',');
+    obPrintf(ob, "%d,", patientAge(i));
+    obCsv(ob, patientGender(i), ',');
+    obCsv(ob, patientPhone(i), ',');
+    obCsv(ob, patientDisease(i), ',');
+    obPrintf(ob, "%d\n", patientDoctorId(i));
+}
+
+static void doctorRow(OutBuf *ob, int i) {
+    obPrintf(ob, "%d,", doctorAt(i)->id);
+    obCsv(ob, doctorAt(i)->name, ',');
+    obCsv(ob, doctorSpecialization(i), ',');
+    obCsv(ob, doctorAt(i)->phone, '\n');
+}
+
+static void diseaseRow(OutBuf *ob, int i) {
+    obPrintf(ob, "%d,", diseaseAt(i)->id);
+    obCsv(ob, diseaseAt(i)->name, ',');
+    obCsv(ob, diseaseAt(i)->symptoms, ',');
+    obCsv(ob, diseaseAt(i)->treatment, '\n');
+}
+
+static void appointmentRow(OutBuf *ob, int i) {
+    char date[40], time[20];
+    appointmentDateTime(i, date, sizeof(date), time, sizeof(time));
+    obPrintf(ob, "%d,%d,%d,", tableRowId(&appointmentTable, i), appointmentPatientId(i), appointmentDoctorId(i));
+    obCsv(ob, date, ',');
+    obCsv(ob, time, '\n');
+}
+
+// Writes up to limit of the rows of t live in view v (the first rows of
+// it), skipping the first offset of them
+static void listRows(OutBuf *ob, const Table *t, const View *v, int rows, int offset, int limit, void (*row)(OutBuf*, int)) {
+    for (int i = 0; i < rows && limit > 0; i++) {
+        if (tableIdAt(t, v->version, i) == 0) continue;
+        if (offset > 0) { offset--; continue; }
+        row(ob, i);
+        limit--;
+    }
+}
+
+// True for commands that change the stores
+static int commandWrites(int kind) {
+    return kind < B_GET_PATIENT || kind == B_SAVE;
+}
+
+// True for the listings, which only read the rows inside a view and so
+// can run without storeLock (see SNAPSHOT VIEWS)
+static int commandScans(int kind) {
+    return kind == B_LIST_PATIENTS || kind == B_LIST_APPOINTMENTS || kind == B_LIST_DOCTORS || kind == B_LIST_DISEASES;
+}
+
+// Runs one parsed command. Listings show the rows of view (NULL for the
+// stores as they are). Query results go to out; *newId is set to the id
+// a new record was given (0 otherwise). Returns NULL or why it was
+// refused.
+static const char* runCommand(const BatchRecord *rec, int kind, const View *view, OutBuf *out, int *newId) {
+    static char err[120];
+    int id, offset, limit;
+    View now;
+    if (!view) {
+        viewOfStores(&now);
+        view = &now;
+    }
+    *newId = 0;
+    if (!batchInt(rec, "id", 0, &id)) return "id is not a number";
+    if (!batchInt(rec, "offset", 0, &offset) || !batchInt(rec, "limit", pageSize, &limit)) {
+        return "offset and limit must be numbers";
+    }
+    if (offset < 0 || limit < 0) return "offset and limit cannot be negative";
+    switch (kind) {
+        case B_PATIENT: {
+            Patient p;
+            p.id = id;
+            batchText(rec, "name", p.name, sizeof(p.name));
+            batchText(rec, "gender", p.gender, sizeof(p.gender));
+            batchText(rec, "phone", p.phone, sizeof(p.phone));
+            batchText(rec, "disease", p.disease, sizeof(p.disease));
+            const char *age = batchField(rec, "age");
+            if (!age || !*age || !batchInt(rec, "age", 0, &p.age)) return "age is missing or not a number";
+            if (!batchInt(rec, "doctor", 0, &p.doctorId)) return "doctor is not a number";
+            const char *e = admitPatient(&p);
+            if (!e) *newId = p.id;
+            return e;
+        }
+        case B_DOCTOR: {
+            Doctor d;
+            d.id = id;
+            batchText(rec, "name", d.name, sizeof(d.name));
+            batchText(rec, "specialization", d.specialization, sizeof(d.specialization));
+            batchText(rec, "phone", d.phone, sizeof(d.phone));
+            const char *e = registerDoctor(&d);
+            if (!e) *newId = d.id;
+            return e;
+        }
+        case B_DISEASE: {
+            Disease *d = diseaseDraft();
+            if (!d) return "Out of memory. Disease not added.";
+            d->id = id;
+            batchText(rec, "name", d->name, sizeof(d->name));
+            batchText(rec, "symptoms", d->symptoms, sizeof(d->symptoms));
+            batchText(rec, "treatment", d->treatment, sizeof(d->treatment));
+            const char *e = registerDisease(d);
+            if (!e) *newId = d->id;
+            return e;
+        }
+        case B_APPOINTMENT: {
+            Appointment a;
+            a.id = id;
+            if (!batchInt(rec, "patient", 0, &a.patientId) || !batchInt(rec, "doctor", 0, &a.doctorId)) {
+                return "patient and doctor must be numbers";
+            }
+            batchText(rec, "date", a.date, sizeof(a.date));
+            batchText(rec, "time", a.time, sizeof(a.time));
+            const char *e = bookAppointment(&a, NULL);
+            if (!e) *newId = a.id;
+            return e;
+        }
+        case B_DELETE_PATIENT: {
+            int i = findPatientIndex(id);
+            if (id <= 0 || i == -1) { snprintf(err, sizeof(err), "No patient found with ID %d.", id); return err; }
+            removePatient(i);
+            journalIds(J_DELETE_PATIENT, id, 0);
+            return NULL;
+        }
+        case B_CANCEL_APPOINTMENT: {
+            int i = findAppointmentIndex(id);
+            if (id <= 0 || i == -1) { snprintf(err, sizeof(err), "No appointment found with ID %d.", id); return err; }
+            removeAppointment(i);
+            journalIds(J_CANCEL_APPOINTMENT, id, 0);
+            return NULL;
+        }
+        case B_GET_PATIENT: {
+            int i = findPatientIndex(id);
+            if (id <= 0 || i == -1) return "No patient found.";
+            patientRow(out, i);
+            return NULL;
+        }
+        case B_FIND_PATIENT: {
+            // Prefix matches from the name index, else close spellings
+            const char *name = batchField(rec, "name");
+            if (!name || !*name) return "Please give a name.";
+            unsigned long long t = metricStart();
+            int shown = 0;
+            indexNeed(X_NAMES);
+            const NameIndex *ix = &patientNameIndex;
+            for (int k = nameIndexLowerBound(ix, name, 0); k < ix->count && shown < limit; k++, shown++) {
+                if (!hasPrefix_custom(patientName(ix->slots[k]), name)) break;
+                patientRow(out, ix->slots[k]);
+            }
+            if (!shown) {
+                FuzzyMatch close[SEARCH_MAX_RESULTS];
+                int n = fuzzyFindPatients(name, close, SEARCH_MAX_RESULTS);
+                for (int k = 0; k < n && k < limit; k++) patientRow(out, close[k].slot);
+            }
+            metricStop(MT_NAME_SEARCH, t);
+            return NULL;
+        }
+        case B_LIST_PATIENTS:
+            listRows(out, &patientTable, view, view->patients, offset, limit, patientRow);
+            return NULL;
+        case B_LIST_APPOINTMENTS:
+            listRows(out, &appointmentTable, view, view->appointments, offset, limit, appointmentRow);
+            return NULL;
+        case B_LIST_DOCTORS:
+            for (int i = offset; i < view->doctors && i - offset < limit; i++) doctorRow(out, i);
+            return NULL;
+        case B_LIST_DISEASES:
+            for (int i = offset; i < view->diseases && i - offset < limit; i++) diseaseRow(out, i);
+            return NULL;
+        case B_DOCTOR_SCHEDULE: {
+            int did, days;
+            char date[20];
+            if (!batchInt(rec, "doctor", 0, &did) || !batchDays(rec, &days)) return "doctor and days must be numbers";
+            batchText(rec, "date", date, sizeof(date));
+            int di = findDoctorIndex(did);
+            int day = parseDate(date);
+            if (di == -1) return "No doctor found.";
+            if (day < 0) return "Invalid date. Use YYYY-MM-DD (years 1970 to 5999).";
+            indexNeed(X_SCHEDULES);
+            if (di >= scheduleCap) return NULL;
+            const DoctorSchedule *ds = &schedules[di];
+            long long to = ((long long)day + days) * MINUTES_PER_DAY;
+            for (int k = scheduleLowerBound(ds, day * MINUTES_PER_DAY); k < ds->count && ds->entries[k].when < to; k++) {
+                int ai = findAppointmentIndex(ds->entries[k].apptId);
+                if (ai != -1) appointmentRow(out, ai);
+            }
+            return NULL;
+        }
+        case B_APPOINTMENTS_ON:
+        case B_ARCHIVED_APPOINTMENTS: {
+            int days;
+            char date[20];
+            if (!batchDays(rec, &days)) return "days must be a number";
+            batchText(rec, "date", date, sizeof(date));
+            int day = parseDate(date);
+            if (day < 0) return "Invalid date. Use YYYY-MM-DD (years 1970 to 5999).";
+            if (kind == B_APPOINTMENTS_ON) {
+                indexNeed(X_CALENDAR);
+                for (int d = day; d < day + days; d++) {
+                    const DoctorSchedule *bucket = calendarDay(d);
+                    for (int k = 0; bucket && k < bucket->count; k++) {
+                        int ai = findAppointmentIndex(bucket->entries[k].apptId);
+                        if (ai != -1) appointmentRow(out, ai);
+                    }
+                }
+                return NULL;
+            }
+            ArchivedAppointment *rows;
+            int n = archiveRead(day, day + days, &rows);
+            for (int k = 0; k < n; k++) {
+                char adate[20], atime[20];
+                formatWhen(rows[k].when, adate, sizeof(adate), atime, sizeof(atime));
+                obPrintf(out, "%d,%d,%d,%s,%s\n", rows[k].id, rows[k].patientId, rows[k].doctorId, adate, atime);
+            }
+            free(rows);
+            return NULL;
+        }
+        case B_WORKLOAD:
+            indexNeed(X_AGGREGATES);
+            for (int i = 0; i < view->doctors; i++) {
+                DoctorLoad l = doctorLoad(i);
+                obPrintf(out, "%d,", doctorAt(i)->id);
+                obCsv(out, doctorAt(i)->name, ',');
+                obPrintf(out, "%d,%d\n", l.patients, l.appointments);
+            }
+            obPrintf(out, "0,unassigned,%d,0\n", aggregates.unassigned);
+            return NULL;
+        case B_CENSUS:
+            indexNeed(X_AGGREGATES);
+            for (int h = 0; h <= interned.refs.count; h++) {
+                if (!censusOf(h)) continue;
+                obCsv(out, internStr(&interned, h), ',');
+                obPrintf(out, "%d\n", censusOf(h));
+            }
+            return NULL;
+        case B_DAILY_APPOINTMENTS: {
+            int days;
+            char date[20];
+            if (!batchDays(rec, &days)) return "days must be a number";
+            batchText(rec, "date", date, sizeof(date));
+            int day = parseDate(date);
+            if (day < 0) return "Invalid date. Use YYYY-MM-DD (years 1970 to 5999).";
+            indexNeed(X_CALENDAR);
+            for (int d = day; d < day + days; d++) {
+                char shown[20];
+                formatDate(d, shown, sizeof(shown));
+                obPrintf(out, "%s,%d\n", shown, appointmentsOn(d));
+            }
+            return NULL;
+        }
+        case B_FILTER_PATIENTS: {
+            int minAge, maxAge, did, matches;
+            Patient p; // Just for its gender and disease fields
+            if (!batchInt(rec, "min-age", INT_MIN, &minAge) || !batchInt(rec, "max-age", INT_MAX, &maxAge) ||
+                !batchInt(rec, "doctor", 0, &did)) return "ages and doctor must be numbers";
+            batchText(rec, "gender", p.gender, sizeof(p.gender));
+            batchText(rec, "disease", p.disease, sizeof(p.disease));
+            PatientQuery q;
+            queryPatients(&q, minAge, maxAge, p.gender, p.disease, did);
+            unsigned long long *bits = filterPatients(&q, &matches);
+            if (!bits) return "Out of memory.";
+            for (int i = filterNext(bits, patientIds.count, 0); i != -1 && limit > 0; i = filterNext(bits, patientIds.count, i + 1)) {
+                if (offset > 0) { offset--; continue; }
+                patientRow(out, i);
+                limit--;
+            }
+            free(bits);
+            return NULL;
+        }
+        case B_METRICS: metricsPrometheus(out); return NULL;
+        case B_SAVE: saveData(); return NULL;
+        case B_QUIT: return NULL;
+    }
+    return "unknown record type";
+}
+
+// Line-by-line CSV header state (see BATCH MODE)
+typedef struct {
+    char line[BATCH_LINE_MAX];
+    char *keys[BATCH_MAX_FIELDS];
+    int count;
+} BatchHeader;
+
+// Parses one line into rec and its command kind. Sets *kind to -1 for a
+// line with nothing to run (blank, comment, or a header when hdr is
+// given). Returns NULL or why the line cannot be parsed.
+static const char* parseCommand(char *line, BatchHeader *hdr, BatchRecord *rec, int *kind) {
+    *kind = -1;
+    rec->n = 0;
+    const char *first = skipSpace(line);
+    if (*first == '\0' || *first == '#') return NULL;
+    if (*first == '{') {
+        if (!jsonSplit(line, rec)) return "not a flat JSON object";
+    } else {
+        char *fields[BATCH_MAX_FIELDS];
+        int n = csvSplit(line, fields, BATCH_MAX_FIELDS);
+        if (n < 0) return "bad CSV quoting or too many columns";
+        if (hdr && strcmp(fields[0], "type") == 0) {
+            memcpy(hdr->line, line, sizeof(hdr->line)); // Fields are NUL-separated within it
+            hdr->count = n;
+            for (int i = 0; i < n; i++) hdr->keys[i] = hdr->line + (fields[i] - line);
+            return NULL;
+        }
+        int k = batchKind(fields[0]);
+        int headed = hdr && hdr->count;
+        for (int i = 0; i < n; i++) {
+            const char *key = headed ? (i < hdr->count ? hdr->keys[i] : NULL)
+                                     : i == 0 ? "type" : k >= 0 && i < 8 ? batchLayouts[k][i] : NULL;
+            if (!key) return "more columns than the header or record type has";
+            rec->keys[rec->n] = key;
+            rec->values[rec->n++] = fields[i];
+        }
+    }
+    const char *type = batchField(rec, "type");
+    *kind = type ? batchKind(type) : -1;
+    return *kind < 0 ? "unknown record type" : NULL;
+}
+
+// Runs batch mode over path (NULL or "-" for stdin). Returns the exit
+// status: 0 if every line was applied, 1 if any was refused, 2 if the
+// input could not be opened.
+int runBatch(const char *path) {
+    FILE *in = (!path || strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "hms: cannot open %s\n", path);
+        return 2;
+    }
+    batchMode = 1;
+    loadData();
+
+    journalBuffered = 1;
+    clock_t started = clock();
+
+    static char line[BATCH_LINE_MAX];
+    static BatchHeader header;
+    OutBuf out = { 0 };
+    int applied[B_KINDS] = {0};
+    int lineNo = 0, refused = 0;
+
+    while (fgets(line, sizeof(line), in)) {
+        lineNo++;
+        size_t len = strlen(line);
+        if (len && line[len - 1] == '\n') line[--len] = '\0';
+        else if (!feof(in)) {
+            int c;
+            while ((c = fgetc(in)) != '\n' && c != EOF) {}
+            fprintf(stderr, "line %d: longer than %d bytes\n", lineNo, BATCH_LINE_MAX - 1);
+            refused++;
+            continue;
+        }
+        if (len && line[len - 1] == '\r') line[--len] = '\0';
+
+        BatchRecord rec;
+        int kind, id;
+        const char *err = parseCommand(line, &header, &rec, &kind);
+        if (!err && kind < 0) continue;
+        if (kind == B_QUIT) break;
+        if (!err && (kind == B_PATIENT || kind == B_DELETE_PATIENT)) {
+            // Imports leave the name indexes to the next search rather
+            // than keep them sorted per insert
+            indexDefer(X_NAMES);
+            indexDefer(X_TRIGRAMS);
+        }
+        if (!err) err = runCommand(&rec, kind, NULL, &out, &id);
+        if (err) {
+            fprintf(stderr, "line %d: %s\n", lineNo, err);
+            refused++;
+        } else {
+            applied[kind]++;
+        }
+        if (out.len >= 65536) obFlush(&out);
+    }
+    if (in != stdin) fclose(in);
+    obFlush(&out);
+    obFree(&out);
+
+    if (journalFp) syncFile(journalFp);
+    journalBuffered = 0;
+    double seconds = (double)(clock() - started) / CLOCKS_PER_SEC;
+    saveData();
+
+    int total = 0, queries = 0;
+    for (int k = 0; k < B_KINDS; k++) total += applied[k];
+    for (int k = B_GET_PATIENT; k < B_SAVE; k++) queries += applied[k];
+    fprintf(stderr, "Batch: %d applied (patients %d, doctors %d, diseases %d, appointments %d, deletions %d, "
+            "cancellations %d, queries %d), %d refused, %.3f s",
+            total, applied[B_PATIENT], applied[B_DOCTOR], applied[B_DISEASE], applied[B_APPOINTMENT],
+            applied[B_DELETE_PATIENT], applied[B_CANCEL_APPOINTMENT], queries, refused, seconds);
+    if (seconds > 0) fprintf(stderr, " (%.0f lines/s)", total / seconds);
+    fprintf(stderr, "\n");
+    return refused ? 1 : 0;
+}
+
+/* --------------------- EXPORT --------------------- */
+// hms [--format csv|jsonl|columns] [--doctor ID] [--from YYYY-MM-DD]
+//     [--to YYYY-MM-DD] --export patients|appointments FILE
+// Streams one table to FILE without formatting it all in memory: rows
+// are walked slot by slot, and output goes out through a buffer flushed
+// every EXPORT_FLUSH bytes (a row group at a time for columns). --doctor
+// keeps the rows of one doctor; --from and --to (inclusive) keep the
+// appointments on those days. Without --format the file's extension
+// picks one (.jsonl, .cols), else CSV.
+//   csv     a header line, then one line per row. The first column is
+//           the batch record type, so the file can be fed to --batch.
+//   jsonl   one object per row with the same keys, for --batch too.
+//   columns a columnar file for analytics tools (see below).
+// Export only reads: the data file and journal are left as they are.
+
+#define EXPORT_FLUSH 65536
+#define EXPORT_GROUP_ROWS 65536
+#define EXPORT_MAX_COLUMNS 8
+#define EXPORT_MAGIC "HMSC"
+
+enum { EF_CSV, EF_JSONL, EF_COLUMNS };
+enum { EC_INT, EC_TEXT };
+
+typedef struct {
+    int table;           // index into exportTables
+    int format;          // EF_*, or -1 to go by the file name
+    int doctorId;        // 0 for any doctor
+    int fromDay, toDay;  // -1 for no bound
+    const char *path;
+} ExportJob;
+
+typedef struct {
+    int value;
+    const char *text;
+    char buf[20];
+} ExportCell;
+
+typedef struct {
+    const char *name;       // as given to --export
+    const char *type;       // the batch record type of its rows
+    const Table *table;
+    int columns;
+    const char *names[EXPORT_MAX_COLUMNS]; // batch column names
+    int kinds[EXPORT_MAX_COLUMNS];
+    int (*keep)(const ExportJob *job, int slot);
+    void (*cells)(int slot, ExportCell *cells);
+} ExportTable;
+
+static int keepPatient(const ExportJob *job, int slot) {
+    return !job->doctorId || patientDoctorId(slot) == job->doctorId;
+}
+
+static void patientCells(int slot, ExportCell *c) {
+    c[0].value = patientId(slot);
+    c[1].text = patientName(slot);
+    c[2].value = patientAge(slot);
+    c[3].text = patientGender(slot);
+    c[4].text = patientPhone(slot);
+    c[5].text = patientDisease(slot);
+    c[6].value = patientDoctorId(slot);
+}
+
+static int keepAppointment(const ExportJob *job, int slot) {
+    if (job->doctorId && appointmentDoctorId(slot) != job->doctorId) return 0;
+    if (job->fromDay < 0 && job->toDay < 0) return 1;
+    int when = appointmentTime(slot); // Unparsed dates match no range
+    if (when < 0) return 0;
+    return (job->fromDay < 0 || when >= job->fromDay * MINUTES_PER_DAY) &&
+           (job->toDay < 0 || when < (job->toDay + 1) * MINUTES_PER_DAY);
+}
+
+static void appointmentCells(int slot, ExportCell *c) {
+    c[0].value = appointmentId(slot);
+    c[1].value = appointmentPatientId(slot);
+    c[2].value = appointmentDoctorId(slot);
+    int when = appointmentTime(slot);
+    if (when < 0) {
+        c[3].text = poolStr(&stringPool, *(StrRef*)storeAt(&appointmentOldText, slot));
+        c[4].text = "";
+        return;
+    }
+    formatDate(when / MINUTES_PER_DAY, c[3].buf, sizeof(c[3].buf));
+    snprintf(c[4].buf, sizeof(c[4].buf), "%02d:%02d", when % MINUTES_PER_DAY / 60, when % 60);
+    c[3].text = c[3].buf;
+    c[4].text = c[4].buf;
+}
+
+static const ExportTable exportTables[] = {
+    { "patients", "patient", &patientTable, 7,
+      { "id", "name", "age", "gender", "phone", "disease", "doctor" },
+      { EC_INT, EC_TEXT, EC_INT, EC_TEXT, EC_TEXT, EC_TEXT, EC_INT },
+      keepPatient, patientCells },
+    { "appointments", "appointment", &appointmentTable, 5,
+      { "id", "patient", "doctor", "date", "time" },
+      { EC_INT, EC_INT, EC_INT, EC_TEXT, EC_TEXT },
+      keepAppointment, appointmentCells },
+};
+
+#define EXPORT_TABLES ((int)(sizeof(exportTables) / sizeof(exportTables[0])))
+
+static int exportTableNamed(const char *name) {
+    for (int t = 0; t < EXPORT_TABLES; t++) if (strcmp(exportTables[t].name, name) == 0) return t;
+    return -1;
+}
+
+static int exportFormatNamed(const char *name) {
+    if (strcmp(name, "csv") == 0) return EF_CSV;
+    if (strcmp(name, "jsonl") == 0 || strcmp(name, "json") == 0) return EF_JSONL;
+    if (strcmp(name, "columns") == 0 || strcmp(name, "cols") == 0) return EF_COLUMNS;
+    return -1;
+}
+
+// Writes s as a JSON string
+static void obJson(OutBuf *ob, const char *s) {
+    obPrintf(ob, "\"");
+    for (const char *run = s;; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c && c != '"' && c != '\\' && c >= 0x20) continue;
+        obPrintf(ob, "%.*s", (int)(s - run), run);
+        if (!c) break;
+        if (c == '"' || c == '\\') obPrintf(ob, "\\%c", c);
+        else obPrintf(ob, "\\u%04x", c);
+        run = s + 1;
+    }
+    obPrintf(ob, "\"");
+}
+
+static void exportCsvRow(OutBuf *ob, const ExportTable *xt, const ExportCell *c) {
+    obPrintf(ob, "%s,", xt->type);
+    for (int k = 0; k < xt->columns; k++) {
+        char after = k + 1 < xt->columns ? ',' : '\n';
+        if (xt->kinds[k] == EC_INT) obPrintf(ob, "%d%c", c[k].value, after);
+        else obCsv(ob, c[k].text, after);
+    }
+}
+
+static void exportJsonRow(OutBuf *ob, const ExportTable *xt, const ExportCell *c) {
+    obPrintf(ob, "{\"type\":\"%s\"", xt->type);
+    for (int k = 0; k < xt->columns; k++) {
+        obPrintf(ob, ",\"%s\":", xt->names[k]);
+        if (xt->kinds[k] == EC_INT) obPrintf(ob, "%d", c[k].value);
+        else obJson(ob, c[k].text);
+    }
+    obPrintf(ob, "}\n");
+}
+
+/* The columns format, little-endian throughout:
+     "HMSC"  row groups  footer  u32 footer length  "HMSC"
+   A row group holds up to EXPORT_GROUP_ROWS rows, each column in turn:
+   an int column is one i32 per row; a text column is rows + 1 u32
+   offsets followed by the bytes they point into (offsets count from the
+   first byte after them). The footer is
+     u32 version (1)   u32 columns   per column: u32 kind (0 int, 1
+     text), u32 name length, name bytes
+     u32 groups        per group: u32 rows, then per column u64 offset
+                       and u64 length of its data in the file
+   so a reader can fetch only the columns it wants. */
+
+typedef struct {
+    PackBuf data[EXPORT_MAX_COLUMNS];
+    PackBuf offsets[EXPORT_MAX_COLUMNS]; // text columns only
+    PackBuf footer;                      // the per-group entries so far
+    int rows, groups;
+    long long written;
+} ColumnWriter;
+
+static void packWord(PackBuf *b, unsigned v) {
+    unsigned char *p = packReserve(b, 4);
+    if (!p) return;
+    putWord(p, v);
+    b->len += 4;
+}
+
+static void packLong(PackBuf *b, long long v) {
+    packWord(b, (unsigned)v);
+    packWord(b, (unsigned)((unsigned long long)v >> 32));
+}
+
+static void columnsAdd(ColumnWriter *cw, const ExportTable *xt, const ExportCell *c) {
+    for (int k = 0; k < xt->columns; k++) {
+        if (xt->kinds[k] == EC_INT) {
+            packWord(&cw->data[k], (unsigned)c[k].value);
+        } else {
+            if (cw->rows == 0) packWord(&cw->offsets[k], 0);
+            packBytes(&cw->data[k], c[k].text, strlen(c[k].text));
+            packWord(&cw->offsets[k], (unsigned)cw->data[k].len);
+        }
+    }
+    cw->rows++;
+}
+
+// Writes the rows gathered so far as one row group. Returns 0 on failure.
+static int columnsFlush(ColumnWriter *cw, const ExportTable *xt, FILE *fp) {
+    if (cw->rows == 0) return 1;
+    int ok = 1;
+    packWord(&cw->footer, (unsigned)cw->rows);
+    for (int k = 0; k < xt->columns; k++) {
+        PackBuf *o = &cw->offsets[k], *d = &cw->data[k];
+        long long length = (long long)(o->len + d->len);
+        if (o->failed || d->failed) ok = 0;
+        if (ok && o->len) ok = fwrite(o->data, o->len, 1, fp) == 1;
+        if (ok && d->len) ok = fwrite(d->data, d->len, 1, fp) == 1;
+        packLong(&cw->footer, cw->written);
+        packLong(&cw->footer, length);
+        cw->written += length;
+        o->len = d->len = 0;
+    }
+    cw->rows = 0;
+    cw->groups++;
+    return ok && !cw->footer.failed;
+}
+
+static int columnsFinish(ColumnWriter *cw, const ExportTable *xt, FILE *fp) {
+    PackBuf head = { NULL, 0, 0, 0 };
+    packWord(&head, 1);
+    packWord(&head, (unsigned)xt->columns);
+    for (int k = 0; k < xt->columns; k++) {
+        packWord(&head, xt->kinds[k] == EC_INT ? 0 : 1);
+        packWord(&head, (unsigned)strlen(xt->names[k]));
+        packBytes(&head, xt->names[k], strlen(xt->names[k]));
+    }
+    packWord(&head, (unsigned)cw->groups);
+    packBytes(&head, cw->footer.data, cw->footer.len);
+    packWord(&head, (unsigned)head.len);
+    packBytes(&head, EXPORT_MAGIC, 4);
+    int ok = !head.failed && fwrite(head.data, head.len, 1, fp) == 1;
+    free(head.data);
+    return ok;
+}
+
+static void columnsFree(ColumnWriter *cw) {
+    for (int k = 0; k < EXPORT_MAX_COLUMNS; k++) {
+        free(cw->data[k].data);
+        free(cw->offsets[k].data);
+    }
+    free(cw->footer.data);
+}
+
+// Writes the rows of job's table that pass its filters to fp. Returns
+// the number written, or -1 if writing failed.
+static long long exportRows(const ExportJob *job, FILE *fp) {
+    const ExportTable *xt = &exportTables[job->table];
+    OutBuf ob = { 0 };
+    ColumnWriter *cw = NULL;
+    int ok = 1;
+    long long count = 0;
+
+    if (job->format == EF_COLUMNS) {
+        if (!(cw = calloc(1, sizeof(*cw)))) return -1;
+        ok = fwrite(EXPORT_MAGIC, 4, 1, fp) == 1;
+        cw->written = 4;
+    } else if (job->format == EF_CSV) {
+        obPrintf(&ob, "type");
+        for (int k = 0; k < xt->columns; k++) obPrintf(&ob, ",%s", xt->names[k]);
+        obPrintf(&ob, "\n");
+    }
+
+    ExportCell cells[EXPORT_MAX_COLUMNS];
+    int rows = tableRows(xt->table);
+    for (int i = 0; i < rows && ok; i++) {
+        if (*(int*)storeAt(xt->table->cols[0], i) == 0 || !xt->keep(job, i)) continue;
+        xt->cells(i, cells);
+        count++;
+        if (cw) {
+            columnsAdd(cw, xt, cells);
+            if (cw->rows == EXPORT_GROUP_ROWS) ok = columnsFlush(cw, xt, fp);
+            continue;
+        }
+        if (job->format == EF_CSV) exportCsvRow(&ob, xt, cells);
+        else exportJsonRow(&ob, xt, cells);
+        if (ob.len >= EXPORT_FLUSH) {
+            ok = !ob.failed && fwrite(ob.data, ob.len, 1, fp) == 1;
+            ob.len = 0;
+        }
+    }
+    if (cw) {
+        if (ok) ok = columnsFlush(cw, xt, fp) && columnsFinish(cw, xt, fp);
+        columnsFree(cw);
+        free(cw);
+    } else if (ok && ob.len) {
+        ok = !ob.failed && fwrite(ob.data, ob.len, 1, fp) == 1;
+    }
+    obFree(&ob);
+    return ok ? count : -1;
+}
+
+// Runs --export. Returns the exit status: 0 on success, 2 if the file
+// could not be written.
+int runExport(ExportJob *job) {
+    if (job->format < 0) {
+        const char *dot = strrchr(job->path, '.');
+        job->format = dot && exportFormatNamed(dot + 1) >= 0 ? exportFormatNamed(dot + 1) : EF_CSV;
+    }
+    batchMode = 1;
+    loadData();
+
+    clock_t started = clock();
+    FILE *fp = fopen(job->path, "wb");
+    if (!fp) {
+        fprintf(stderr, "hms: cannot open %s for writing\n", job->path);
+        return 2;
+    }
+    long long count = exportRows(job, fp);
+    if (fclose(fp) != 0) count = -1;
+    if (count < 0) {
+        fprintf(stderr, "hms: could not write %s\n", job->path);
+        return 2;
+    }
+    fprintf(stderr, "Export: %lld %s written to %s, %.3f s\n", count, exportTables[job->table].name, job->path,
+            (double)(clock() - started) / CLOCKS_PER_SEC);
+    return 0;
+}
+
+/* --------------------- BENCHMARK --------------------- */
+// hms --bench [SIZES]   (e.g. --bench 1k,100k; default 1k,100k,10M)
+// Builds a synthetic hospital of each size (in patients) in a scratch
+// directory and times the core operations on it, printing one JSON
+// object per operation to stdout so runs can be compared by a script:
+//   {"patients":100000,"op":"find-id","threads":4,"ops":100000,"seconds":0.041,
+//    "ops_per_sec":2439024,"p50_us":0.31,"p90_us":0.48,"p99_us":1.1,"p999_us":3.9,"max_us":12}
+// Operations, in the order they run:
+//   insert     admitPatient for every patient (name indexes deferred, as
+//              in batch mode)
+//   book       bookAppointment for a quarter as many appointments
+//   sort       rebuilding the name index the sorted listing walks
+//   find-id    findPatientIndex of random ids
+//   find-name  the find-patient command: prefix search, with a fifth of
+//              the queries misspelled so they fall back to close matches
+//   delete     the delete-patient command
+//   save       saveData
+//   load       loadData in a fresh process
+// Names, conditions and doctors are drawn from Zipf distributions, so a
+// few of each dominate as in a real register. The generator is seeded
+// the same way every run. Lookups, searches and deletes stop early once
+// they have taken BENCH_BUDGET_NS ("ops" says how many ran). Each size
+// runs in a child process so it starts from empty stores, and journal
+// records are buffered as in batch mode.
+// Latencies go into the histograms of METRICS, so percentiles are within
+// a few percent whatever the number of operations. (Linux/macOS only.)
+
+#define BENCH_DEFAULT_SIZES "1k,100k,10M"
+#define BENCH_MAX_SIZES 16
+#define BENCH_LOOKUPS 1000000  // find-id operations at most
+#define BENCH_SEARCHES 20000   // find-name operations at most
+#define BENCH_DELETES 10000    // each one shifts the name index
+#define BENCH_REPEATS 3        // runs of sort, save and load
+#define BENCH_BUDGET_NS 10000000000ull // lookups, searches and deletes stop after 10 s
+#define BENCH_MIN_OPS 100
+#define BENCH_DISEASES 24
+#define BENCH_SPECIALIZATIONS 8
+
+#ifdef HAVE_FORK
+
+// One operation being timed, and where its line is reported
+typedef struct {
+    FILE *out;
+    int patients;
+    const char *op;
+    LatencyHistogram h;
+    unsigned long long started, elapsed;
+} BenchOp;
+
+static void benchBegin(BenchOp *b, const char *op) {
+    memset(&b->h, 0, sizeof(b->h));
+    b->op = op;
+    b->elapsed = 0;
+}
+
+static inline void benchStart(BenchOp *b) { b->started = nowNanos(); }
+
+static inline void benchStop(BenchOp *b) {
+    unsigned long long ns = nowNanos() - b->started;
+    b->elapsed += ns;
+    latAdd(&b->h, ns);
+}
+
+// True once enough of a repeated operation has been timed
+static inline int benchEnough(const BenchOp *b) {
+    return b->elapsed > BENCH_BUDGET_NS && b->h.total >= BENCH_MIN_OPS;
+}
+
+static void benchReport(const BenchOp *b) {
+    double seconds = (double)b->elapsed / 1e9;
+    fprintf(b->out, "{\"patients\":%d,\"op\":\"%s\",\"threads\":%d,\"ops\":%lld,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+            "\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f}\n",
+            b->patients, b->op, taskThreads(), b->h.total, seconds, seconds > 0 ? (double)b->h.total / seconds : 0.0,
+            latPercentile(&b->h, 0.5) / 1e3, latPercentile(&b->h, 0.9) / 1e3, latPercentile(&b->h, 0.99) / 1e3,
+            latPercentile(&b->h, 0.999) / 1e3, (double)b->h.max / 1e3);
+    fflush(b->out);
+}
+
+static unsigned long long benchState = 0x2545F4914F6CDD1Dull;
+
+// splitmix64
+static unsigned long long benchRandom() {
+    unsigned long long z = (benchState += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static int benchBelow(int n) { return (int)(benchRandom() % (unsigned long long)n); }
+
+// Cumulative Zipf weights (exponent 1) over n choices
+static double* zipfTable(int n) {
+    double *cum = malloc((size_t)n * sizeof(double)), sum = 0;
+    if (!cum) return NULL;
+    for (int k = 0; k < n; k++) cum[k] = sum += 1.0 / (k + 1);
+    return cum;
+}
+
+static int zipfPick(const double *cum, int n) {
+    double u = (double)(benchRandom() >> 11) / 9007199254740992.0 * cum[n - 1];
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cum[mid] <= u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static const char *const benchFirstNames[] = {
+    "James", "Mary", "John", "Patricia", "Robert", "Jennifer", "Michael", "Linda", "William", "Elizabeth",
+    "David", "Barbara", "Richard", "Susan", "Joseph", "Jessica", "Thomas", "Sarah", "Charles", "Karen",
+    "Aisha", "Wei", "Priya", "Mohammed", "Sofia", "Hiroshi", "Olga", "Kwame", "Lucia", "Ivan", "Mei", "Omar",
+};
+static const char *const benchLastNames[] = {
+    "Smith", "Johnson", "Williams", "Brown", "Jones", "Garcia", "Miller", "Davis", "Rodriguez", "Martinez",
+    "Hernandez", "Lopez", "Gonzalez", "Wilson", "Anderson", "Thomas", "Taylor", "Moore", "Jackson", "Martin",
+    "Lee", "Perez", "Thompson", "White", "Harris", "Sanchez", "Clark", "Ramirez", "Lewis", "Robinson",
+    "Walker", "Young", "Allen", "King", "Wright", "Scott", "Torres", "Nguyen", "Hill", "Flores",
+    "Green", "Adams", "Nelson", "Baker", "Hall", "Rivera", "Campbell", "Mitchell",
+};
+static const char *const benchDiseases[BENCH_DISEASES] = {
+    "Flu", "Common Cold", "Hypertension", "Diabetes", "Asthma", "Migraine", "Bronchitis", "Back Pain",
+    "Gastritis", "Anxiety", "Allergy", "Arthritis", "Pneumonia", "Sinusitis", "Eczema", "Anemia",
+    "Tonsillitis", "Gout", "Hepatitis", "Malaria", "Measles", "Tuberculosis", "Dengue", "Cholera",
+};
+static const char *const benchSpecializations[BENCH_SPECIALIZATIONS] = {
+    "General", "Cardiology", "Pediatrics", "Neurology", "Orthopedics", "Dermatology", "Oncology", "Psychiatry",
+};
+
+// Surnames past the common ones above are made of syllables, so the
+// register has a long tail of rare names
+#define BENCH_SURNAMES 20000
+
+static const char *const benchSyllables[] = {
+    "ka", "ro", "mi", "tan", "ber", "lo", "vi", "sen", "da", "mor", "ne", "ul",
+    "fer", "ash", "ti", "gren", "po", "wen", "sa", "dor", "el", "qu", "zan", "he",
+};
+
+static void benchSurname(int rank, char *buf, size_t size) {
+    int common = (int)(sizeof(benchLastNames) / sizeof(benchLastNames[0]));
+    if (rank < common) { snprintf(buf, size, "%s", benchLastNames[rank]); return; }
+    size_t len = 0;
+    for (int r = rank; r > 0 && len + 4 < size; r /= 24) len += (size_t)snprintf(buf + len, size - len, "%s", benchSyllables[r % 24]);
+    buf[0] = (char)toupper((unsigned char)buf[0]);
+}
+
+#define COUNT_OF(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+// Runs one command, reusing out for whatever it prints
+static void benchCommand(int kind, const char *key, const char *value, OutBuf *out) {
+    BatchRecord rec = { 1, { key }, { value } };
+    int id;
+    runCommand(&rec, kind, NULL, out, &id);
+    out->len = 0;
+}
+
+// Builds a hospital of n patients and times everything but the load
+static int benchBuild(BenchOp *b, int n) {
+    int first = COUNT_OF(benchFirstNames), last = BENCH_SURNAMES;
+    int doctors = n / 2000 + 5;
+    double *firstCum = zipfTable(first), *lastCum = zipfTable(last), *diseaseCum = zipfTable(BENCH_DISEASES);
+    double *doctorCum = zipfTable(doctors);
+    if (!firstCum || !lastCum || !diseaseCum || !doctorCum) return 0;
+
+    for (int k = 0; k < BENCH_DISEASES / 2; k++) {
+        Disease d = { 0, "", "", "" };
+        snprintf(d.name, sizeof(d.name), "%s", benchDiseases[k]);
+        snprintf(d.symptoms, sizeof(d.symptoms), "Symptoms of %s", benchDiseases[k]);
+        snprintf(d.treatment, sizeof(d.treatment), "Treatment for %s", benchDiseases[k]);
+        registerDisease(&d);
+    }
+    for (int k = 0; k < doctors; k++) {
+        Doctor d = { 0, "", "", "" };
+        snprintf(d.name, sizeof(d.name), "Dr %s %s", benchFirstNames[k % first], benchLastNames[k % COUNT_OF(benchLastNames)]);
+        snprintf(d.specialization, sizeof(d.specialization), "%s", benchSpecializations[k % BENCH_SPECIALIZATIONS]);
+        snprintf(d.phone, sizeof(d.phone), "555-%04d", k % 10000);
+        registerDoctor(&d);
+    }
+
+    deferNameIndexes = 1;
+    benchBegin(b, "insert");
+    for (int i = 0; i < n; i++) {
+        Patient p = { 0, "", 0, "", "", "", 0 };
+        char surname[40];
+        benchSurname(zipfPick(lastCum, last), surname, sizeof(surname));
+        snprintf(p.name, sizeof(p.name), "%s %s", benchFirstNames[zipfPick(firstCum, first)], surname);
+        p.age = benchBelow(96);
+        snprintf(p.gender, sizeof(p.gender), "%s", benchBelow(2) ? "M" : "F");
+        snprintf(p.phone, sizeof(p.phone), "555-%07d", benchBelow(10000000));
+        snprintf(p.disease, sizeof(p.disease), "%s", benchDiseases[zipfPick(diseaseCum, BENCH_DISEASES)]);
+        p.doctorId = benchBelow(4) ? 0 : 1 + zipfPick(doctorCum, doctors);
+        benchStart(b);
+        const char *e = admitPatient(&p);
+        benchStop(b);
+        if (e) return 0;
+    }
+    benchReport(b);
+
+    benchBegin(b, "book");
+    for (int i = 0; i < n / 4; i++) {
+        Appointment a = { 0, 1 + benchBelow(n), 1 + zipfPick(doctorCum, doctors), "", "" };
+        formatDate(parseDate("2026-01-01") + benchBelow(365), a.date, sizeof(a.date));
+        snprintf(a.time, sizeof(a.time), "%02d:%02d", 8 + benchBelow(10), benchBelow(2) * 30);
+        benchStart(b);
+        bookAppointment(&a, NULL); // Clashes are refused; they are timed all the same
+        benchStop(b);
+    }
+    benchReport(b);
+
+    benchBegin(b, "sort");
+    for (int r = 0; r < BENCH_REPEATS; r++) {
+        benchStart(b);
+        int ok = nameIndexRebuild(&patientNameIndex);
+        benchStop(b);
+        if (!ok) return 0;
+    }
+    benchReport(b);
+    if (!trigramIndexRebuild(&patientTrigrams)) return 0;
+    deferNameIndexes = 0;
+
+    int lookups = n < BENCH_LOOKUPS ? n : BENCH_LOOKUPS;
+    volatile int sink = 0;
+    benchBegin(b, "find-id");
+    for (int i = 0; i < lookups && !benchEnough(b); i++) {
+        int id = 1 + benchBelow(n);
+        benchStart(b);
+        sink += findPatientIndex(id);
+        benchStop(b);
+    }
+    benchReport(b);
+    (void)sink;
+
+    OutBuf out = { 0 };
+    int searches = n < BENCH_SEARCHES ? n : BENCH_SEARCHES;
+    benchBegin(b, "find-name");
+    for (int i = 0; i < searches && !benchEnough(b); i++) {
+        char query[100];
+        const char *name = patientName(findPatientIndex(1 + benchBelow(n)));
+        if (benchBelow(5) == 0) {
+            // Drop a letter from the surname: no prefix matches, so the
+            // close-spelling search runs
+            const char *space = strchr(name, ' ');
+            int at = space ? (int)(space - name) + 2 : 1;
+            snprintf(query, sizeof(query), "%.*s%s", at, name, name + at + 1);
+        } else {
+            const char *space = strchr(name, ' ');
+            snprintf(query, sizeof(query), "%.*s", space ? (int)(space - name) + 4 : 3, name);
+        }
+        benchStart(b);
+        benchCommand(B_FIND_PATIENT, "name", query, &out);
+        benchStop(b);
+    }
+    benchReport(b);
+
+    int deletes = n / 100 > 0 ? n / 100 : 1;
+    if (deletes > BENCH_DELETES) deletes = BENCH_DELETES;
+    benchBegin(b, "delete");
+    for (int i = 0; i < deletes && !benchEnough(b); i++) {
+        char id[20];
+        snprintf(id, sizeof(id), "%d", 1 + (int)((long long)i * n / deletes)); // Spread out, each once
+        benchStart(b);
+        benchCommand(B_DELETE_PATIENT, "id", id, &out);
+        benchStop(b);
+    }
+    benchReport(b);
+    obFree(&out);
+
+    benchBegin(b, "save");
+    for (int r = 0; r < BENCH_REPEATS; r++) {
+        benchStart(b);
+        saveData();
+        benchStop(b);
+    }
+    benchReport(b);
+
+    free(firstCum);
+    free(lastCum);
+    free(diseaseCum);
+    free(doctorCum);
+    return 1;
+}
+
+// Runs fn(b, n) in a child process with stdout silenced (b->out is the
+// real one), and passes back the child's b->elapsed in *elapsed. Returns
+// 0 if the child failed.
+static int benchChild(BenchOp *b, int n, int (*fn)(BenchOp*, int), unsigned long long *elapsed) {
+    int fds[2];
+    if (pipe(fds) != 0) return 0;
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        b->out = fdopen(dup(STDOUT_FILENO), "w");
+        int null = open("/dev/null", O_WRONLY);
+        if (!b->out || null < 0 || dup2(null, STDOUT_FILENO) < 0) _exit(1);
+        batchMode = 1;
+        journalBuffered = 1;
+        int ok = fn(b, n);
+        fflush(NULL);
+        ok = ok && write(fds[1], &b->elapsed, sizeof(b->elapsed)) == (ssize_t)sizeof(b->elapsed);
+        _exit(ok ? 0 : 1);
+    }
+    close(fds[1]);
+    int ok = pid > 0 && read(fds[0], elapsed, sizeof(*elapsed)) == (ssize_t)sizeof(*elapsed);
+    close(fds[0]);
+    int status;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int benchLoad(BenchOp *b, int n) {
+    (void)n;
+    unsigned long long started = nowNanos();
+    loadData();
+    b->elapsed = nowNanos() - started;
+    return 1;
+}
+
+static int benchSaveEmpty(BenchOp *b, int n) {
+    (void)b;
+    (void)n;
+    saveData();
+    return 1;
+}
+
+// Removes every file a run leaves in the scratch directory
+static void benchClean() {
+    const char *files[] = { DATA_FILE, JOURNAL_FILE, JOURNAL_OLD_FILE, SNAPSHOT_TEMP_FILE, ARCHIVE_FILE };
+    for (size_t k = 0; k < sizeof(files) / sizeof(files[0]); k++) remove(files[k]);
+    for (int g = 1; g <= snapshotGenerations; g++) {
+        char name[64];
+        generationName(g, name, sizeof(name));
+        remove(name);
+    }
+}
+
+// Parses "1k,100k,10M" into sizes. Returns how many, or -1 if malformed.
+static int benchSizes(const char *list, int *sizes) {
+    int count = 0;
+    for (const char *p = list; *p;) {
+        char *end;
+        long v = strtol(p, &end, 10);
+        if (*end == 'k' || *end == 'K') { v *= 1000; end++; }
+        else if (*end == 'm' || *end == 'M') { v *= 1000000; end++; }
+        if (end == p || v <= 0 || v > INT_MAX / 2 || count == BENCH_MAX_SIZES || (*end && *end != ',')) return -1;
+        sizes[count++] = (int)v;
+        p = *end ? end + 1 : end;
+    }
+    return count;
+}
+
+// Runs --bench. Returns the exit status: 0 if every size ran, 1 if any
+// failed, 2 if the arguments or scratch directory were unusable.
+int runBench(const char *list) {
+    int sizes[BENCH_MAX_SIZES];
+    int count = benchSizes(list ? list : BENCH_DEFAULT_SIZES, sizes);
+    if (count <= 0) {
+        fprintf(stderr, "hms: sizes must look like 1000,100k,10M\n");
+        return 2;
+    }
+    const char *tmp = getenv("TMPDIR");
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s/hms-bench-XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    if (!mkdtemp(dir) || chdir(dir) != 0) {
+        fprintf(stderr, "hms: cannot make a scratch directory in %s\n", tmp && *tmp ? tmp : "/tmp");
+        return 2;
+    }
+
+    // A new install saves an empty database first; it must load again
+    // (loadData() exits if it cannot)
+    BenchOp empty;
+    unsigned long long ns;
+    empty.out = stdout;
+    int failed = !benchChild(&empty, 0, benchSaveEmpty, &ns) || !benchChild(&empty, 0, benchLoad, &ns);
+    if (failed) fprintf(stderr, "hms: an empty database does not save and load again\n");
+    benchClean();
+
+    for (int s = 0; s < count; s++) {
+        BenchOp b;
+        b.out = stdout;
+        b.patients = sizes[s];
+        fprintf(stderr, "Benchmark: %d patients...\n", sizes[s]);
+        if (!benchChild(&b, sizes[s], benchBuild, &ns)) {
+            fprintf(stderr, "hms: benchmark of %d patients failed (out of memory?)\n", sizes[s]);
+            failed = 1;
+        } else {
+            // Each load needs empty stores, so each runs in a new process
+            benchBegin(&b, "load");
+            for (int r = 0; r < BENCH_REPEATS; r++) {
+                if (!benchChild(&b, sizes[s], benchLoad, &ns)) { failed = 1; continue; }
+                latAdd(&b.h, ns);
+                b.elapsed += ns;
+            }
+            benchReport(&b);
+        }
+        benchClean();
+    }
+    if (chdir("/") == 0) rmdir(dir);
+    return failed;
+}
+
+#else
+
+int runBench(const char *list) {
+    (void)list;
+    fprintf(stderr, "hms: benchmark mode is not available on this platform\n");
+    return 2;
+}
+
+#endif
+
+/* --------------------- SERVICE MODE --------------------- */
+// hms --serve PORT [--workers N]
+// Serves the batch command language (see BATCH MODE) over TCP to many
+// clients at once. Each request is one line; the reply is any result rows
+// followed by a status line: "OK", "OK <new id>" or "ERR <reason>".
+// One thread runs a poll() loop that accepts connections and does all
+// socket I/O; complete request lines are handed to a pool of worker
+// threads. A session has at most one request in flight, so its replies
+// come back in order. Changes run one at a time under the exclusive
+// (write) lock on the stores, and lookups under the shared (read) lock.
+// Listings take no lock at all: they pin a view (see SNAPSHOT VIEWS), so
+// however many run at once, intake never waits for them.
+// A "GET /metrics ..." line is answered as an HTTP request, with the
+// metrics (see METRICS), and the connection closed, so Prometheus can
+// scrape the same port. Replicas follow a primary through the same port
+// (see REPLICATION below).
+
+#define SERVICE_DEFAULT_WORKERS 4
+
+const char *replicaOf = NULL; // Set by --replica-of HOST:PORT
+char **mainArgv = NULL;       // For a replica to restart itself
+
+#define SHARD_MAX 16
+
+// A site a router sends requests to (see ROUTER below)
+typedef struct {
+    char name[32];
+    int lo, hi;        // the ids it hands out (its --id-range)
+    char address[128]; // HOST:PORT of its service port
+} Shard;
+
+Shard shards[SHARD_MAX];
+int shardCount = 0; // Set by --shard; service mode then routes instead of holding data
+
+// Adds a site given as NAME=LO-HI@HOST:PORT. Returns 0 if it is
+// malformed, or its name or range is already taken.
+int addShard(const char *spec) {
+    Shard sh;
+    int used;
+    const char *eq = strchr(spec, '='), *at = eq ? strchr(eq, '@') : NULL;
+    if (shardCount == SHARD_MAX || !at || eq == spec || (size_t)(eq - spec) >= sizeof(sh.name) ||
+        strlen(at + 1) >= sizeof(sh.address) || !strrchr(at + 1, ':')) return 0;
+    if (sscanf(eq + 1, "%d-%d%n", &sh.lo, &sh.hi, &used) != 2 || eq + 1 + used != at || sh.lo < 1 || sh.hi < sh.lo) return 0;
+    memcpy(sh.name, spec, (size_t)(eq - spec));
+    sh.name[eq - spec] = '\0';
+    strcpy(sh.address, at + 1);
+    for (int i = 0; i < shardCount; i++) {
+        if (strcmp(shards[i].name, sh.name) == 0 || (sh.lo <= shards[i].hi && shards[i].lo <= sh.hi)) return 0;
+    }
+    shards[shardCount++] = sh;
+    return 1;
+}
+
+#ifdef HAVE_SOCKETS
+
+#define SERVICE_MAX_SESSIONS 1024
+
+typedef struct {
+    int fd;
+    char in[BATCH_LINE_MAX];  // bytes received and not yet run
+    size_t inLen;
+    int discarding;           // dropping the rest of an over-long line
+    char request[BATCH_LINE_MAX]; // the line a worker is running
+    OutBuf out;               // replies not yet sent
+    size_t sent;
+    int busy;                 // a worker holds request
+    int closing;              // client gone or said quit
+    int overlong;             // the queued request was cut short
+} Session;
+
+pthread_rwlock_t storeLock = PTHREAD_RWLOCK_INITIALIZER; // Guards every store and index
+pthread_mutex_t serviceLock = PTHREAD_MUTEX_INITIALIZER; // Guards the job queue and session replies
+pthread_cond_t jobReady = PTHREAD_COND_INITIALIZER;
+
+Session *jobs[SERVICE_MAX_SESSIONS]; // Ring of sessions with a request to run
+int jobHead = 0, jobCount = 0;
+volatile sig_atomic_t serviceStopping = 0;
+int wakeFds[2] = { -1, -1 }; // Workers (and signals) wake the poll loop through this pipe
+
+static void serviceWake() {
+    char c = 0;
+    if (write(wakeFds[1], &c, 1) < 0) { /* The loop is already due to wake */ }
+}
+
+static void serviceSignal(int sig) {
+    (void)sig;
+    serviceStopping = 1;
+    serviceWake();
+}
+
+// Pins the current view for reader r so its rows stay put. Waits while
+// a writer is moving rows.
+static const View* viewPin(int r) {
+    for (;;) {
+        // Pin a version no newer than the view, so nothing it reaches is reclaimed
+        __atomic_store_n(&viewPins[r].version, __atomic_load_n(&viewVersion, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&viewsFrozen, __ATOMIC_SEQ_CST)) return __atomic_load_n(&currentView, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&viewPins[r].version, 0, __ATOMIC_SEQ_CST);
+        pthread_rwlock_rdlock(&storeLock); // Held by the writer moving rows
+        pthread_rwlock_unlock(&storeLock);
+    }
+}
+
+static void viewUnpin(int r) {
+    __atomic_store_n(&viewPins[r].version, 0, __ATOMIC_RELEASE);
+}
+
+/* REPLICATION. Any instance in service mode is a primary; one started
+   with --replica-of HOST:PORT is also a replica of the primary there.
+   The replica connects to the primary's service port and sends
+   "replicate EPOCH SEQ": where its data stands in the primary's record
+   stream (EPOCH names one run of the primary; "0 0" if it has never
+   synced). If the backlog still holds record SEQ on, the primary answers
+   "STREAM EPOCH SEQ". Otherwise it writes a snapshot cut (as an autosave
+   does) and answers "SNAPSHOT EPOCH SEQ BYTES ARCHIVED" and the file,
+   then the first ARCHIVED bytes of its ARCHIVE_FILE as they stood at the
+   cut; the replica installs both as its own: before loading at startup,
+   or by restarting itself if it was already running. Later archive
+   passes reach it as journal records.
+   After that a feed thread on the primary sends ReplicaFrames, each a
+   batch of journal records, as soon as there are any and without waiting
+   for the replica, up to REPLICA_WINDOW records ahead of its acks. The
+   replica applies a frame under the write lock, journals it locally with
+   one sync, notes its position in REPLICA_POSITION_FILE and answers
+   "ack SEQ". Replay is idempotent by id, so applying a record twice
+   after a crash is harmless. An idle feed sends an empty frame every
+   second, so a replica notices a dead primary within REPLICA_TIMEOUT
+   seconds and starts reconnecting.
+   A replica refuses changes and serves everything else. "promote" stops
+   replication and lets it take changes, so it can stand in for a failed
+   primary at once; "replication" reports where it stands. */
+
+#define REPLICA_MAX 8                      // Feeds a primary runs at once
+#define REPLICA_WINDOW 4096                // Records sent ahead of the replica's acks
+#define REPLICA_FRAME_BYTES (256 << 10)    // Most record bytes in one frame
+#define REPLICA_TIMEOUT 5                  // Seconds of silence before a replica reconnects
+#define REPLICA_ACK_BYTES 4096             // Acks read at a time
+#define REPLICA_PIN (VIEW_MAX_READERS - 2) // View pin slot of a feed writing a snapshot
+
+typedef struct {
+    unsigned long long seq; // number of the first record
+    int count;              // records (0 when idle)
+    int len;                // bytes of records that follow
+    unsigned crc;           // crc32 of those bytes
+} ReplicaFrame;
+
+typedef struct {
+    int used;    // a thread was started in this slot
+    int done;    // and has finished (to be joined)
+    int fd;
+    char peer[INET6_ADDRSTRLEN];
+    unsigned long long epoch, from; // where the replica asked to start
+    unsigned long long sent, acked; // records sent and acknowledged so far
+    pthread_t thread;
+} Feed;
+
+Feed feeds[REPLICA_MAX];
+pthread_mutex_t feedLock = PTHREAD_MUTEX_INITIALIZER;     // Guards the feed slots
+pthread_mutex_t feedSendLock = PTHREAD_MUTEX_INITIALIZER; // One snapshot (and REPLICA_PIN) at a time
+unsigned long long streamEpoch = 0; // Names this run's record stream
+
+unsigned long long replicaEpoch = 0, replicaSeq = 0; // Where this replica's data stands
+int replicaFd = -1;           // Connection to the primary (the replica thread's)
+int replicaPromoted = 0;      // Set by "promote"
+
+// True while this instance follows a primary (and so refuses changes)
+static int replicaActive() {
+    return replicaOf && !__atomic_load_n(&replicaPromoted, __ATOMIC_ACQUIRE);
+}
+
+// Sends all n bytes. Returns 0 on a broken (or stalled) connection.
+static int sendAll(int fd, const void *buf, size_t n) {
+    const char *p = buf;
+    while (n) {
+        ssize_t k = write(fd, p, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return 0;
+        p += k;
+        n -= (size_t)k;
+    }
+    return 1;
+}
+
+// Receives exactly n bytes. Returns 0 on end of stream, error or timeout.
+static int recvAll(int fd, void *buf, size_t n) {
+    char *p = buf;
+    while (n) {
+        ssize_t k = read(fd, p, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return 0;
+        p += k;
+        n -= (size_t)k;
+    }
+    return 1;
+}
+
+// Receives one line (without its newline). Only used for the handshake,
+// so it reads a byte at a time rather than past the line.
+static int recvLine(int fd, char *buf, size_t size) {
+    size_t len = 0;
+    char c;
+    while (recvAll(fd, &c, 1)) {
+        if (c == '\n') {
+            if (len && buf[len - 1] == '\r') len--;
+            buf[len] = '\0';
+            return 1;
+        }
+        if (len + 1 < size) buf[len++] = c;
+    }
+    return 0;
+}
+
+// Sends the first bytes bytes of fp. Returns 0 on failure.
+static int sendFileBytes(int fd, FILE *fp, long long bytes) {
+    char chunk[65536];
+    int ok = fseek(fp, 0, SEEK_SET) == 0;
+    while (ok && bytes > 0) {
+        size_t n = bytes < (long long)sizeof(chunk) ? (size_t)bytes : sizeof(chunk);
+        ok = fread(chunk, 1, n, fp) == n && sendAll(fd, chunk, n);
+        bytes -= (long long)n;
+    }
+    return ok;
+}
+
+// Receives bytes bytes into a new file at path, synced. Returns 0 on
+// failure (removing the file).
+static int recvFile(int fd, const char *path, long long bytes) {
+    remove(path);
+    FILE *fp = fopen(path, "wb");
+    char chunk[65536];
+    int ok = fp != NULL;
+    while (ok && bytes > 0) {
+        size_t n = bytes < (long long)sizeof(chunk) ? (size_t)bytes : sizeof(chunk);
+        ok = recvAll(fd, chunk, n) && fwrite(chunk, 1, n, fp) == n;
+        bytes -= (long long)n;
+    }
+    if (fp && (!fileSync(fp) || fclose(fp) != 0)) ok = 0;
+    if (!ok) remove(path);
+    return ok;
+}
+
+// Finds the stream offset of record seq in the backlog. Called with
+// backlog.lock held. Returns 0 if it is no longer (or not yet) there.
+static int backlogFind(unsigned long long seq, unsigned long long *off) {
+    if (seq < backlog.baseSeq || seq > backlog.endSeq) return 0;
+    size_t pos = 0;
+    for (unsigned long long n = backlog.baseSeq; n < seq; n++) {
+        JournalHeader h;
+        memcpy(&h, backlog.data + pos, sizeof(h));
+        pos += sizeof(h) + (size_t)h.len;
+    }
+    *off = backlog.base + pos;
+    return 1;
+}
+
+// Sends the replica on fd a snapshot cut where the stream now stands,
+// and returns that point in *seq and *off. Returns 0 on failure.
+static int feedSnapshot(int fd, unsigned long long *seq, unsigned long long *off) {
+    pthread_mutex_lock(&feedSendLock);
+    for (;;) {
+        pthread_rwlock_wrlock(&storeLock);
+        if (checkpointFinish(0)) break; // A running autosave holds its pin until reaped
+        pthread_rwlock_unlock(&storeLock);
+        struct timespec pause = { 0, 10000000 };
+        nanosleep(&pause, NULL);
+    }
+    SnapshotCut cut;
+    snapshotPrepare();
+    snapshotCutNow(&cut);
+    pthread_mutex_lock(&backlog.lock);
+    *seq = backlog.endSeq;
+    *off = backlog.base + backlog.len;
+    pthread_mutex_unlock(&backlog.lock);
+    __atomic_store_n(&viewPins[REPLICA_PIN].version, cut.version, __ATOMIC_SEQ_CST);
+    // Blocks are only appended, so the archive as of the cut is its first
+    // 'archived' bytes; passes after the cut come as records
+    FILE *arc = fopen(ARCHIVE_FILE, "rb");
+    long long archived = arc && fseek(arc, 0, SEEK_END) == 0 ? ftell(arc) : 0;
+    pthread_rwlock_unlock(&storeLock);
+
+    int ok = snapshotSave(REPLICA_SEND_FILE, &cut);
+    __atomic_store_n(&viewPins[REPLICA_PIN].version, 0, __ATOMIC_RELEASE);
+    FILE *fp = ok ? fopen(REPLICA_SEND_FILE, "rb") : NULL;
+    ok = 0;
+    if (fp && fseek(fp, 0, SEEK_END) == 0) {
+        long long bytes = ftell(fp);
+        char line[128];
+        snprintf(line, sizeof(line), "SNAPSHOT %llu %llu %lld %lld\n", streamEpoch, *seq, bytes, archived);
+        ok = sendAll(fd, line, strlen(line)) && sendFileBytes(fd, fp, bytes) &&
+             (!archived || sendFileBytes(fd, arc, archived));
+    }
+    if (fp) fclose(fp);
+    if (arc) fclose(arc);
+    remove(REPLICA_SEND_FILE);
+    pthread_mutex_unlock(&feedSendLock);
+    return ok;
+}
+
+// Takes in the acks the replica has sent, waiting up to waitMs for the
+// first. Returns 0 once the replica has gone.
+static int feedAcks(Feed *f, char *acks, size_t *len, int waitMs) {
+    struct pollfd pfd = { f->fd, POLLIN, 0 };
+    while (poll(&pfd, 1, waitMs) > 0) {
+        ssize_t k = read(f->fd, acks + *len, REPLICA_ACK_BYTES - 1 - *len);
+        if (k <= 0) return k < 0 && errno == EINTR;
+        *len += (size_t)k;
+        acks[*len] = '\0';
+        char *line = acks, *nl;
+        unsigned long long seq;
+        while ((nl = strchr(line, '\n'))) {
+            if (sscanf(line, "ack %llu", &seq) == 1 && seq > f->acked && seq <= f->sent) {
+                __atomic_store_n(&f->acked, seq, __ATOMIC_RELEASE);
+            }
+            line = nl + 1;
+        }
+        *len = strlen(line);
+        memmove(acks, line, *len + 1);
+        if (*len == REPLICA_ACK_BYTES - 1) *len = 0; // Not an ack: drop it
+        waitMs = 0; // Then take whatever else has arrived
+    }
+    return 1;
+}
+
+// Streams records to one replica until it goes or the service stops
+static void* feedThread(void *arg) {
+    Feed *f = arg;
+    unsigned long long seq = f->from, off = 0;
+    pthread_mutex_lock(&backlog.lock);
+    int stream = f->epoch == streamEpoch && backlogFind(seq, &off);
+    pthread_mutex_unlock(&backlog.lock);
+    int ok;
+    if (stream) {
+        char line[96];
+        snprintf(line, sizeof(line), "STREAM %llu %llu\n", streamEpoch, seq);
+        ok = sendAll(f->fd, line, strlen(line));
+    } else {
+        ok = feedSnapshot(f->fd, &seq, &off);
+    }
+    f->sent = f->acked = seq;
+
+    unsigned char *buf = malloc(REPLICA_FRAME_BYTES);
+    char acks[REPLICA_ACK_BYTES];
+    size_t ackLen = 0;
+    unsigned long long lastSend = nowNanos();
+    while (ok && buf && !serviceStopping) {
+        int full = seq - __atomic_load_n(&f->acked, __ATOMIC_ACQUIRE) >= REPLICA_WINDOW;
+        ReplicaFrame fr = { seq, 0, 0, 0 };
+        pthread_mutex_lock(&backlog.lock);
+        if (!full && seq == backlog.endSeq) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += 1;
+            pthread_cond_timedwait(&backlog.grew, &backlog.lock, &until);
+        }
+        if (off < backlog.base) {
+            ok = 0; // Fell out of the backlog: the replica reconnects for a snapshot
+        } else if (!full) {
+            size_t pos = (size_t)(off - backlog.base);
+            while (pos < backlog.len && seq + (unsigned)fr.count - f->acked < REPLICA_WINDOW) {
+                JournalHeader h;
+                memcpy(&h, backlog.data + pos, sizeof(h));
+                size_t n = sizeof(h) + (size_t)h.len;
+                if ((size_t)fr.len + n > REPLICA_FRAME_BYTES) break;
+                memcpy(buf + fr.len, backlog.data + pos, n);
+                fr.len += (int)n;
+                fr.count++;
+                pos += n;
+            }
+        }
+        pthread_mutex_unlock(&backlog.lock);
+        if (!ok) break;
 
-    fread(&patientCount, sizeof(int), 1, fp);
-    fread(&diseaseCount, sizeof(int), 1, fp);
-    fread(&doctorCount, sizeof(int), 1, fp);
-    fread(&appointmentCount, sizeof(int), 1, fp);
+        unsigned long long now = nowNanos();
+        if (fr.count || now - lastSend >= 1000000000ull) {
+            fr.crc = crc32Update(0, buf, (size_t)fr.len);
+            ok = sendAll(f->fd, &fr, sizeof(fr)) && sendAll(f->fd, buf, (size_t)fr.len);
+            seq += (unsigned)fr.count;
+            off += (unsigned)fr.len;
+            __atomic_store_n(&f->sent, seq, __ATOMIC_RELEASE);
+            lastSend = now;
+        }
+        if (ok) ok = feedAcks(f, acks, &ackLen, full ? 1000 : 0);
+    }
+    free(buf);
+    close(f->fd);
+    __atomic_store_n(&f->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
 
-    fread(&nextPatientId, sizeof(int), 1, fp);
-    fread(&nextDiseaseId, sizeof(int), 1, fp);
-    fread(&nextDoctorId, sizeof(int), 1, fp);
-    fread(&nextAppointmentId, sizeof(int), 1, fp);
+// Hands the session's connection to a new feed ("replicate EPOCH SEQ").
+// Returns 1 (the session is done with it) once the feed has started.
+static int feedStart(Session *s, const char *args, OutBuf *out) {
+    unsigned long long epoch, seq;
+    if (sscanf(args, "%llu %llu", &epoch, &seq) != 2) {
+        obPrintf(out, "ERR usage: replicate EPOCH SEQ\n");
+        return 0;
+    }
+    pthread_mutex_lock(&feedLock);
+    Feed *f = NULL;
+    for (int i = 0; i < REPLICA_MAX && !f; i++) {
+        if (feeds[i].used && __atomic_load_n(&feeds[i].done, __ATOMIC_ACQUIRE)) {
+            pthread_join(feeds[i].thread, NULL);
+            feeds[i].used = 0;
+        }
+        if (!feeds[i].used) f = &feeds[i];
+    }
+    int fd = f && backlog.data ? dup(s->fd) : -1;
+    if (fd < 0) {
+        pthread_mutex_unlock(&feedLock);
+        obPrintf(out, "ERR %s\n", backlog.data ? "too many replicas" : "replication is off");
+        return 0;
+    }
+    memset(f, 0, sizeof(*f));
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    struct timeval tv = { REPLICA_TIMEOUT * 2, 0 }; // A replica that stops reading is dropped
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    struct sockaddr_storage addr;
+    socklen_t alen = sizeof(addr);
+    strcpy(f->peer, "?");
+    if (getpeername(fd, (struct sockaddr*)&addr, &alen) == 0) {
+        getnameinfo((struct sockaddr*)&addr, alen, f->peer, sizeof(f->peer), NULL, 0, NI_NUMERICHOST);
+    }
+    f->fd = fd;
+    f->epoch = epoch;
+    f->from = seq;
+    f->used = pthread_create(&f->thread, NULL, feedThread, f) == 0;
+    pthread_mutex_unlock(&feedLock);
+    if (!f->used) {
+        close(fd);
+        obPrintf(out, "ERR cannot start a thread\n");
+        return 0;
+    }
+    return 1;
+}
 
-    if (patientCount > 0) fread(patients, sizeof(Patient), patientCount, fp);
-    if (diseaseCount > 0) fread(diseases, sizeof(Disease), diseaseCount, fp);
-    if (doctorCount > 0) fread(doctors, sizeof(Doctor), doctorCount, fp);
-    if (appointmentCount > 0) fread(appointments, sizeof(Appointment), appointmentCount, fp);
+// Reads where this replica's data stands (0 0 if it has never synced)
+static void replicaLoadPosition() {
+    FILE *fp = fopen(REPLICA_POSITION_FILE, "r");
+    if (!fp) return;
+    if (fscanf(fp, "%llu %llu", &replicaEpoch, &replicaSeq) != 2) replicaEpoch = replicaSeq = 0;
+    fclose(fp);
+}
 
+// A torn file reads as "never synced", which only costs a snapshot
+static void replicaSavePosition() {
+    FILE *fp = fopen(REPLICA_POSITION_FILE, "w");
+    if (!fp) return;
+    fprintf(fp, "%llu %llu\n", replicaEpoch, replicaSeq);
     fclose(fp);
-    printf(CYAN "?? Data loaded. Patients: %d, Diseases: %d, Doctors: %d, Appointments: %d\n" RESET_COLOR,
-           patientCount, diseaseCount, doctorCount, appointmentCount);
-    
-    printf("Press Enter to continue...");
-    getchar(); // Wait for user
 }
 
-/* --------------------- DOCTOR OPERATIONS --------------------- */
+// Connects to "HOST:PORT", giving up on reads and writes that stall for
+// timeout seconds. Returns the socket or -1.
+static int dialAddress(const char *address, int timeout) {
+    char host[256];
+    snprintf(host, sizeof(host), "%s", address);
+    char *port = strrchr(host, ':');
+    if (!port) return -1;
+    *port++ = '\0';
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) return -1;
+    int fd = -1;
+    for (struct addrinfo *a = res; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd < 0) return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    struct timeval tv = { timeout, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return fd;
+}
 
-void displayDoctors() {
-    if (doctorCount == 0) {
-        printf(YELLOW "?? No doctors added yet.\n" RESET_COLOR);
-        return;
+// Connects to the primary and asks to follow on from where this replica
+// stands. A snapshot sent back is left in REPLICA_RECEIVE_FILE (its
+// archive in REPLICA_ARCHIVE_FILE) and *snapshot set. Returns the connection with the stream position in
+// *epoch and *seq, or -1.
+static int replicaConnect(int *snapshot, unsigned long long *epoch, unsigned long long *seq) {
+    int fd = dialAddress(replicaOf, REPLICA_TIMEOUT);
+    if (fd < 0) return -1;
+
+    char line[128];
+    long long bytes, archived = 0;
+    snprintf(line, sizeof(line), "replicate %llu %llu\n", replicaEpoch, replicaSeq);
+    *snapshot = 0;
+    if (sendAll(fd, line, strlen(line)) && recvLine(fd, line, sizeof(line))) {
+        if (sscanf(line, "STREAM %llu %llu", epoch, seq) == 2) return fd;
+        if (sscanf(line, "SNAPSHOT %llu %llu %lld %lld", epoch, seq, &bytes, &archived) >= 3) {
+            if (recvFile(fd, REPLICA_RECEIVE_FILE, bytes) && recvFile(fd, REPLICA_ARCHIVE_FILE, archived)) {
+                *snapshot = 1;
+                return fd;
+            }
+            remove(REPLICA_RECEIVE_FILE);
+        }
     }
-    printf("\n" MAGENTA "========== DOCTOR LIST ==========\n" RESET_COLOR);
-    for (int i = 0; i < doctorCount; i++) {
-        printf(CYAN "ID: %d" RESET_COLOR " | Name: %s | Specialization: %s\n", 
-               doctors[i].id, doctors[i].name, doctors[i].specialization);
-        printf("----------------------------------\n");
+    close(fd);
+    return -1;
+}
+
+// Makes the snapshot received the local data, in place of DATA_FILE and
+// the journal on top of it. Returns 0 if it could not be put in place.
+static int replicaInstall(unsigned long long epoch, unsigned long long seq) {
+    if (!snapshotInstall(REPLICA_RECEIVE_FILE)) {
+        remove(REPLICA_RECEIVE_FILE);
+        remove(REPLICA_ARCHIVE_FILE);
+        return 0;
     }
+    rename(REPLICA_ARCHIVE_FILE, ARCHIVE_FILE); // Days the primary archived before the cut
+    journalReset();
+    replicaEpoch = epoch;
+    replicaSeq = seq;
+    replicaSavePosition();
+    return 1;
 }
 
-void addDoctor() {
-    clear_screen();
-    if (doctorCount >= MAX_DOCTORS) {
-        printf(RED "? Max doctors reached.\n" RESET_COLOR);
+// Applies one frame of records and journals them, synced once
+static void replicaApply(const unsigned char *bytes, const ReplicaFrame *fr) {
+    pthread_rwlock_wrlock(&storeLock);
+    if (!replicaActive()) {
+        pthread_rwlock_unlock(&storeLock);
         return;
     }
+    journalBuffered = 1;
+    size_t pos = 0;
+    for (int i = 0; i < fr->count; i++) {
+        JournalHeader h;
+        JBuf b;
+        memcpy(&h, bytes + pos, sizeof(h));
+        if (h.len < 0 || h.len > JOURNAL_MAX_PAYLOAD || pos + sizeof(h) + (size_t)h.len > (size_t)fr->len) break;
+        memcpy(b.data, bytes + pos + sizeof(h), (size_t)h.len);
+        b.len = 0;
+        b.bad = 0;
+        journalApply(h.op, &b, h.len);
+        b.len = h.len;
+        b.bad = 0;
+        journalAppend(h.op, &b);
+        pos += sizeof(h) + (size_t)h.len;
+    }
+    journalBuffered = 0;
+    if (journalFp) syncFile(journalFp);
+    replicaSeq += (unsigned)fr->count;
+    maintainStores();
+    viewPublish();
+    autosavePoll();
+    pthread_rwlock_unlock(&storeLock);
+    replicaSavePosition();
+}
 
-    Doctor d;
-    d.id = nextDoctorId++;
-    char temp[200];
-
-    printf(CYAN "\n--- New Doctor Registration ---\n" RESET_COLOR);
-    getLine("Enter doctor name (e.g., Dr. Smith): ", temp, sizeof(temp));
-    strncpy(d.name, temp, sizeof(d.name)-1); d.name[sizeof(d.name)-1] = '\0';
-
-    getLine("Enter specialization: ", temp, sizeof(temp));
-    strncpy(d.specialization, temp, sizeof(d.specialization)-1); d.specialization[sizeof(d.specialization)-1] = '\0';
+// Receives the frame of records from seq on into buf. Returns 0 if the
+// connection failed or the frame is not the one expected.
+static int replicaReceive(int fd, unsigned char *buf, unsigned long long seq, ReplicaFrame *fr) {
+    return recvAll(fd, fr, sizeof(*fr)) && fr->len >= 0 && fr->len <= REPLICA_FRAME_BYTES && fr->seq == seq &&
+           recvAll(fd, buf, (size_t)fr->len) && crc32Update(0, buf, (size_t)fr->len) == fr->crc;
+}
 
-    getLine("Enter phone: ", temp, sizeof(temp));
-    strncpy(d.phone, temp, sizeof(d.phone)-1); d.phone[sizeof(d.phone)-1] = '\0';
+// Follows the primary until promoted or stopped, reconnecting whenever
+// the connection drops. A snapshot on reconnecting means this replica
+// fell too far behind (or the primary restarted): it is installed and
+// the process starts over on it.
+static void* replicaThread(void *arg) {
+    (void)arg;
+    unsigned char *buf = malloc(2 * REPLICA_FRAME_BYTES);
+    while (buf && !serviceStopping && replicaActive()) {
+        if (replicaFd < 0) {
+            int snapshot;
+            unsigned long long epoch, seq;
+            int fd = replicaConnect(&snapshot, &epoch, &seq);
+            if (fd < 0) {
+                sleep(1);
+                continue;
+            }
+            if (snapshot) {
+                close(fd);
+                pthread_rwlock_wrlock(&storeLock);
+                checkpointFinish(1); // Never two writers on DATA_FILE
+                if (replicaInstall(epoch, seq)) {
+                    printf(YELLOW "?? Resynchronized from the primary; restarting on the new data.\n" RESET_COLOR);
+                    fflush(stdout);
+                    execvp(mainArgv[0], mainArgv);
+                    fprintf(stderr, "hms: cannot restart: %s\n", strerror(errno));
+                    exit(1); // The data on disk is no longer what is loaded
+                }
+                pthread_rwlock_unlock(&storeLock);
+                sleep(1);
+                continue;
+            }
+            printf(CYAN "?? Following the primary at %s from record %llu.\n" RESET_COLOR, replicaOf, seq);
+            fflush(stdout);
+            __atomic_store_n(&replicaFd, fd, __ATOMIC_RELEASE);
+        }
+        // Frames already waiting are applied with this one, under one lock and one sync
+        ReplicaFrame fr, next;
+        int ok = replicaReceive(replicaFd, buf, replicaSeq, &fr);
+        struct pollfd pfd = { replicaFd, POLLIN, 0 };
+        while (ok && fr.len < REPLICA_FRAME_BYTES && poll(&pfd, 1, 0) > 0) {
+            ok = replicaReceive(replicaFd, buf + fr.len, replicaSeq + (unsigned)fr.count, &next);
+            fr.count += next.count;
+            fr.len += next.len;
+        }
+        if (!ok) {
+            if (!serviceStopping && replicaActive()) {
+                printf(YELLOW "?? Lost the primary at %s; reconnecting.\n" RESET_COLOR, replicaOf);
+                fflush(stdout);
+            }
+            close(replicaFd);
+            __atomic_store_n(&replicaFd, -1, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (fr.count) replicaApply(buf, &fr);
+        char ack[48];
+        snprintf(ack, sizeof(ack), "ack %llu\n", replicaSeq);
+        sendAll(replicaFd, ack, strlen(ack)); // A failure shows on the next read
+    }
+    if (replicaFd >= 0) close(replicaFd);
+    replicaFd = -1;
+    free(buf);
+    return NULL;
+}
 
-    doctors[doctorCount++] = d;
-    printf(GREEN "? Doctor added successfully! (ID: %d)\n" RESET_COLOR, d.id);
+// "promote": stops following the primary and takes changes from now on
+static int replicaPromote(OutBuf *out) {
+    if (!replicaActive()) {
+        obPrintf(out, "ERR not a replica\n");
+        return 0;
+    }
+    pthread_rwlock_wrlock(&storeLock); // Lets a frame being applied finish
+    __atomic_store_n(&replicaPromoted, 1, __ATOMIC_RELEASE);
+    remove(REPLICA_POSITION_FILE);
+    pthread_rwlock_unlock(&storeLock);
+    printf(GREEN "?? Promoted: no longer following %s; changes are accepted.\n" RESET_COLOR, replicaOf);
+    fflush(stdout);
+    obPrintf(out, "OK\n");
+    return 0;
 }
 
-void viewDoctors() {
-    clear_screen();
-    displayDoctors(); // Use the helper
+// "replication": this instance's stream position and, on a replica,
+// its primary's; then one row per replica fed
+static int replicationStatus(OutBuf *out) {
+    pthread_mutex_lock(&backlog.lock);
+    obPrintf(out, "primary,%llu,%llu\n", streamEpoch, backlog.endSeq);
+    pthread_mutex_unlock(&backlog.lock);
+    if (replicaOf) {
+        pthread_rwlock_rdlock(&storeLock);
+        obPrintf(out, "replica,%s,%llu,%llu,%s\n", replicaOf, replicaEpoch, replicaSeq,
+                 !replicaActive() ? "promoted" : __atomic_load_n(&replicaFd, __ATOMIC_ACQUIRE) >= 0 ? "following" : "connecting");
+        pthread_rwlock_unlock(&storeLock);
+    }
+    pthread_mutex_lock(&feedLock);
+    for (int i = 0; i < REPLICA_MAX; i++) {
+        Feed *f = &feeds[i];
+        if (!f->used || __atomic_load_n(&f->done, __ATOMIC_ACQUIRE)) continue;
+        obPrintf(out, "feed,%s,%llu,%llu\n", f->peer, __atomic_load_n(&f->sent, __ATOMIC_ACQUIRE),
+                 __atomic_load_n(&f->acked, __ATOMIC_ACQUIRE));
+    }
+    pthread_mutex_unlock(&feedLock);
+    obPrintf(out, "OK\n");
+    return 0;
 }
 
-/* --------------------- PATIENT OPERATIONS --------------------- */
+/* ROUTER. Given --shard NAME=LO-HI@HOST:PORT options, service mode holds
+   no data and passes each request on to the sites (shards) that serve
+   it. Each site is an instance of its own, with its own file, journal
+   and locks; started with --id-range LO-HI, every id it hands out names
+   the site a record lives on.
+   - A line starting with "@NAME " goes to that site alone: this is how
+     new records are placed by clinic, and how one site is listed.
+   - A request naming an id goes to its owner: get, delete and cancel,
+     a record given its own id, a new patient by their doctor, a new
+     appointment by its patient, doctor-schedule by the doctor. Other new
+     records and metrics go to the first site.
+   - Listings, find-patient and the reports fan out. The request goes to
+     every site before any reply is read, so they run side by side, and
+     the rows are merged: by id (by name for find-patient), with report
+     rows for the same doctor, condition or day added up. offset and
+     limit apply to the merged rows. save goes to every site.
+   Each worker keeps one connection to each site. */
 
-void addPatient() {
-    clear_screen();
-    if (patientCount >= MAX_PATIENTS) {
-        printf(RED "? Max patients reached.\n" RESET_COLOR);
-        return;
-    }
+#define SHARD_TIMEOUT 10 // Seconds to wait on a site
 
-    Patient p;
-    p.id = nextPatientId++;
-    char temp[200];
+typedef struct {
+    int fd;
+    char buf[4096]; // received, from pos to len not yet read
+    size_t pos, len;
+} ShardConn;
 
-    printf(CYAN "\n--- New Patient Registration ---\n" RESET_COLOR);
-    getLine("Enter patient name: ", temp, sizeof(temp));
-    strncpy(p.name, temp, sizeof(p.name)-1); p.name[sizeof(p.name)-1] = '\0';
+ShardConn *shardConns[VIEW_MAX_READERS][SHARD_MAX]; // Per worker and site, made on first use
 
-    p.age = get_int_from_user("Enter age: "); // Robust input
+// A merged row: one line of a site's reply and its sort key
+typedef struct {
+    const char *row;
+    int len;
+    int site;
+    long long num;  // the key column as a number (numeric keys)
+    char key[128];  // or as text
+} RouteRow;
 
-    getLine("Enter gender: ", temp, sizeof(temp));
-    strncpy(p.gender, temp, sizeof(p.gender)-1); p.gender[sizeof(p.gender)-1] = '\0';
+static int shardOwning(int id) {
+    for (int k = 0; k < shardCount; k++) if (id >= shards[k].lo && id <= shards[k].hi) return k;
+    return -1;
+}
 
-    getLine("Enter phone number: ", temp, sizeof(temp));
-    strncpy(p.phone, temp, sizeof(p.phone)-1); p.phone[sizeof(p.phone)-1] = '\0';
+// Sends line (ending in a newline) to site k over worker r's connection,
+// connecting first if need be. Returns the connection, or NULL if the
+// site cannot be reached.
+static ShardConn* shardSend(int r, int k, const char *line, size_t len) {
+    ShardConn *c = shardConns[r][k];
+    if (!c) {
+        if (!(c = calloc(1, sizeof(ShardConn)))) return NULL;
+        c->fd = -1;
+        shardConns[r][k] = c;
+    }
+    struct pollfd idle = { c->fd, POLLIN, 0 };
+    if (c->fd >= 0 && poll(&idle, 1, 0) > 0) {
+        close(c->fd); // Sites send nothing unasked, so this is the end of the stream: it restarted
+        c->fd = -1;
+    }
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (c->fd < 0) {
+            c->fd = dialAddress(shards[k].address, SHARD_TIMEOUT);
+            c->pos = c->len = 0;
+        }
+        if (c->fd < 0) return NULL;
+        if (sendAll(c->fd, line, len)) return c;
+        close(c->fd); // Closed by the site since it was last used: dial again once
+        c->fd = -1;
+    }
+    return NULL;
+}
 
-    // --- STREAMLINED WORKFLOW ---
-    printf(CYAN "\n--- Diagnosis & Assignment ---\n" RESET_COLOR);
-    getLine("Enter patient's disease/condition: ", temp, sizeof(temp));
-    strncpy(p.disease, temp, sizeof(p.disease)-1); p.disease[sizeof(p.disease)-1] = '\0';
-    
-    // Automatically show doctor list for assignment
-    if (doctorCount > 0) {
-        printf(YELLOW "\n--- Assign a Doctor ---" RESET_COLOR);
-        displayDoctors(); // Show list
-        int docId = get_int_from_user("Enter Doctor ID to assign (or 0 for none): ");
-        
-        if (docId != 0 && findDoctorIndex(docId) != -1) {
-            p.doctorId = docId;
-            printf(GREEN "? Doctor (ID: %d) assigned.\n" RESET_COLOR, docId);
-        } else {
-            p.doctorId = 0;
-            if (docId != 0) {
-                 printf(RED "?? No doctor found with ID %d. Patient assigned 'None'.\n" RESET_COLOR, docId);
-            } else {
-                 printf(YELLOW "?? Patient assigned 'None'.\n" RESET_COLOR);
+// Reads one reply line (without its newline). Returns 0 on failure.
+static int shardLine(ShardConn *c, char *line, size_t size) {
+    size_t n = 0;
+    for (;;) {
+        while (c->pos < c->len) {
+            char ch = c->buf[c->pos++];
+            if (ch == '\n') {
+                line[n] = '\0';
+                return 1;
             }
+            if (n + 1 < size) line[n++] = ch;
         }
-    } else {
-        printf(YELLOW "?? No doctors in system. Patient assigned 'None'.\n" RESET_COLOR);
-        p.doctorId = 0; // No doctors to assign
+        ssize_t k = read(c->fd, c->buf, sizeof(c->buf));
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return 0;
+        c->pos = 0;
+        c->len = (size_t)k;
     }
+}
 
-    patients[patientCount++] = p;
-    printf(GREEN "\n? Patient added successfully! (ID: %d)\n" RESET_COLOR, p.id);
+// Reads a site's whole reply: rows onto rows, the status line into status.
+// Returns 0 (and drops the connection) if it failed.
+static int shardReply(ShardConn *c, OutBuf *rows, char *status, size_t size) {
+    char line[BATCH_LINE_MAX];
+    while (shardLine(c, line, sizeof(line))) {
+        if (strncmp(line, "OK", 2) == 0 || strncmp(line, "ERR", 3) == 0) {
+            size_t n = strlen(line) < size ? strlen(line) : size - 1; // A long reason is cut short
+            memcpy(status, line, n);
+            status[n] = '\0';
+            return 1;
+        }
+        obPrintf(rows, "%s\n", line);
+    }
+    close(c->fd);
+    c->fd = -1;
+    return 0;
 }
 
-void viewPatients() {
-    clear_screen();
-    if (patientCount == 0) {
-        printf(YELLOW "?? No patients available.\n" RESET_COLOR);
-        return;
+// Index of the site a single-site request goes to; -1 to fan it out, or
+// -2 (with *id set) if no site owns the id it names
+static int routeTarget(int kind, const BatchRecord *rec, int *id) {
+    int other = 0;
+    batchInt(rec, "id", 0, id); // Malformed numbers are left for the site to refuse
+    switch (kind) {
+        case B_PATIENT: if (!*id) batchInt(rec, "doctor", 0, &other); break;
+        case B_APPOINTMENT: if (!*id) batchInt(rec, "patient", 0, &other); break;
+        case B_DOCTOR_SCHEDULE: batchInt(rec, "doctor", 0, &other); break;
+        case B_DOCTOR: case B_DISEASE: case B_METRICS: break;
+        case B_DELETE_PATIENT: case B_GET_PATIENT: case B_CANCEL_APPOINTMENT:
+            if (*id <= 0) return 0; // Refused by the site
+            break;
+        default: return -1;
     }
+    if (other) *id = other;
+    if (!*id) return 0;
+    int k = shardOwning(*id);
+    return k >= 0 ? k : -2;
+}
 
-    printf("\n" MAGENTA "========== PATIENT LIST ==========\n" RESET_COLOR);
-    for (int i = 0; i < patientCount; i++) {
-        printf(BLUE "ID: %d\n" RESET_COLOR, patients[i].id);
-        printf("Name: %s\n", patients[i].name);
-        printf("Age: %d\n", patients[i].age);
-        printf("Gender: %s\n", patients[i].gender);
-        printf("Phone: %s\n", patients[i].phone);
-        printf(YELLOW "Disease: %s\n" RESET_COLOR, patients[i].disease);
-        
-        if (patients[i].doctorId != 0) {
-            char dname[100] = "Unknown";
-            int doc_idx = findDoctorIndex(patients[i].doctorId);
-            if (doc_idx != -1) {
-                strncpy(dname, doctors[doc_idx].name, sizeof(dname)-1);
+// Copies CSV field col of row (up to its newline) into out. Returns 1 if
+// another field follows it.
+static int csvFieldOf(const char *row, int col, char *out, size_t size) {
+    size_t n = 0;
+    for (int c = 0; *row && *row != '\n'; c++) {
+        int quoted = *row == '"';
+        if (quoted) row++;
+        while (*row && *row != '\n' && (quoted || *row != ',')) {
+            if (quoted && *row == '"') {
+                if (row[1] != '"') { row++; break; }
+                row++;
             }
-            printf(GREEN "Doctor: %s (ID: %d)\n" RESET_COLOR, dname, patients[i].doctorId);
-        } else {
-            printf(RED "Doctor: Not Assigned\n" RESET_COLOR);
+            if (c == col && n + 1 < size) out[n++] = *row;
+            row++;
         }
-        printf("----------------------------------\n");
+        if (c == col) break;
+        if (*row == ',') row++;
     }
+    out[n] = '\0';
+    return *row == ',';
 }
 
-void searchPatientById() {
-    clear_screen();
-    int id = get_int_from_user("\nEnter patient ID to search: ");
-    if (id <= 0) { printf(RED "? Invalid ID.\n" RESET_COLOR); return; }
+static int routeRowCompare(const void *a, const void *b) {
+    const RouteRow *x = a, *y = b;
+    if (x->num != y->num) return x->num < y->num ? -1 : 1;
+    int c = strcmp(x->key, y->key);
+    if (c) return c;
+    if (x->site != y->site) return x->site - y->site;
+    return x->row < y->row ? -1 : x->row > y->row; // Rows of one site stay in order
+}
 
-    int i = findPatientIndex(id);
-    if (i != -1) {
-        printf(GREEN "\n? Patient Found!\n" RESET_COLOR);
-        printf("ID: %d\n", patients[i].id);
-        printf("Name: %s\n", patients[i].name);
-        printf("Age: %d\n", patients[i].age);
-        printf("Gender: %s\n", patients[i].gender);
-        printf("Phone: %s\n", patients[i].phone);
-        printf(YELLOW "Disease: %s\n" RESET_COLOR, patients[i].disease);
-        if (patients[i].doctorId) {
-            int j = findDoctorIndex(patients[i].doctorId);
-            if (j != -1) {
-                printf(GREEN "Doctor: %s (ID: %d)\n" RESET_COLOR, doctors[j].name, doctors[j].id);
-            } else {
-                 printf(RED "Doctor: Unknown (ID: %d)\n" RESET_COLOR, patients[i].doctorId);
-            }
-        } else {
-            printf(RED "Doctor: Not Assigned\n" RESET_COLOR);
+// True if s is a whole (possibly negative) integer
+static int isInteger(const char *s) {
+    if (*s == '-') s++;
+    if (!*s) return 0;
+    while (isdigit((unsigned char)*s)) s++;
+    return *s == '\0';
+}
+
+// Writes the rows of group (all with one key) as one row, adding up the
+// columns that are numbers in every row
+static void routeSumRows(OutBuf *out, const RouteRow *group, int n) {
+    char field[BATCH_LINE_MAX], first[BATCH_LINE_MAX];
+    for (int col = 0; ; col++) {
+        char after = csvFieldOf(group[0].row, col, first, sizeof(first)) ? ',' : '\n';
+        long long sum = 0;
+        int numeric = isInteger(first);
+        for (int i = 0; i < n && numeric; i++) {
+            csvFieldOf(group[i].row, col, field, sizeof(field));
+            numeric = isInteger(field);
+            sum += strtoll(field, NULL, 10);
         }
-        return;
+        if (numeric && col > 0) obPrintf(out, "%lld%c", sum, after);
+        else obCsv(out, first, after);
+        if (after == '\n') return;
     }
-    printf(YELLOW "? Patient with ID %d not found.\n" RESET_COLOR, id);
 }
 
-void searchPatientByName() {
-    clear_screen();
-    char name[100];
-    getLine("\nEnter patient name to search: ", name, sizeof(name));
-
-    int found = 0;
-    for (int i = 0; i < patientCount; i++) {
-        if (stricmp_custom(patients[i].name, name) == 0) {
-            if (!found) { printf(GREEN "\n? Matches:\n" RESET_COLOR); }
-            found = 1;
-            printf("ID: %d | Name: %s | Disease: %s\n", patients[i].id, patients[i].name, patients[i].disease);
+// Runs a request through the sites. Returns 1 if the client asked to quit.
+static int routeRun(Session *s, int r, OutBuf *out) {
+    char line[BATCH_LINE_MAX];
+    const char *text = s->request;
+    int only = -1;
+    if (*text == '@') {
+        const char *sp = strchr(text, ' ');
+        for (int k = 0; k < shardCount && sp; k++) {
+            if (strlen(shards[k].name) == (size_t)(sp - text - 1) && strncmp(shards[k].name, text + 1, (size_t)(sp - text - 1)) == 0) only = k;
+        }
+        if (only < 0) {
+            obPrintf(out, "ERR no such site\n");
+            return 0;
         }
+        text = sp + 1;
     }
-    if (!found) {
-        printf(YELLOW "? No patient named '%s' found.\n" RESET_COLOR, name);
+    snprintf(line, sizeof(line), "%s", text);
+    BatchRecord rec;
+    int kind, id = 0;
+    const char *err = s->overlong ? "line too long" : parseCommand(line, NULL, &rec, &kind);
+    if (!err && kind < 0) return 0;
+    if (err) {
+        obPrintf(out, "ERR %s\n", err);
+        return 0;
+    }
+    if (kind == B_QUIT) {
+        obPrintf(out, "OK\n");
+        return 1;
+    }
+    unsigned long long t = metricStart();
+    int target = only >= 0 ? only : routeTarget(kind, &rec, &id);
+    if (target == -2) {
+        obPrintf(out, "ERR No site holds ID %d.\n", id);
+        return 0;
     }
-}
 
-void deletePatient() {
-    clear_screen();
-    int id = get_int_from_user("\nEnter patient ID to delete: ");
-    if (id <= 0) { printf(RED "? Invalid ID.\n" RESET_COLOR); return; }
+    // Listings are asked for from the start, to be cut to offset and limit
+    // once merged. A negative offset or limit goes out as it is, for the
+    // sites to refuse.
+    int offset = 0, limit = pageSize;
+    int listing = kind == B_LIST_PATIENTS || kind == B_LIST_APPOINTMENTS || kind == B_LIST_DOCTORS ||
+                  kind == B_LIST_DISEASES || kind == B_FILTER_PATIENTS;
+    OutBuf request = { 0 };
+    if (target < 0 && listing && batchInt(&rec, "offset", 0, &offset) && batchInt(&rec, "limit", pageSize, &limit) &&
+        offset >= 0 && limit >= 0) {
+        long long want = (long long)offset + limit;
+        obPrintf(&request, "%s,", batchLayouts[kind][0]);
+        for (int c = 1; c < 8 && batchLayouts[kind][c]; c++) {
+            const char *col = batchLayouts[kind][c], *v = batchField(&rec, col);
+            char after = c == 7 || !batchLayouts[kind][c + 1] ? '\n' : ',';
+            if (strcmp(col, "offset") == 0) obPrintf(&request, "0%c", after);
+            else if (strcmp(col, "limit") == 0) obPrintf(&request, "%lld%c", want < INT_MAX ? want : INT_MAX, after);
+            else obCsv(&request, v ? v : "", after);
+        }
+    } else {
+        obPrintf(&request, "%s\n", text);
+        if (kind == B_FIND_PATIENT) batchInt(&rec, "limit", pageSize, &limit);
+    }
 
-    int i = findPatientIndex(id);
-    if (i != -1) {
-        printf(YELLOW "Found: %s. Are you sure you want to delete? (y/n): " RESET_COLOR, patients[i].name);
-        char confirm[10];
-        getLine("", confirm, sizeof(confirm));
-        
-        if (confirm[0] == 'y' || confirm[0] == 'Y') {
-            // shift left
-            for (int j = i; j < patientCount - 1; j++) patients[j] = patients[j+1];
-            patientCount--;
-            printf(GREEN "??? Patient deleted successfully.\n" RESET_COLOR);
+    // Send to every site first, then collect, so they work side by side
+    int first = target >= 0 ? target : 0, last = target >= 0 ? target : shardCount - 1;
+    ShardConn *conns[SHARD_MAX];
+    OutBuf rows[SHARD_MAX];
+    char status[SHARD_MAX][200];
+    int failed = -1, refused = -1;
+    for (int k = first; k <= last; k++) {
+        conns[k] = request.failed ? NULL : shardSend(r, k, request.data, request.len);
+        if (!conns[k] && failed < 0) failed = k;
+    }
+    for (int k = first; k <= last; k++) {
+        memset(&rows[k], 0, sizeof(rows[k]));
+        status[k][0] = '\0';
+        if (conns[k] && !shardReply(conns[k], &rows[k], status[k], sizeof(status[k])) && failed < 0) failed = k;
+        if (strncmp(status[k], "ERR", 3) == 0 && refused < 0) refused = k;
+    }
+    obFree(&request);
+
+    if (failed >= 0) {
+        obPrintf(out, "ERR site %s is unavailable\n", shards[failed].name);
+    } else if (target >= 0) {
+        // One site: its reply as it is
+        if (rows[target].len) obPrintf(out, "%.*s", (int)rows[target].len, rows[target].data);
+        obPrintf(out, "%s\n", status[target]);
+    } else if (refused >= 0) {
+        obPrintf(out, "ERR %s: %s\n", shards[refused].name, status[refused] + (status[refused][3] == ' ' ? 4 : 3));
+    } else {
+        int count = 0;
+        for (int k = first; k <= last; k++) {
+            for (size_t i = 0; i < rows[k].len; i++) count += rows[k].data[i] == '\n';
+        }
+        RouteRow *merged = malloc((size_t)(count ? count : 1) * sizeof(RouteRow));
+        int n = 0;
+        int sum = kind == B_WORKLOAD || kind == B_CENSUS || kind == B_DAILY_APPOINTMENTS;
+        int keyCol = kind == B_FIND_PATIENT ? 1 : 0;
+        int numeric = kind != B_FIND_PATIENT && kind != B_CENSUS && kind != B_DAILY_APPOINTMENTS;
+        for (int k = first; k <= last && merged; k++) {
+            for (size_t i = 0; i < rows[k].len; ) {
+                RouteRow *m = &merged[n++];
+                m->row = rows[k].data + i;
+                m->len = (int)((const char*)memchr(m->row, '\n', rows[k].len - i) - m->row) + 1;
+                m->site = k;
+                csvFieldOf(m->row, keyCol, m->key, sizeof(m->key));
+                m->num = numeric ? strtoll(m->key, NULL, 10) : 0;
+                if (numeric) m->key[0] = '\0';
+                i += (size_t)m->len;
+            }
+        }
+        if (!merged) {
+            obPrintf(out, "ERR Out of memory.\n");
         } else {
-            printf(CYAN "Deletion canceled.\n" RESET_COLOR);
+            qsort(merged, (size_t)n, sizeof(RouteRow), routeRowCompare);
+            if (!listing) offset = 0;
+            if (sum) limit = INT_MAX;
+            int shown = 0;
+            for (int i = 0; i < n && shown < limit; ) {
+                int j = i + 1;
+                while (sum && j < n && merged[j].num == merged[i].num && strcmp(merged[j].key, merged[i].key) == 0) j++;
+                if (offset > 0) {
+                    offset--;
+                } else {
+                    if (j - i > 1) routeSumRows(out, &merged[i], j - i);
+                    else obPrintf(out, "%.*s", merged[i].len, merged[i].row);
+                    shown++;
+                }
+                i = j;
+            }
+            obPrintf(out, "OK\n");
         }
-        return;
+        free(merged);
     }
-    printf(YELLOW "? No patient found with ID %d.\n" RESET_COLOR, id);
+    for (int k = first; k <= last; k++) obFree(&rows[k]);
+    metricStop(MT_REQUEST, t);
+    return 0;
 }
 
-// *** NEW *** Comparison function for qsort
-int comparePatientsByName(const void *a, const void *b) {
-    Patient *pA = (Patient*)a;
-    Patient *pB = (Patient*)b;
-    return stricmp_custom(pA->name, pB->name);
+// Answers a scrape of the metrics and asks for the connection to close
+static int serviceMetricsPage(OutBuf *out) {
+    OutBuf body = { 0 };
+    pthread_rwlock_rdlock(&storeLock);
+    metricsPrometheus(&body);
+    pthread_rwlock_unlock(&storeLock);
+    obPrintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n"
+             "Connection: close\r\n\r\n%.*s", body.len, (int)body.len, body.data ? body.data : "");
+    if (body.failed) out->failed = 1;
+    obFree(&body);
+    return 1;
 }
 
-void sortPatientsByName() {
-    clear_screen();
-    if (patientCount < 2) { 
-        printf(YELLOW "?? Not enough patients to sort.\n" RESET_COLOR); 
-        return; 
+// Runs one request line for worker r and appends its reply to out.
+// Returns 1 if the client asked to quit.
+static int serviceRun(Session *s, int r, OutBuf *out) {
+    if (strncmp(s->request, "GET /metrics", 12) == 0) return serviceMetricsPage(out);
+    if (shardCount) return routeRun(s, r, out);
+    if (strncmp(s->request, "replicate ", 10) == 0) return feedStart(s, s->request + 10, out);
+    if (strcmp(s->request, "promote") == 0) return replicaPromote(out);
+    if (strcmp(s->request, "replication") == 0) return replicationStatus(out);
+    unsigned long long t = metricStart();
+    BatchRecord rec;
+    int kind, id = 0;
+    const char *err = s->overlong ? "line too long" : parseCommand(s->request, NULL, &rec, &kind);
+    if (!err && kind < 0) return 0; // Blank line or comment: no reply
+    if (!err && commandScans(kind)) {
+        err = runCommand(&rec, kind, viewPin(r), out, &id);
+        viewUnpin(r);
+        if (err) obPrintf(out, "ERR %s\n", err);
+    } else if (!err && commandWrites(kind) && kind != B_SAVE && replicaActive()) {
+        err = "read-only replica (send promote to take changes)";
+        obPrintf(out, "ERR %s\n", err);
+    } else if (!err) {
+        int writes = commandWrites(kind);
+        if (writes) pthread_rwlock_wrlock(&storeLock);
+        else pthread_rwlock_rdlock(&storeLock);
+        err = runCommand(&rec, kind, NULL, out, &id);
+        if (writes) {
+            if (!replicaActive()) archiveClosedDays(); // A replica follows its primary's passes
+            maintainStores(); // Compaction moves rows, so only under the write lock
+            viewPublish();
+            autosavePoll();
+        }
+        if (err) obPrintf(out, "ERR %s\n", err); // Copied before the lock drops: err may be a shared buffer
+        pthread_rwlock_unlock(&storeLock);
+    } else {
+        obPrintf(out, "ERR %s\n", err);
     }
-    
-    // Use qsort for efficient sorting
-    qsort(patients, patientCount, sizeof(Patient), comparePatientsByName);
-    
-    printf(GREEN "? Patients sorted by name. Please use 'View All Patients' to see the new order.\n" RESET_COLOR);
-}
-
-/* --------------------- DISEASE REFERENCE OPERATIONS --------------------- */
-void addDisease() {
-    clear_screen();
-    if (diseaseCount >= MAX_DISEASES) {
-        printf(RED "? Max diseases reached.\n" RESET_COLOR);
-        return;
+    if (!err) {
+        if (id) obPrintf(out, "OK %d\n", id);
+        else obPrintf(out, "OK\n");
     }
+    metricStop(MT_REQUEST, t);
+    return !err && kind == B_QUIT;
+}
 
-    Disease d;
-    d.id = nextDiseaseId++;
-    char tmp[300];
-    
-    printf(CYAN "\n--- Add to Disease Reference Database ---\n" RESET_COLOR);
-    getLine("Enter disease name: ", tmp, sizeof(tmp));
-    strncpy(d.name, tmp, sizeof(d.name)-1); d.name[sizeof(d.name)-1] = '\0';
-
-    getLine("Enter common symptoms: ", tmp, sizeof(tmp));
-    strncpy(d.symptoms, tmp, sizeof(d.symptoms)-1); d.symptoms[sizeof(d.symptoms)-1] = '\0';
+static void* serviceWorker(void *arg) {
+    int r = (int)(intptr_t)arg; // This worker's view pin
+    OutBuf out = { 0 };
+    pthread_mutex_lock(&serviceLock);
+    for (;;) {
+        while (!jobCount && !serviceStopping) pthread_cond_wait(&jobReady, &serviceLock);
+        if (!jobCount) break;
+        Session *s = jobs[jobHead];
+        jobHead = (jobHead + 1) % SERVICE_MAX_SESSIONS;
+        jobCount--;
+        pthread_mutex_unlock(&serviceLock);
 
-    getLine("Enter common treatment: ", tmp, sizeof(tmp));
-    strncpy(d.treatment, tmp, sizeof(d.treatment)-1); d.treatment[sizeof(d.treatment)-1] = '\0';
+        int quit = serviceRun(s, r, &out); // Formatted outside serviceLock so other sessions keep flowing
 
-    diseases[diseaseCount++] = d;
-    printf(GREEN "? Disease reference added successfully! (ID: %d)\n" RESET_COLOR, d.id);
+        pthread_mutex_lock(&serviceLock);
+        if (quit) s->closing = 1;
+        if (out.len) obPrintf(&s->out, "%.*s", (int)out.len, out.data);
+        if (out.failed) obPrintf(&s->out, "ERR out of memory\n");
+        out.len = 0;
+        out.failed = 0;
+        s->busy = 0;
+        serviceWake();
+    }
+    pthread_mutex_unlock(&serviceLock);
+    obFree(&out);
+    return NULL;
 }
 
-void displayDiseases() {
-    clear_screen();
-    if (diseaseCount == 0) {
-        printf(YELLOW "?? No diseases recorded in reference database.\n" RESET_COLOR);
-        return;
+// Hands the session's next complete line to the workers, if it has one
+// and nothing in flight. Called with serviceLock held.
+static void serviceDispatch(Session *s) {
+    if (s->busy || s->closing) return;
+    char *nl = memchr(s->in, '\n', s->inLen);
+    if (!nl) {
+        if (s->inLen < sizeof(s->in)) return;
+        // A full buffer with no newline: refuse the line, drop the rest of it
+        s->overlong = 1;
+        s->discarding = 1;
+        s->inLen = 0;
+    } else {
+        size_t len = (size_t)(nl - s->in);
+        if (len && s->in[len - 1] == '\r') len--;
+        memcpy(s->request, s->in, len);
+        s->request[len] = '\0';
+        s->overlong = 0;
+        size_t used = (size_t)(nl - s->in) + 1;
+        memmove(s->in, s->in + used, s->inLen - used);
+        s->inLen -= used;
     }
-    printf("\n" MAGENTA "========== DISEASE REFERENCE DATABASE ==========\n" RESET_COLOR);
-    for (int i = 0; i < diseaseCount; i++) {
-        printf(BLUE "ID: %d\nName: %s\n" RESET_COLOR, diseases[i].id, diseases[i].name);
-        printf("Symptoms: %s\nTreatment: %s\n", diseases[i].symptoms, diseases[i].treatment);
-        printf("----------------------------------\n");
+    s->busy = 1;
+    jobs[(jobHead + jobCount++) % SERVICE_MAX_SESSIONS] = s;
+    pthread_cond_signal(&jobReady);
+}
+
+// Reads what the client sent. Returns 0 once the connection is finished.
+static int serviceRead(Session *s) {
+    char buf[4096];
+    size_t room = sizeof(s->in) - s->inLen; // Never take more than fits: the rest waits in the socket
+    if (!room) return 1;
+    ssize_t n = read(s->fd, buf, room < sizeof(buf) ? room : sizeof(buf));
+    if (n == 0) return 0;
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    for (ssize_t i = 0; i < n; i++) {
+        if (s->discarding) {
+            if (buf[i] == '\n') s->discarding = 0;
+            continue;
+        }
+        s->in[s->inLen++] = buf[i];
     }
+    return 1;
 }
 
-/* --------------------- APPOINTMENTS --------------------- */
+// Sends queued replies. Called with serviceLock held. Returns 0 on a
+// broken connection.
+static int serviceWrite(Session *s) {
+    while (s->sent < s->out.len) {
+        ssize_t n = write(s->fd, s->out.data + s->sent, s->out.len - s->sent);
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        s->sent += (size_t)n;
+    }
+    s->out.len = s->sent = 0;
+    return 1;
+}
 
-void addAppointment() {
-    clear_screen();
-    if (appointmentCount >= MAX_APPOINTS) {
-        printf(RED "? Max appointments reached.\n" RESET_COLOR);
-        return;
+// Runs service mode on port. Returns the process exit status.
+int runService(int port, int workers) {
+    batchMode = 1; // No prompts or screen clears
+    if (replicaOf) {
+        // Sync before loading, so a snapshot sent back is what gets loaded
+        replicaLoadPosition();
+        int fd, snapshot, waiting = 0;
+        unsigned long long epoch, seq;
+        while ((fd = replicaConnect(&snapshot, &epoch, &seq)) < 0) {
+            if (!waiting++) printf("Waiting for the primary at %s...\n", replicaOf);
+            fflush(stdout);
+            sleep(1);
+        }
+        if (snapshot && !replicaInstall(epoch, seq)) {
+            fprintf(stderr, "hms: cannot install the snapshot from %s\n", replicaOf);
+            return 2;
+        }
+        printf(snapshot ? "Received a snapshot from %s at record %llu.\n" : "Following %s from record %llu.\n", replicaOf, seq);
+        replicaFd = fd;
     }
-    if (patientCount == 0 || doctorCount == 0) {
-        printf(YELLOW "?? Need at least one patient and one doctor to schedule.\n" RESET_COLOR);
-        return;
+    if (!shardCount) {
+        loadData(); // A router holds no data of its own
+        backlog.data = malloc(BACKLOG_BYTES);
     }
-    
-    printf(CYAN "\n--- Schedule New Appointment ---\n" RESET_COLOR);
-
-    int pid = get_int_from_user("Enter patient ID: ");
-    int did = get_int_from_user("Enter doctor ID: ");
+    streamEpoch = ((unsigned long long)time(NULL) << 20) ^ nowNanos();
+    if (!shareViews() || (!shardCount && !backlog.data)) {
+        fprintf(stderr, "hms: out of memory\n");
+        return 2;
+    }
+    if (workers > REPLICA_PIN) workers = REPLICA_PIN; // The last pins are the snapshot writers'
+    lastCheckpoint = nowNanos();
 
-    int pi = findPatientIndex(pid);
-    int di = findDoctorIndex(did);
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((unsigned short)port);
+    if (lfd < 0 || setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(lfd, 64) < 0 || pipe(wakeFds) < 0) {
+        fprintf(stderr, "hms: cannot listen on port %d: %s\n", port, strerror(errno));
+        return 2;
+    }
+    fcntl(lfd, F_SETFL, O_NONBLOCK);
+    fcntl(wakeFds[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakeFds[1], F_SETFL, O_NONBLOCK);
+    for (int i = 0; i < 2; i++) fcntl(wakeFds[i], F_SETFD, FD_CLOEXEC); // Not kept by a replica restarting itself
+    fcntl(lfd, F_SETFD, FD_CLOEXEC);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, serviceSignal);
+    signal(SIGTERM, serviceSignal);
 
-    if (pi == -1 || di == -1) { 
-        printf(YELLOW "? Invalid patient or doctor ID.\n" RESET_COLOR); 
-        return; 
+    pthread_t *pool = malloc((size_t)workers * sizeof(pthread_t));
+    int started = 0;
+    while (pool && started < workers && pthread_create(&pool[started], NULL, serviceWorker, (void*)(intptr_t)started) == 0) started++;
+    if (!started) {
+        fprintf(stderr, "hms: cannot start worker threads\n");
+        return 2;
+    }
+    pthread_t follower;
+    int following = replicaOf && pthread_create(&follower, NULL, replicaThread, NULL) == 0;
+    if (replicaOf && !following) {
+        fprintf(stderr, "hms: cannot start the replica thread\n");
+        return 2;
     }
+    if (shardCount) printf("Routing on port %d to %d site(s) with %d worker(s). Ctrl+C stops.\n", port, shardCount, started);
+    else printf("Serving on port %d with %d worker(s)%s. Ctrl+C saves and stops.\n", port, started,
+                replicaOf ? " as a read-only replica" : "");
+    fflush(stdout);
 
-    Appointment a;
-    a.id = nextAppointmentId++;
-    a.patientId = pid;
-    a.doctorId = did;
+    static Session *sessions[SERVICE_MAX_SESSIONS];
+    static struct pollfd fds[SERVICE_MAX_SESSIONS + 2];
+    int count = 0;
+    while (!serviceStopping) {
+        fds[0].fd = lfd;
+        fds[0].events = count < SERVICE_MAX_SESSIONS ? POLLIN : 0;
+        fds[1].fd = wakeFds[0];
+        fds[1].events = POLLIN;
+        pthread_mutex_lock(&serviceLock);
+        for (int i = 0; i < count; i++) {
+            Session *s = sessions[i];
+            fds[i + 2].fd = s->fd;
+            fds[i + 2].events = (s->closing || s->inLen == sizeof(s->in) ? 0 : POLLIN) |
+                                (s->out.len > s->sent ? POLLOUT : 0);
+        }
+        pthread_mutex_unlock(&serviceLock);
 
-    char temp[200];
-    getLine("Enter date (YYYY-MM-DD): ", a.date, sizeof(a.date));
-    getLine("Enter time (HH:MM): ", a.time, sizeof(a.time));
+        if (poll(fds, (nfds_t)count + 2, -1) < 0 && errno != EINTR) break;
 
-    appointments[appointmentCount++] = a;
+        if (fds[1].revents) {
+            char drain[64];
+            while (read(wakeFds[0], drain, sizeof(drain)) > 0) {}
+        }
+        pthread_mutex_lock(&serviceLock);
+        for (int i = 0; i < count; i++) {
+            Session *s = sessions[i];
+            short ev = fds[i + 2].revents;
+            if ((ev & (POLLIN | POLLHUP | POLLERR)) && !s->closing && !serviceRead(s)) s->closing = 1;
+            if (!serviceWrite(s)) { s->closing = 1; s->out.len = s->sent = 0; }
+            serviceDispatch(s);
+            if (s->closing && !s->busy && s->out.len == s->sent) {
+                close(s->fd);
+                obFree(&s->out);
+                free(s);
+                sessions[i--] = sessions[--count];
+                fds[i + 3] = fds[count + 2]; // Keep revents lined up with the moved session
+            }
+        }
+        pthread_mutex_unlock(&serviceLock);
 
-    // --- FIX ---
-    // If the patient doesn't have a primary doctor,
-    // assign the doctor from the appointment.
-    if (patients[pi].doctorId == 0) {
-        patients[pi].doctorId = did;
-        printf(CYAN "Note: %s has been set as the primary doctor for %s.\n" RESET_COLOR, doctors[di].name, patients[pi].name);
+        if (fds[0].revents & POLLIN) {
+            int cfd;
+            while (count < SERVICE_MAX_SESSIONS && (cfd = accept(lfd, NULL, NULL)) >= 0) {
+                Session *s = calloc(1, sizeof(Session));
+                if (!s) { close(cfd); break; }
+                fcntl(cfd, F_SETFL, O_NONBLOCK);
+                fcntl(cfd, F_SETFD, FD_CLOEXEC);
+                s->fd = cfd;
+                sessions[count++] = s;
+            }
+        }
     }
-    // --- END FIX ---
 
-    printf(GREEN "? Appointment scheduled (ID: %d) for patient %s with %s on %s %s\n" RESET_COLOR,
-           a.id, patients[pi].name, doctors[di].name, a.date, a.time);
+    pthread_mutex_lock(&serviceLock);
+    serviceStopping = 1;
+    pthread_cond_broadcast(&jobReady);
+    pthread_mutex_unlock(&serviceLock);
+    for (int i = 0; i < started; i++) pthread_join(pool[i], NULL); // Finishes queued requests first
+    free(pool);
+    if (following) pthread_join(follower, NULL);
+    pthread_cond_broadcast(&backlog.grew);
+    for (int i = 0; i < REPLICA_MAX; i++) if (feeds[i].used) pthread_join(feeds[i].thread, NULL);
+    for (int i = 0; i < count; i++) close(sessions[i]->fd);
+    close(lfd);
+    if (!shardCount) saveData();
+    return 0;
 }
 
-void displayAppointments() {
-    clear_screen();
-    if (appointmentCount == 0) {
-        printf(YELLOW "?? No appointments scheduled.\n" RESET_COLOR);
-        return;
-    }
-    printf("\n" MAGENTA "========== APPOINTMENTS ==========\n" RESET_COLOR);
-    for (int i = 0; i < appointmentCount; i++) {
-        int pid = appointments[i].patientId;
-        int did = appointments[i].doctorId;
-        char pname[100] = "Unknown";
-        char dname[100] = "Unknown";
-
-        int pi = findPatientIndex(pid);
-        int di = findDoctorIndex(did);
-        if (pi != -1) strncpy(pname, patients[pi].name, sizeof(pname)-1);
-        if (di != -1) strncpy(dname, doctors[di].name, sizeof(dname)-1);
-
-        printf(BLUE "Appointment ID: %d\n" RESET_COLOR, appointments[i].id);
-        printf("Patient: %s (ID: %d)\n", pname, pid);
-        printf("Doctor: %s (ID: %d)\n", dname, did);
-        printf("Date: %s\nTime: %s\n", appointments[i].date, appointments[i].time);
-        printf("----------------------------------\n");
-    }
+#else
+
+int runService(int port, int workers) {
+    (void)port;
+    (void)workers;
+    fprintf(stderr, "hms: service mode is not available on this platform\n");
+    return 2;
 }
 
-void cancelAppointment() {
-    clear_screen();
-    int id = get_int_from_user("\nEnter appointment ID to cancel: ");
-    if (id <= 0) { printf(RED "? Invalid ID.\n" RESET_COLOR); return; }
+#endif
 
-    int i = findAppointmentIndex(id);
-    if (i != -1) {
-        // *** BUG FIX ***: Used new getPatientName helper function
-        printf(YELLOW "Found appointment for %s. Are you sure? (y/n): " RESET_COLOR, getPatientName(appointments[i].patientId));
-        char confirm[10];
-        getLine("", confirm, sizeof(confirm));
+/* --------------------- MAIN --------------------- */
 
-        if (confirm[0] == 'y' || confirm[0] == 'Y') {
-            for (int j = i; j < appointmentCount - 1; j++) appointments[j] = appointments[j+1];
-            appointmentCount--;
-            printf(GREEN "? Appointment canceled.\n" RESET_COLOR);
+int main(int argc, char **argv) {
+    int servePort = 0, workers = SERVICE_DEFAULT_WORKERS;
+    ExportJob job = { -1, -1, 0, -1, -1, NULL };
+    mainArgv = argv;
+    if (getenv("NO_COLOR")) plainOutput = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--plain") == 0) {
+            plainOutput = 1;
+        } else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            pageSize = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            servePort = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--shard") == 0 && i + 1 < argc && addShard(argv[i + 1])) {
+            i++;
+        } else if (strcmp(argv[i], "--id-range") == 0 && i + 1 < argc &&
+                   sscanf(argv[i + 1], "%d-%d", &siteFirstId, &siteLastId) == 2 && siteFirstId > 0 && siteLastId >= siteFirstId) {
+            i++;
+        } else if (strcmp(argv[i], "--replica-of") == 0 && i + 1 < argc && strrchr(argv[i + 1], ':')) {
+            replicaOf = argv[++i];
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            metricsOn = 1;
+        } else if (strcmp(argv[i], "--autosave") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            autosaveSeconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--autosave-changes") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            autosaveChanges = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--generations") == 0 && i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) {
+            snapshotGenerations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--keep-days") == 0 && i + 1 < argc &&
+                   (isdigit((unsigned char)argv[i + 1][0]) || strcmp(argv[i + 1], "all") == 0)) {
+            i++;
+            archiveKeepDays = strcmp(argv[i], "all") == 0 ? -1 : atoi(argv[i]);
+        } else if (strcmp(argv[i], "--auto-assign") == 0) {
+            autoAssign = 1;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            packSnapshots = 1;
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc && exportFormatNamed(argv[i + 1]) >= 0) {
+            job.format = exportFormatNamed(argv[++i]);
+        } else if (strcmp(argv[i], "--doctor") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            job.doctorId = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--from") == 0 && i + 1 < argc && parseDate(argv[i + 1]) >= 0) {
+            job.fromDay = parseDate(argv[++i]);
+        } else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc && parseDate(argv[i + 1]) >= 0) {
+            job.toDay = parseDate(argv[++i]);
+        } else if (strcmp(argv[i], "--export") == 0 && i + 3 == argc && exportTableNamed(argv[i + 1]) >= 0) {
+            job.table = exportTableNamed(argv[++i]);
+            job.path = argv[++i];
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 2 >= argc) {
+            return runBench(i + 1 < argc ? argv[i + 1] : NULL);
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 2 >= argc) {
+            return runBatch(i + 1 < argc ? argv[i + 1] : NULL);
         } else {
-            printf(CYAN "Canceled.\n" RESET_COLOR);
+            fprintf(stderr, "usage: %s [--plain] [--page-size N] [--compress] [--metrics] [--auto-assign]\n"
+                    "       [--autosave SECONDS] [--autosave-changes N] [--generations N] [--keep-days N|all] [--id-range LO-HI]\n"
+                    "       [--batch [FILE] | --serve PORT [--workers N] [--replica-of HOST:PORT | --shard NAME=LO-HI@HOST:PORT ...] |\n"
+                    "       --bench [SIZES] |\n"
+                    "       [--format csv|jsonl|columns] [--doctor ID] [--from DATE] [--to DATE] --export patients|appointments FILE]\n", argv[0]);
+            return 2;
         }
-        return;
     }
-    printf(YELLOW "? No appointment found with ID %d.\n" RESET_COLOR, id);
-}
-
-/* --------------------- MENU / UI --------------------- */
-
-void display_menu() {
-    clear_screen();
-    printf(CYAN "============================================\n" RESET_COLOR);
-    printf(CYAN "    Professional Hospital Management System\n" RESET_COLOR);
-    printf(CYAN "============================================\n\n" RESET_COLOR);
-
-    printf(YELLOW "Patient Management\n" RESET_COLOR);
-    printf(BLUE " 1." RESET_COLOR " Add Patient (Full Intake)\n");
-    printf(BLUE " 2." RESET_COLOR " View All Patients\n");
-    printf(BLUE " 3." RESET_COLOR " Search Patient by ID\n");
-    printf(BLUE " 4." RESET_COLOR " Search Patient by Name\n");
-    printf(BLUE " 5." RESET_COLOR " Delete Patient\n");
-    printf(BLUE " 6." RESET_COLOR " Sort Patients by Name\n");
-    
-    printf(YELLOW "\nStaff & Reference\n" RESET_COLOR);
-    printf(BLUE " 7." RESET_COLOR " Add Doctor\n");
-    printf(BLUE " 8." RESET_COLOR " View Doctors\n");
-    printf(BLUE " 9." RESET_COLOR " Add Disease (Reference)\n");
-    printf(BLUE " 10." RESET_COLOR " View Diseases (Reference)\n");
-    
-    printf(YELLOW "\nScheduling\n" RESET_COLOR);
-    printf(BLUE " 11." RESET_COLOR " Schedule Appointment\n");
-    printf(BLUE " 12." RESET_COLOR " View Appointments\n");
-    printf(BLUE " 13." RESET_COLOR " Cancel Appointment\n");
-
-    printf(YELLOW "\nSystem\n" RESET_COLOR);
-    printf(BLUE " 14." RESET_COLOR " Save Data Now\n");
-    printf(BLUE " 15." RESET_COLOR " Exit\n");
-}
-
-/* --------------------- MAIN --------------------- */
+    if (job.path) {
+        if (exportTables[job.table].table != &appointmentTable && (job.fromDay >= 0 || job.toDay >= 0)) {
+            fprintf(stderr, "hms: --from and --to apply to appointments\n");
+            return 2;
+        }
+        return runExport(&job);
+    }
+    if ((replicaOf || shardCount) && !servePort) {
+        fprintf(stderr, "hms: --replica-of and --shard need --serve PORT\n");
+        return 2;
+    }
+    if (replicaOf && shardCount) {
+        fprintf(stderr, "hms: a router is not a replica\n");
+        return 2;
+    }
+    if (servePort) return runService(servePort, workers);
 
-int main() {
     loadData(); // Load data on start
+    if ((autosaveSeconds || autosaveChanges) && !shareViews()) {
+        printf(RED "? Error: Out of memory. Autosave is off.\n" RESET_COLOR);
+        autosaveSeconds = autosaveChanges = 0;
+    }
+    lastCheckpoint = nowNanos();
     
     int running = 1;
     while (running) {
@@ -671,8 +8006,11 @@ int main() {
             case 11: addAppointment(); break;
             case 12: displayAppointments(); break;
             case 13: cancelAppointment(); break;
-            case 14: saveData(); break;
-            case 15:
+            case 14: viewDoctorSchedule(); break;
+            case 15: saveData(); break;
+            case 16: viewReports(); break;
+            case 17: viewStatistics(); break;
+            case 18:
                 saveData(); // Auto-save on exit
                 printf(MAGENTA "?? Exiting. Goodbye!\n" RESET_COLOR);
                 running = 0;
@@ -681,7 +8019,11 @@ int main() {
                 printf(RED "?? Invalid choice. Try again.\n" RESET_COLOR);
         }
 
-        if (running && choice != 15) {
+        if (running) archiveClosedDays(); // Closed days move out after the first operation
+        maintainStores(); // Compact between operations, not inside them
+        autosavePoll();
+
+        if (running && choice != 18) {
             printf("\nPress Enter to return to menu...");
             getchar(); // Wait for user
         }